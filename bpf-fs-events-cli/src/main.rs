@@ -1,7 +1,15 @@
 use bpf_fs_events_sock::Client;
+use bpf_fs_events_sock::Message;
 use bpf_fs_events_sock::Server;
 use clap::Parser;
 
+mod sink;
+
+const RECONNECT_INTERVAL: std::time::Duration = std::time::Duration::from_millis(250);
+
+// Stdio: how long to wait on the kernel once we've flushed everything out
+const STDIO_POLL_TIMEOUT: std::time::Duration = std::time::Duration::from_millis(100);
+
 const SOCK_PATH_DEFAULT: &str = concat!(
     "/var/run/fs-events.v",
     env!("CARGO_PKG_VERSION_MAJOR"),
@@ -17,6 +25,25 @@ enum Role {
     Stdio,
 }
 
+#[derive(Copy, Clone, PartialEq, Eq, clap::ValueEnum)]
+enum Effect {
+    Create,
+    Rename,
+    Link,
+    Delete,
+}
+
+impl From<Effect> for bpf_fs_events::EffectType {
+    fn from(effect: Effect) -> Self {
+        match effect {
+            Effect::Create => bpf_fs_events::EffectType::Create,
+            Effect::Rename => bpf_fs_events::EffectType::Rename,
+            Effect::Link => bpf_fs_events::EffectType::Link,
+            Effect::Delete => bpf_fs_events::EffectType::Delete,
+        }
+    }
+}
+
 #[derive(clap::Parser)]
 #[command(name = "bpf-fs-events")]
 struct Cli {
@@ -24,80 +51,396 @@ struct Cli {
     sockpath: String,
     #[arg(value_enum, short, long, default_value = "stdio")]
     role: Role,
+    /// Stdio, client: how to write events to stdout. Clients ask for front-coded
+    /// paths for formats other than text, as those need the events' fields.
+    #[arg(value_enum, short, long, default_value = "text")]
+    format: sink::Format,
+    /// Server: how many recent events to keep for clients resuming after a reconnect
+    #[arg(long, default_value_t = bpf_fs_events_sock::HISTORY_LEN_DEFAULT)]
+    history_len: usize,
+    /// Client: keep trying to reconnect (and resume) when the server goes away
+    #[arg(long)]
+    reconnect: bool,
+    /// Client: ask the server to front-code paths, which is much smaller on the wire.
+    /// Implied by any --format other than text.
+    #[arg(long)]
+    front_coded: bool,
+    /// Server: pin the probes and event buffer in a bpffs, so that they stay attached, and keep
+    /// collecting events, while a new server takes over from this one
+    #[arg(long, num_args = 0..=1, default_missing_value = bpf_fs_events::PIN_DIR_DEFAULT)]
+    pin_dir: Option<std::path::PathBuf>,
+    /// Server, stdio: share one set of probes with every other server or stdio on this host
+    /// which passes this too, rather than attaching our own. Pinned in --pin-dir, if given.
+    #[arg(long)]
+    shared: bool,
+    /// Server, stdio: only watch for these effects, leaving the other probes detached.
+    /// Comma-separated. All of them, if not given.
+    #[arg(value_enum, long, value_delimiter = ',')]
+    effects: Vec<Effect>,
+    /// Server, stdio: only watch processes in this cgroup (v2) directory, or below it.
+    /// Can be given more than once.
+    #[arg(long)]
+    cgroup: Vec<std::path::PathBuf>,
+    /// Server, stdio: only watch processes in this mount namespace, like /proc/<pid>/ns/mnt.
+    /// Can be given more than once.
+    #[arg(long)]
+    mount_ns: Vec<std::path::PathBuf>,
+    /// Server, stdio: only watch this process and its descendants, including those
+    /// it forks later. Can be given more than once. Needs a 5.11+ kernel.
+    #[arg(long)]
+    process_tree: Vec<u32>,
+    /// Server, stdio: paths from each process's own root, as a container sees them
+    #[arg(long)]
+    relative_paths: bool,
+    /// Server, stdio: only watch these filesystems: mount points, types like ext4,
+    /// or superblock magic numbers in hex. Comma-separated.
+    #[arg(long, value_delimiter = ',', conflicts_with = "fs_except")]
+    fs_only: Vec<bpf_fs_events::Filesystem>,
+    /// Server, stdio: skip these filesystems, like tmpfs,proc,/mnt/backup, where
+    /// something is mounted at /mnt/backup. Comma-separated.
+    #[arg(long, value_delimiter = ',')]
+    fs_except: Vec<bpf_fs_events::Filesystem>,
+    /// Server, stdio: skip paths with any component named one of these, like .git. Comma-separated.
+    #[arg(long, value_delimiter = ',')]
+    ignore_name: Vec<String>,
+    /// Server, stdio: skip paths ending in one of these, like .swp. Comma-separated.
+    #[arg(long, value_delimiter = ',')]
+    ignore_suffix: Vec<String>,
+    /// Server, stdio: skip version control, build output and editor swap files,
+    /// as well as anything given to --ignore-name and --ignore-suffix
+    #[arg(long)]
+    ignore_common: bool,
+    /// Stdio: first list everything under this path, as creations, then carry on
+    /// with the events since. Can be given more than once.
+    #[arg(long)]
+    snapshot: Vec<std::path::PathBuf>,
+    /// Stdio: crawl with this many threads for --snapshot, or one per CPU
+    #[arg(long, requires = "snapshot")]
+    snapshot_threads: Option<usize>,
+    /// Server: serve Prometheus metrics over HTTP, on a loopback address like 127.0.0.1:9464,
+    /// or a Unix socket like unix:/run/fs-events-metrics.sock
+    #[arg(long)]
+    metrics_listen: Option<String>,
+    /// Server, stdio: at most this many MiB of events buffered in the process, in every queue.
+    /// Past it, events are dropped, and clients are told to resync.
+    #[arg(long)]
+    memory_budget_mib: Option<usize>,
+    /// Server: run as a pipeline, with a thread reading from the kernel, this many
+    /// serializing events, and one writing to clients, rather than all on one thread
+    #[arg(long)]
+    pipeline_workers: Option<usize>,
+    /// Server: pin the pipeline's reader thread to this CPU
+    #[arg(long, requires = "pipeline_workers")]
+    reader_cpu: Option<usize>,
+    /// Server: pin the pipeline's workers to these CPUs, in turn. Comma-separated.
+    #[arg(long, value_delimiter = ',', requires = "pipeline_workers")]
+    worker_cpus: Vec<usize>,
+    /// Server: pin the pipeline's fanout thread to this CPU
+    #[arg(long, requires = "pipeline_workers")]
+    fanout_cpu: Option<usize>,
+    /// Server, stdio: print how long events spend in each stage, and how busy
+    /// the pipeline's threads are, if there is one, to stderr, every so many seconds
+    #[arg(long)]
+    latency_interval: Option<u64>,
+    /// Server, stdio: have the kernel time our BPF programs, and print their run counts, run times
+    /// and path walk histograms, to stderr, every so many seconds
+    #[arg(long)]
+    bpf_stats_interval: Option<u64>,
 }
 
-fn event_to_string(event: bpf_fs_events::Event) -> String {
-    use bpf_fs_events::EffectType;
-    use bpf_fs_events::PathType;
-    let et = match event.effect_type {
-        EffectType::Create => "create",
-        EffectType::Rename => "rename",
-        EffectType::Link => "link",
-        EffectType::Delete => "delete",
-        EffectType::Continuation => "unexpected:cont",
-        EffectType::Association => "unexpected:assoc",
-    };
-    let pt = match event.path_type {
-        PathType::Dir => "dir",
-        PathType::File => "file",
-        PathType::Symlink => "symlink",
-        PathType::Hardlink => "hardlink",
-        PathType::Blockdev => "blockdev",
-        PathType::Socket => "socket",
-        PathType::Continuation => "unexpected:cont",
-        PathType::Unknown => "unexpected:unknown",
-    };
-    let ts = event.timestamp;
-    let pid = event.pid;
-    let pn = event.path_name;
-    if let Some(associated) = event.associated {
-        format!("@ {ts} {et} {pt} pid:{pid}\n> {pn}\n> {associated}")
-    } else {
-        format!("@ {ts} {et} {pt} pid:{pid}\n> {pn}")
+/// For the reports printed every so often
+struct Every {
+    interval: std::time::Duration,
+    last: std::time::Instant,
+}
+
+impl Every {
+    fn secs(secs: Option<u64>) -> Option<Self> {
+        secs.map(|secs| Self {
+            interval: std::time::Duration::from_secs(secs),
+            last: std::time::Instant::now(),
+        })
+    }
+
+    fn due(this: &mut Option<Self>) -> bool {
+        match this {
+            Some(every) if every.last.elapsed() >= every.interval => {
+                every.last = std::time::Instant::now();
+                true
+            }
+            _ => false,
+        }
+    }
+}
+
+fn event_to_bytes(event: &bpf_fs_events::Event) -> Vec<u8> {
+    let mut out = Vec::with_capacity(512);
+    sink::push_text(&mut out, &event.into());
+    out
+}
+
+/// Someone reading our output, like `head`, going away is a normal way to stop.
+fn done_writing(result: Result<(), std::io::Error>) -> Result<bool, std::io::Error> {
+    match result {
+        Ok(_) => Ok(false),
+        Err(e) if e.kind() == std::io::ErrorKind::BrokenPipe => Ok(true),
+        Err(e) => Err(e),
     }
 }
 
-fn event_to_bytes(event: bpf_fs_events::Event) -> Vec<u8> {
-    event_to_string(event).into_bytes()
+fn print_latencies(stages: &[(&str, &bpf_fs_events::HistogramSnapshot)]) {
+    let us = |ns: u64| ns as f64 / 1e3;
+    for (stage, h) in stages {
+        eprintln!(
+            "latency {stage}: n={} p50={:.1}us p99={:.1}us p99.9={:.1}us max={:.1}us",
+            h.count,
+            us(h.value_at_quantile(0.5)),
+            us(h.value_at_quantile(0.99)),
+            us(h.value_at_quantile(0.999)),
+            us(h.max),
+        );
+    }
+}
+
+fn print_bpf_stats(watcher: &bpf_fs_events::FsEvents) {
+    use bpf_fs_events::KernelHistogram;
+    match watcher.prog_stats() {
+        Ok(progs) => {
+            for prog in progs {
+                eprintln!(
+                    "bpf {}: runs={} run_time={}ns per_run={}ns recursion_misses={}",
+                    prog.name,
+                    prog.run_cnt,
+                    prog.run_time_ns,
+                    prog.ns_per_run(),
+                    prog.recursion_misses,
+                );
+            }
+        }
+        Err(e) => eprintln!("error reading bpf program stats: {e}"),
+    }
+    for which in KernelHistogram::ALL {
+        match watcher.kernel_histogram(which) {
+            Ok(slots) => {
+                let mut line = format!("bpf {}:", which.name());
+                for (slot, count) in slots.iter().enumerate().filter(|(_, n)| **n > 0) {
+                    let le = KernelHistogram::slot_upper_bound(slot);
+                    line += &format!(" le{le}={count}");
+                }
+                eprintln!("{line}");
+            }
+            Err(e) => eprintln!("error reading {} histogram: {e:?}", which.name()),
+        }
+    }
 }
 
 fn main() -> Result<(), Box<dyn std::error::Error>> {
     env_logger::init();
     let args = Cli::parse();
+    let mut ignore = match args.ignore_common {
+        true => bpf_fs_events::IgnoreRules::common(),
+        false => bpf_fs_events::IgnoreRules::default(),
+    };
+    ignore.names.extend(args.ignore_name.iter().cloned());
+    ignore.suffixes.extend(args.ignore_suffix.iter().cloned());
+    let opts = bpf_fs_events::Options {
+        pin_dir: args.pin_dir.clone(),
+        shared: args.shared,
+        effects: match args.effects.is_empty() {
+            true => bpf_fs_events::EffectMask::ALL,
+            false => args.effects.iter().map(|e| (*e).into()).collect(),
+        },
+        scope: bpf_fs_events::Scope {
+            cgroups: args.cgroup.clone(),
+            mount_namespaces: args.mount_ns.clone(),
+            process_trees: args.process_tree.clone(),
+            relative_paths: args.relative_paths,
+        },
+        filesystems: match (args.fs_only.is_empty(), args.fs_except.is_empty()) {
+            (false, _) => bpf_fs_events::FsFilter::Only(args.fs_only.clone()),
+            (_, false) => bpf_fs_events::FsFilter::Except(args.fs_except.clone()),
+            _ => bpf_fs_events::FsFilter::All,
+        },
+        ignore,
+        process_cache: false,
+        memory_budget: args
+            .memory_budget_mib
+            .map(|mib| std::sync::Arc::new(bpf_fs_events::MemoryBudget::new(mib << 20))),
+    };
     match args.role {
         Role::Server => {
-            let mut server = Server::try_new(args.sockpath.as_str(), event_to_bytes)?;
-            loop {
+            let mut server = Server::try_new_with(args.sockpath.as_str(), event_to_bytes, &opts)?
+                .with_history_len(args.history_len);
+            if let Some(listen) = &args.metrics_listen {
+                server = server.with_metrics_endpoint(listen)?;
+            }
+            if let Some(workers) = args.pipeline_workers {
+                server = server.with_pipeline(bpf_fs_events_sock::PipelineOptions {
+                    workers,
+                    reader_cpu: args.reader_cpu,
+                    worker_cpus: args.worker_cpus.clone(),
+                    fanout_cpu: args.fanout_cpu,
+                    ..Default::default()
+                });
+            }
+            if args.bpf_stats_interval.is_some() {
+                server = server.with_prog_stats()?;
+            }
+            let mut latency_report = Every::secs(args.latency_interval);
+            let mut bpf_stats_report = Every::secs(args.bpf_stats_interval);
+            while !server.handed_over() {
+                if Every::due(&mut latency_report) {
+                    print_latencies(&server.stage_latencies().stages());
+                    for (stage, utilization) in server.stage_utilization() {
+                        eprintln!("utilization {stage}: {:.1}%", utilization * 100.0);
+                    }
+                }
+                if Every::due(&mut bpf_stats_report) {
+                    print_bpf_stats(server.watcher());
+                }
                 match server.try_send_fs_events_blocking() {
                     Ok(_) => (),
                     Err(e) => return Err(Box::new(std::io::Error::new(e, "server"))),
                 }
             }
+            Ok(())
         }
         Role::Client => {
-            let mut client = Client::try_new(args.sockpath.as_str())?;
+            // Text lines are written as the server sent them; the rest need the fields
+            let front_coded = args.front_coded || args.format != sink::Format::Text;
+            let encoding = match front_coded {
+                true => bpf_fs_events_sock::Encoding::FrontCoded,
+                false => bpf_fs_events_sock::Encoding::Serialized,
+            };
+            let mut client = Client::try_new_with_encoding(args.sockpath.as_str(), encoding)?;
+            let mut sink = sink::Sink::stdout(args.format);
             loop {
-                match client.try_read() {
-                    Ok(msg) => println!("{msg}"),
+                // Our reads block, so we can't tell when we're idle. Flushing every event.
+                let written = match client.try_read() {
+                    Ok(Message::Event(msg)) => sink.write_line(msg.as_bytes()),
+                    Ok(Message::CodedEvent(event)) => sink.write(&event.into()),
+                    Ok(Message::ResyncRequired) => {
+                        log::warn!(
+                            "events were missed, resync required at seq {}",
+                            client.last_seq()
+                        );
+                        continue;
+                    }
                     Err(std::io::ErrorKind::WouldBlock) => continue,
+                    Err(std::io::ErrorKind::ConnectionReset) if args.reconnect => {
+                        log::info!("connection reset, resuming after seq {}", client.last_seq());
+                        while let Err(e) = client.try_reconnect() {
+                            log::debug!("reconnect failed: {e}");
+                            std::thread::sleep(RECONNECT_INTERVAL);
+                        }
+                        continue;
+                    }
                     Err(std::io::ErrorKind::ConnectionReset) => {
                         log::info!("connection reset");
                         return Ok(());
                     }
                     Err(e) => return Err(Box::new(std::io::Error::new(e, "client"))),
+                };
+                if done_writing(written.and_then(|_| sink.flush()))? {
+                    return Ok(());
                 }
             }
         }
         Role::Stdio => {
-            ctrlc::set_handler(|| std::process::exit(0))?;
-            let watcher = bpf_fs_events::FsEvents::try_new()?;
-            loop {
-                match watcher.poll_indefinite() {
+            let stop = std::sync::Arc::new(std::sync::atomic::AtomicBool::new(false));
+            let stop_on_signal = stop.clone();
+            ctrlc::set_handler(move || {
+                stop_on_signal.store(true, std::sync::atomic::Ordering::Relaxed)
+            })?;
+            // Only shared probes are pinned here, since they clean up after themselves
+            let opts = bpf_fs_events::Options {
+                pin_dir: opts.pin_dir.filter(|_| opts.shared),
+                ..opts
+            };
+            let mut watcher = bpf_fs_events::FsEvents::try_new_with(&opts)?;
+            if args.bpf_stats_interval.is_some() {
+                watcher.enable_prog_stats()?;
+            }
+            let mut sink = sink::Sink::stdout(args.format);
+            if !args.snapshot.is_empty() {
+                let mut snapshot_opts = bpf_fs_events::SnapshotOptions {
+                    roots: args.snapshot.clone(),
+                    ..Default::default()
+                };
+                if let Some(threads) = args.snapshot_threads {
+                    snapshot_opts.threads = threads;
+                }
+                let snapshot = watcher.snapshot(&snapshot_opts)?;
+                if snapshot.errors > 0 {
+                    log::warn!(
+                        "{} paths couldn't be read for the snapshot",
+                        snapshot.errors
+                    );
+                }
+                for (path, entry) in &snapshot.entries {
+                    let record = sink::Record {
+                        timestamp: snapshot.taken_at,
+                        pid: 0,
+                        effect_type: bpf_fs_events::EffectType::Create,
+                        path_type: entry.path_type,
+                        path_name: path,
+                        associated: None,
+                    };
+                    if done_writing(sink.write(&record))? {
+                        return Ok(());
+                    }
+                }
+                for event in &snapshot.events {
+                    if done_writing(sink.write(&event.into()))? {
+                        return Ok(());
+                    }
+                }
+            }
+            let mut latency_report = Every::secs(args.latency_interval);
+            let mut bpf_stats_report = Every::secs(args.bpf_stats_interval);
+            while !stop.load(std::sync::atomic::Ordering::Relaxed) {
+                if Every::due(&mut latency_report) {
+                    let metrics = watcher.metrics();
+                    print_latencies(&[
+                        (
+                            "kernel_to_callback",
+                            &metrics.kernel_to_callback_ns.snapshot(),
+                        ),
+                        (
+                            "callback_to_dequeue",
+                            &metrics.callback_to_dequeue_ns.snapshot(),
+                        ),
+                    ]);
+                }
+                if Every::due(&mut bpf_stats_report) {
+                    print_bpf_stats(&watcher);
+                }
+                // Events are written out in batches, whenever the kernel runs dry.
+                // Their paths go back to the watcher's pool once they're written.
+                let polled = match watcher.poll_pooled_immediate() {
+                    Ok(None) => match done_writing(sink.flush())? {
+                        true => return Ok(()),
+                        false => watcher.poll_pooled_with_timeout(STDIO_POLL_TIMEOUT),
+                    },
+                    polled => polled,
+                };
+                match polled {
+                    // Likely interrupted by the signal we're stopping for
+                    Err(_) if stop.load(std::sync::atomic::Ordering::Relaxed) => break,
                     Err(e) => return Err(format!("{:?}", e).into()),
-                    Ok(Some(event)) => println!("{}", event_to_string(event)),
+                    Ok(Some(event)) => {
+                        let shed = watcher.take_gap();
+                        if shed > 0 {
+                            log::warn!("{shed} events were dropped for the memory budget");
+                        }
+                        if done_writing(sink.write(&(&*event).into()))? {
+                            return Ok(());
+                        }
+                    }
                     Ok(None) => (),
                 }
             }
+            Ok(())
         }
     }
 }
@@ -0,0 +1,250 @@
+use bpf_fs_events::EffectType;
+use bpf_fs_events::PathType;
+use std::io::Write;
+
+// Written out once this much has built up, or whenever we're idle
+const FLUSH_AT: usize = 64 << 10;
+
+#[derive(Copy, Clone, PartialEq, Eq, clap::ValueEnum)]
+pub enum Format {
+    /// What we've always printed: a header line, then a line for each path
+    Text,
+    /// A JSON object per line
+    Jsonl,
+    /// Six NUL-terminated fields per event: timestamp, effect, path type, pid,
+    /// path, and associated path (empty if there isn't one)
+    Nul,
+    /// Little-endian, for programs:
+    ///   [u64 timestamp][u32 pid][u8 effect][u8 path type][u8 has associated][u8 0]
+    ///   [u32 path len][u32 associated len][path][associated]
+    Binary,
+}
+
+/// The parts of an event we print, borrowed from wherever the event came from.
+pub struct Record<'a> {
+    pub timestamp: u64,
+    pub pid: u32,
+    pub effect_type: EffectType,
+    pub path_type: PathType,
+    pub path_name: &'a str,
+    pub associated: Option<&'a str>,
+}
+
+impl<'a> From<&'a bpf_fs_events::Event> for Record<'a> {
+    fn from(event: &'a bpf_fs_events::Event) -> Self {
+        Self {
+            timestamp: event.timestamp,
+            pid: event.pid,
+            effect_type: event.effect_type,
+            path_type: event.path_type,
+            path_name: &event.path_name,
+            associated: event.associated.as_deref(),
+        }
+    }
+}
+
+impl<'a> From<&'a bpf_fs_events_sock::EventView> for Record<'a> {
+    fn from(event: &'a bpf_fs_events_sock::EventView) -> Self {
+        Self {
+            timestamp: event.timestamp,
+            pid: event.pid,
+            effect_type: event.effect_type,
+            path_type: event.path_type,
+            path_name: event.path_name(),
+            associated: event.associated(),
+        }
+    }
+}
+
+fn effect_name(effect_type: EffectType) -> &'static str {
+    match effect_type {
+        EffectType::Create => "create",
+        EffectType::Rename => "rename",
+        EffectType::Link => "link",
+        EffectType::Delete => "delete",
+        EffectType::Continuation => "unexpected:cont",
+        EffectType::Association => "unexpected:assoc",
+    }
+}
+
+fn path_type_name(path_type: PathType) -> &'static str {
+    match path_type {
+        PathType::Dir => "dir",
+        PathType::File => "file",
+        PathType::Symlink => "symlink",
+        PathType::Hardlink => "hardlink",
+        PathType::Blockdev => "blockdev",
+        PathType::Socket => "socket",
+        PathType::Continuation => "unexpected:cont",
+        PathType::Unknown => "unexpected:unknown",
+    }
+}
+
+/// Decimal digits, without going through the formatting machinery.
+fn push_u64(out: &mut Vec<u8>, mut n: u64) {
+    let mut digits = [0u8; 20];
+    let mut at = digits.len();
+    loop {
+        at -= 1;
+        digits[at] = b'0' + (n % 10) as u8;
+        n /= 10;
+        if n == 0 {
+            break;
+        }
+    }
+    out.extend_from_slice(&digits[at..]);
+}
+
+fn push_json_str(out: &mut Vec<u8>, s: &str) {
+    const HEX: &[u8; 16] = b"0123456789abcdef";
+    out.push(b'"');
+    // Runs of bytes which need no escaping are copied in one go
+    let mut run = 0;
+    for (idx, &b) in s.as_bytes().iter().enumerate() {
+        let escaped: &[u8] = match b {
+            b'"' => b"\\\"",
+            b'\\' => b"\\\\",
+            b'\n' => b"\\n",
+            b'\t' => b"\\t",
+            0..=0x1f => &[
+                b'\\',
+                b'u',
+                b'0',
+                b'0',
+                HEX[(b >> 4) as usize],
+                HEX[(b & 0xf) as usize],
+            ],
+            _ => continue,
+        };
+        out.extend_from_slice(&s.as_bytes()[run..idx]);
+        out.extend_from_slice(escaped);
+        run = idx + 1;
+    }
+    out.extend_from_slice(&s.as_bytes()[run..]);
+    out.push(b'"');
+}
+
+/// The text format, which is also what the server sends its clients.
+pub fn push_text(out: &mut Vec<u8>, r: &Record) {
+    out.extend_from_slice(b"@ ");
+    push_u64(out, r.timestamp);
+    out.push(b' ');
+    out.extend_from_slice(effect_name(r.effect_type).as_bytes());
+    out.push(b' ');
+    out.extend_from_slice(path_type_name(r.path_type).as_bytes());
+    out.extend_from_slice(b" pid:");
+    push_u64(out, r.pid as u64);
+    out.extend_from_slice(b"\n> ");
+    out.extend_from_slice(r.path_name.as_bytes());
+    if let Some(associated) = r.associated {
+        out.extend_from_slice(b"\n> ");
+        out.extend_from_slice(associated.as_bytes());
+    }
+}
+
+fn push_jsonl(out: &mut Vec<u8>, r: &Record) {
+    out.extend_from_slice(b"{\"timestamp\":");
+    push_u64(out, r.timestamp);
+    out.extend_from_slice(b",\"effect\":\"");
+    out.extend_from_slice(effect_name(r.effect_type).as_bytes());
+    out.extend_from_slice(b"\",\"path_type\":\"");
+    out.extend_from_slice(path_type_name(r.path_type).as_bytes());
+    out.extend_from_slice(b"\",\"pid\":");
+    push_u64(out, r.pid as u64);
+    out.extend_from_slice(b",\"path\":");
+    push_json_str(out, r.path_name);
+    if let Some(associated) = r.associated {
+        out.extend_from_slice(b",\"associated\":");
+        push_json_str(out, associated);
+    }
+    out.extend_from_slice(b"}\n");
+}
+
+fn push_nul(out: &mut Vec<u8>, r: &Record) {
+    push_u64(out, r.timestamp);
+    out.push(0);
+    out.extend_from_slice(effect_name(r.effect_type).as_bytes());
+    out.push(0);
+    out.extend_from_slice(path_type_name(r.path_type).as_bytes());
+    out.push(0);
+    push_u64(out, r.pid as u64);
+    out.push(0);
+    out.extend_from_slice(r.path_name.as_bytes());
+    out.push(0);
+    out.extend_from_slice(r.associated.unwrap_or("").as_bytes());
+    out.push(0);
+}
+
+fn push_binary(out: &mut Vec<u8>, r: &Record) {
+    let associated = r.associated.unwrap_or("");
+    out.extend_from_slice(&r.timestamp.to_le_bytes());
+    out.extend_from_slice(&r.pid.to_le_bytes());
+    out.push(r.effect_type.into());
+    out.push(r.path_type.into());
+    out.push(r.associated.is_some() as u8);
+    out.push(0);
+    out.extend_from_slice(&(r.path_name.len() as u32).to_le_bytes());
+    out.extend_from_slice(&(associated.len() as u32).to_le_bytes());
+    out.extend_from_slice(r.path_name.as_bytes());
+    out.extend_from_slice(associated.as_bytes());
+}
+
+/// Buffers events for stdout, which stays locked for as long as we're around.
+/// The buffer is reused, and the serializers push straight into it,
+/// so once it has grown to `FLUSH_AT` nothing is allocated per event.
+pub struct Sink {
+    format: Format,
+    out: std::io::StdoutLock<'static>,
+    buf: Vec<u8>,
+}
+
+impl Sink {
+    pub fn stdout(format: Format) -> Self {
+        Self {
+            format,
+            out: std::io::stdout().lock(),
+            buf: Vec::with_capacity(FLUSH_AT * 2),
+        }
+    }
+
+    pub fn write(&mut self, r: &Record) -> Result<(), std::io::Error> {
+        match self.format {
+            Format::Text => {
+                push_text(&mut self.buf, r);
+                self.buf.push(b'\n');
+            }
+            Format::Jsonl => push_jsonl(&mut self.buf, r),
+            Format::Nul => push_nul(&mut self.buf, r),
+            Format::Binary => push_binary(&mut self.buf, r),
+        }
+        self.flush_if_full()
+    }
+
+    /// For lines which were serialized elsewhere, like those from the server.
+    pub fn write_line(&mut self, line: &[u8]) -> Result<(), std::io::Error> {
+        self.buf.extend_from_slice(line);
+        self.buf.push(b'\n');
+        self.flush_if_full()
+    }
+
+    fn flush_if_full(&mut self) -> Result<(), std::io::Error> {
+        match self.buf.len() >= FLUSH_AT {
+            true => self.flush(),
+            false => Ok(()),
+        }
+    }
+
+    pub fn flush(&mut self) -> Result<(), std::io::Error> {
+        if !self.buf.is_empty() {
+            self.out.write_all(&self.buf)?;
+            self.buf.clear();
+        }
+        self.out.flush()
+    }
+}
+
+impl Drop for Sink {
+    fn drop(&mut self) {
+        let _ = self.flush();
+    }
+}
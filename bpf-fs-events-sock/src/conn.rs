@@ -0,0 +1,152 @@
+use crate::frame::Encoding;
+use crate::front_coding::FrontEncoder;
+use crate::metrics::ClientMetrics;
+use crate::metrics::ServerMetrics;
+use bpf_fs_events::MemoryBudget;
+use std::collections::VecDeque;
+use std::io::Write;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+
+/// How much may be waiting to be written to one client before we
+/// stop queueing for it. A client that far behind is told to resync
+/// once it has caught up with what's already queued.
+pub const CLIENT_QUEUE_BYTES_MAX: usize = 8 << 20;
+
+/// A client connection. Writes don't block: frames are queued here and
+/// written out as the socket has room, so one slow client can't hold up
+/// the others (or the kernel's event buffer behind them).
+pub(crate) struct Conn {
+    stream: std::os::unix::net::UnixStream,
+    // Only for connections which asked for front-coded events
+    pub(crate) front_encoder: Option<FrontEncoder>,
+    // Frames are shared between connections when their encoding is.
+    // The front frame may have been partly written already.
+    // Each is kept with when it was queued, to time how long it waits.
+    queue: VecDeque<(Arc<Vec<u8>>, std::time::Instant)>,
+    written: usize,
+    queued_bytes: usize,
+    // Set when frames were dropped for this client
+    lagging: bool,
+    // Charged for what's queued, counting shared frames for each connection
+    budget: Option<Arc<MemoryBudget>>,
+    pub(crate) metrics: Arc<ClientMetrics>,
+}
+
+impl Drop for Conn {
+    fn drop(&mut self) {
+        if let Some(budget) = &self.budget {
+            budget.release(self.queued_bytes);
+        }
+    }
+}
+
+impl Conn {
+    pub(crate) fn try_new(
+        stream: std::os::unix::net::UnixStream,
+        encoding: Encoding,
+        id: u64,
+        budget: Option<Arc<MemoryBudget>>,
+    ) -> Result<Self, std::io::Error> {
+        stream.set_nonblocking(true)?;
+        Ok(Self {
+            stream,
+            front_encoder: match encoding {
+                Encoding::Serialized => None,
+                Encoding::FrontCoded => Some(FrontEncoder::new()),
+            },
+            queue: VecDeque::new(),
+            written: 0,
+            queued_bytes: 0,
+            lagging: false,
+            budget,
+            metrics: Arc::new(ClientMetrics {
+                id,
+                ..Default::default()
+            }),
+        })
+    }
+
+    /// Whether an event should be queued, or dropped.
+    /// Once we've dropped one, we drop everything until the client
+    /// has been told to resync, so that it never sees a silent gap.
+    /// The memory budget being spent drops it for every client alike,
+    /// once the history has given way.
+    pub(crate) fn has_room(&self) -> bool {
+        !self.lagging
+            && self.queued_bytes < CLIENT_QUEUE_BYTES_MAX
+            && self.budget.as_ref().map_or(true, |budget| budget.admits())
+    }
+
+    pub(crate) fn enqueue(&mut self, frame: Arc<Vec<u8>>) {
+        if let Some(budget) = &self.budget {
+            budget.charge(frame.len());
+        }
+        self.queued_bytes += frame.len();
+        self.queue.push_back((frame, std::time::Instant::now()));
+        self.metrics
+            .queued_frames
+            .store(self.queue.len() as u64, Ordering::Relaxed);
+        self.metrics
+            .queued_bytes
+            .store(self.queued_bytes as u64, Ordering::Relaxed);
+    }
+
+    pub(crate) fn drop_frame(&mut self, srv: &ServerMetrics) {
+        if !self.lagging {
+            eprintln!("client {} fell behind, dropping events", self.metrics.id);
+        }
+        self.lagging = true;
+        self.metrics.frames_dropped.fetch_add(1, Ordering::Relaxed);
+        srv.frames_dropped.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// True once a lagging client has written out everything queued for it
+    /// and is ready to be told to resync. Clears the lagging state.
+    pub(crate) fn take_caught_up(&mut self) -> bool {
+        let caught_up = self.lagging && self.queue.is_empty();
+        if caught_up {
+            self.lagging = false;
+        }
+        caught_up
+    }
+
+    pub(crate) fn has_pending(&self) -> bool {
+        !self.queue.is_empty()
+    }
+
+    /// Writes as much as the socket will take without blocking.
+    /// An error means the connection is done for.
+    pub(crate) fn flush(&mut self, srv: &ServerMetrics) -> Result<(), std::io::Error> {
+        while let Some((frame, queued_at)) = self.queue.front() {
+            match self.stream.write(&frame[self.written..]) {
+                Ok(0) => return Err(std::io::ErrorKind::WriteZero.into()),
+                Ok(n) => {
+                    self.written += n;
+                    srv.bytes_sent.fetch_add(n as u64, Ordering::Relaxed);
+                    if self.written == frame.len() {
+                        self.queued_bytes -= frame.len();
+                        if let Some(budget) = &self.budget {
+                            budget.release(frame.len());
+                        }
+                        self.written = 0;
+                        srv.enqueue_to_write_ns.record_since(*queued_at);
+                        self.queue.pop_front();
+                        self.metrics.frames_sent.fetch_add(1, Ordering::Relaxed);
+                        srv.frames_sent.fetch_add(1, Ordering::Relaxed);
+                    }
+                }
+                Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => break,
+                Err(e) if e.kind() == std::io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            }
+        }
+        self.metrics
+            .queued_frames
+            .store(self.queue.len() as u64, Ordering::Relaxed);
+        self.metrics
+            .queued_bytes
+            .store(self.queued_bytes as u64, Ordering::Relaxed);
+        Ok(())
+    }
+}
@@ -0,0 +1,140 @@
+use std::io::Read;
+
+/// Every message on the socket is framed with a small header:
+///   [u32 payload len][u8 kind][u64 seq][payload]
+/// All integers are little-endian.
+/// The sequence number is assigned by the server, per event, and
+/// is what a reconnecting client presents to resume the stream.
+pub(crate) const HEADER_LEN: usize = 4 + 1 + 8;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum FrameKind {
+    /// Sent once on connect. The payload is the server's epoch (u64),
+    /// which tells a client whether its sequence numbers still mean anything.
+    Hello,
+    /// A serialized event. The sequence number is the event's.
+    Event,
+    /// An event in the compact binary encoding, with front-coded paths.
+    /// Only sent to clients which asked for it. See `front_coding`.
+    CodedEvent,
+    /// The client asked to resume from a sequence number which is no longer
+    /// in the server's history. Everything after this frame is live.
+    /// The sequence number is the last one the server assigned.
+    ResyncRequired,
+}
+
+impl TryFrom<u8> for FrameKind {
+    type Error = std::io::ErrorKind;
+
+    fn try_from(value: u8) -> Result<Self, Self::Error> {
+        match value {
+            0 => Ok(FrameKind::Hello),
+            1 => Ok(FrameKind::Event),
+            2 => Ok(FrameKind::ResyncRequired),
+            3 => Ok(FrameKind::CodedEvent),
+            _ => Err(std::io::ErrorKind::InvalidData),
+        }
+    }
+}
+
+impl From<FrameKind> for u8 {
+    fn from(value: FrameKind) -> Self {
+        match value {
+            FrameKind::Hello => 0,
+            FrameKind::Event => 1,
+            FrameKind::ResyncRequired => 2,
+            FrameKind::CodedEvent => 3,
+        }
+    }
+}
+
+pub(crate) struct FrameHeader {
+    pub(crate) len: usize,
+    pub(crate) kind: FrameKind,
+    pub(crate) seq: u64,
+}
+
+pub(crate) fn encode(kind: FrameKind, seq: u64, payload: &[u8]) -> Vec<u8> {
+    let mut frame = Vec::with_capacity(HEADER_LEN + payload.len());
+    encode_into(&mut frame, kind, seq, payload);
+    frame
+}
+
+pub(crate) fn encode_into(frame: &mut Vec<u8>, kind: FrameKind, seq: u64, payload: &[u8]) {
+    frame.clear();
+    frame.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+    frame.push(kind.into());
+    frame.extend_from_slice(&seq.to_le_bytes());
+    frame.extend_from_slice(payload);
+}
+
+pub(crate) fn read_header(r: &mut impl Read) -> Result<FrameHeader, std::io::ErrorKind> {
+    let mut header = [0; HEADER_LEN];
+    match r.read_exact(&mut header) {
+        Ok(_) => (),
+        Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => {
+            return Err(std::io::ErrorKind::ConnectionReset)
+        }
+        Err(e) => return Err(e.kind()),
+    }
+    let len = u32::from_le_bytes(header[0..4].try_into().unwrap()) as usize;
+    let kind = FrameKind::try_from(header[4])?;
+    let seq = u64::from_le_bytes(header[5..13].try_into().unwrap());
+    Ok(FrameHeader { len, kind, seq })
+}
+
+/// How a connection wants its events encoded.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Encoding {
+    /// Whatever the server's event serializer produces.
+    Serialized,
+    /// The binary encoding with front-coded paths.
+    FrontCoded,
+}
+
+/// What a client says when it connects, before anything else.
+///   "hello [front-coded]"                -- Start from the live stream
+///   "resume <epoch> <seq> [front-coded]" -- Replay everything after <seq>, then go live
+pub(crate) struct Greeting {
+    pub(crate) resume: Option<(u64, u64)>,
+    pub(crate) encoding: Encoding,
+}
+
+impl Greeting {
+    pub(crate) fn hello() -> Self {
+        Self {
+            resume: None,
+            encoding: Encoding::Serialized,
+        }
+    }
+
+    pub(crate) fn to_msg(&self) -> String {
+        let encoding = match self.encoding {
+            Encoding::Serialized => "",
+            Encoding::FrontCoded => " front-coded",
+        };
+        match self.resume {
+            Some((epoch, seq)) => format!("resume {epoch} {seq}{encoding}"),
+            None => format!("hello{encoding}"),
+        }
+    }
+
+    pub(crate) fn parse(msg: &str) -> Option<Self> {
+        let mut words = msg.split_ascii_whitespace();
+        let resume = match words.next()? {
+            "hello" => None,
+            "resume" => {
+                let epoch = words.next()?.parse().ok()?;
+                let seq = words.next()?.parse().ok()?;
+                Some((epoch, seq))
+            }
+            _ => return None,
+        };
+        let encoding = match words.next() {
+            None => Encoding::Serialized,
+            Some("front-coded") => Encoding::FrontCoded,
+            Some(_) => return None,
+        };
+        Some(Self { resume, encoding })
+    }
+}
@@ -0,0 +1,167 @@
+use bpf_fs_events::EffectType;
+use bpf_fs_events::Event;
+use bpf_fs_events::PathType;
+
+/// Consecutive events usually share a long directory prefix, so on connections
+/// which ask for it, each path is sent as the length of the prefix it shares with
+/// the previous path on that connection, followed by the rest of it.
+/// An associated path (the moved-to path of a rename, for example) is coded
+/// against the event's own path, which it usually shares a directory with.
+///
+/// A coded event's payload, with little-endian integers:
+///   [u64 timestamp][u32 pid][u8 effect type][u8 path type][u8 has associated]
+///   [u16 prefix len][u16 suffix len][suffix]
+///   ([u16 prefix len][u16 suffix len][suffix], if there is an associated path)
+const FIXED_LEN: usize = 8 + 4 + 1 + 1 + 1;
+
+/// Both sides keep the previous path as their state. The encoder lives with
+/// the server's connection, the decoder with the client.
+pub(crate) struct FrontEncoder {
+    prev: String,
+}
+
+/// The longest shared prefix which ends on a char boundary in both,
+/// so that the decoder can truncate its previous path to it.
+fn shared_prefix_len(a: &str, b: &str) -> usize {
+    let len = a
+        .bytes()
+        .zip(b.bytes())
+        .take(u16::MAX as usize)
+        .take_while(|(a, b)| a == b)
+        .count();
+    (0..=len)
+        .rev()
+        .find(|&n| a.is_char_boundary(n))
+        .unwrap_or(0)
+}
+
+fn push_coded_path(out: &mut Vec<u8>, prev: &str, path: &str) {
+    let prefix_len = shared_prefix_len(prev, path);
+    let suffix = &path.as_bytes()[prefix_len..];
+    let suffix = &suffix[..suffix.len().min(u16::MAX as usize)];
+    out.extend_from_slice(&(prefix_len as u16).to_le_bytes());
+    out.extend_from_slice(&(suffix.len() as u16).to_le_bytes());
+    out.extend_from_slice(suffix);
+}
+
+impl FrontEncoder {
+    pub(crate) fn new() -> Self {
+        Self {
+            prev: String::with_capacity(256),
+        }
+    }
+
+    pub(crate) fn encode(&mut self, event: &Event, out: &mut Vec<u8>) {
+        out.clear();
+        out.extend_from_slice(&event.timestamp.to_le_bytes());
+        out.extend_from_slice(&event.pid.to_le_bytes());
+        out.push(event.effect_type.into());
+        out.push(event.path_type.into());
+        out.push(event.associated.is_some() as u8);
+        push_coded_path(out, &self.prev, &event.path_name);
+        if let Some(associated) = &event.associated {
+            push_coded_path(out, &event.path_name, associated);
+        }
+        self.prev.clear();
+        self.prev.push_str(&event.path_name);
+    }
+}
+
+/// An event decoded from a front-coded frame.
+/// The path buffers are reused from one event to the next, so once they
+/// have grown to fit the longest path seen, decoding doesn't allocate.
+pub struct EventView {
+    pub timestamp: u64,
+    pub pid: u32,
+    pub path_type: PathType,
+    pub effect_type: EffectType,
+    path_name: String,
+    associated: String,
+    has_associated: bool,
+}
+
+struct Cursor<'a> {
+    buf: &'a [u8],
+}
+
+impl<'a> Cursor<'a> {
+    fn take(&mut self, n: usize) -> Result<&'a [u8], std::io::ErrorKind> {
+        if self.buf.len() < n {
+            return Err(std::io::ErrorKind::InvalidData);
+        }
+        let (head, tail) = self.buf.split_at(n);
+        self.buf = tail;
+        Ok(head)
+    }
+
+    fn u16(&mut self) -> Result<u16, std::io::ErrorKind> {
+        Ok(u16::from_le_bytes(self.take(2)?.try_into().unwrap()))
+    }
+}
+
+/// Rebuilds `dst` as the first `prefix_len` bytes of `base` (which may be `dst`
+/// itself, when `base` is `None`), followed by the suffix in the cursor.
+fn decode_path(
+    cursor: &mut Cursor,
+    dst: &mut String,
+    base: Option<&str>,
+) -> Result<(), std::io::ErrorKind> {
+    let prefix_len = cursor.u16()? as usize;
+    let suffix_len = cursor.u16()? as usize;
+    let suffix = cursor.take(suffix_len)?;
+    let suffix = std::str::from_utf8(suffix).map_err(|_| std::io::ErrorKind::InvalidData)?;
+    let base_ok = |base: &str| prefix_len <= base.len() && base.is_char_boundary(prefix_len);
+    match base {
+        Some(base) if base_ok(base) => {
+            dst.clear();
+            dst.push_str(&base[..prefix_len]);
+        }
+        None if base_ok(dst) => dst.truncate(prefix_len),
+        _ => return Err(std::io::ErrorKind::InvalidData),
+    }
+    dst.push_str(suffix);
+    Ok(())
+}
+
+impl EventView {
+    pub(crate) fn new() -> Self {
+        Self {
+            timestamp: 0,
+            pid: 0,
+            path_type: PathType::Unknown,
+            effect_type: EffectType::Create,
+            path_name: String::with_capacity(256),
+            associated: String::with_capacity(256),
+            has_associated: false,
+        }
+    }
+
+    pub fn path_name(&self) -> &str {
+        &self.path_name
+    }
+
+    pub fn associated(&self) -> Option<&str> {
+        match self.has_associated {
+            true => Some(&self.associated),
+            false => None,
+        }
+    }
+
+    /// Decodes the next event on the connection in place.
+    pub(crate) fn decode(&mut self, payload: &[u8]) -> Result<(), std::io::ErrorKind> {
+        let mut cursor = Cursor { buf: payload };
+        let fixed = cursor.take(FIXED_LEN)?;
+        // Effect types beyond these are not something a server would send
+        let effect_type = EffectType::try_from(fixed[12])?;
+        self.timestamp = u64::from_le_bytes(fixed[0..8].try_into().unwrap());
+        self.pid = u32::from_le_bytes(fixed[8..12].try_into().unwrap());
+        self.effect_type = effect_type;
+        self.path_type = PathType::from(fixed[13]);
+        self.has_associated = fixed[14] != 0;
+        decode_path(&mut cursor, &mut self.path_name, None)?;
+        if self.has_associated {
+            decode_path(&mut cursor, &mut self.associated, Some(&self.path_name))?;
+        }
+        Ok(())
+    }
+}
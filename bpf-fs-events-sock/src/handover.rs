@@ -0,0 +1,128 @@
+use std::io::Read;
+use std::io::Write;
+use std::os::fd::AsRawFd;
+use std::os::fd::FromRawFd;
+use std::os::unix::net::UnixListener;
+use std::os::unix::net::UnixStream;
+
+/// A server listens here, next to its socket, for its replacement to ask it to step down.
+/// The new server attaches its reader first, then asks. The old one drains what it has
+/// left for its clients, and sends over its listening socket (with SCM_RIGHTS) along
+/// with its epoch and sequence number, so that clients resume without noticing much.
+pub(crate) fn path(sock_path: &str) -> String {
+    format!("{sock_path}.handover")
+}
+
+const REQUEST: &[u8] = b"handover";
+
+// How long a new server waits on the old one before going it alone
+const TIMEOUT: std::time::Duration = std::time::Duration::from_secs(5);
+
+pub(crate) struct Handover {
+    pub(crate) listener: UnixListener,
+    pub(crate) epoch: u64,
+    pub(crate) seq: u64,
+}
+
+/// Asks the server at `sock_path`, if there is one, to hand over to us.
+pub(crate) fn request(sock_path: &str) -> Result<Option<Handover>, std::io::Error> {
+    let mut stream = match UnixStream::connect(path(sock_path)) {
+        Ok(stream) => stream,
+        Err(e) => match e.kind() {
+            std::io::ErrorKind::NotFound | std::io::ErrorKind::ConnectionRefused => {
+                return Ok(None)
+            }
+            _ => return Err(e),
+        },
+    };
+    stream.set_read_timeout(Some(TIMEOUT))?;
+    stream.write_all(REQUEST)?;
+    let mut state = [0u8; 16];
+    let listener = recv_fd(&stream, &mut state)?;
+    Ok(Some(Handover {
+        listener: UnixListener::from(listener),
+        epoch: u64::from_le_bytes(state[..8].try_into().unwrap()),
+        seq: u64::from_le_bytes(state[8..].try_into().unwrap()),
+    }))
+}
+
+/// Reads a replacement's request, which should come right after it connects.
+pub(crate) fn read_request(stream: &mut UnixStream) -> Result<(), std::io::Error> {
+    stream.set_nonblocking(false)?;
+    stream.set_read_timeout(Some(TIMEOUT))?;
+    let mut buf = [0u8; REQUEST.len()];
+    stream.read_exact(&mut buf)?;
+    match buf == REQUEST {
+        true => Ok(()),
+        false => Err(std::io::ErrorKind::InvalidData.into()),
+    }
+}
+
+pub(crate) fn send(
+    stream: &UnixStream,
+    listener: &UnixListener,
+    epoch: u64,
+    seq: u64,
+) -> Result<(), std::io::Error> {
+    let mut state = [0u8; 16];
+    state[..8].copy_from_slice(&epoch.to_le_bytes());
+    state[8..].copy_from_slice(&seq.to_le_bytes());
+    send_fd(stream, &state, listener.as_raw_fd())
+}
+
+// Room for a control message carrying one fd
+const CMSG_BUF_LEN: usize = 64;
+
+fn send_fd(stream: &UnixStream, data: &[u8], fd: i32) -> Result<(), std::io::Error> {
+    unsafe {
+        let mut iov = libc::iovec {
+            iov_base: data.as_ptr() as *mut libc::c_void,
+            iov_len: data.len(),
+        };
+        let mut cmsg_buf = [0u64; CMSG_BUF_LEN / 8];
+        let mut msg: libc::msghdr = std::mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf.as_mut_ptr() as *mut libc::c_void;
+        msg.msg_controllen = libc::CMSG_SPACE(std::mem::size_of::<i32>() as u32) as _;
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(std::mem::size_of::<i32>() as u32) as _;
+        std::ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut i32, fd);
+        match libc::sendmsg(stream.as_raw_fd(), &msg, 0) {
+            n if n < 0 => Err(std::io::Error::last_os_error()),
+            n if (n as usize) < data.len() => Err(std::io::ErrorKind::WriteZero.into()),
+            _ => Ok(()),
+        }
+    }
+}
+
+fn recv_fd(stream: &UnixStream, data: &mut [u8]) -> Result<std::os::fd::OwnedFd, std::io::Error> {
+    unsafe {
+        let mut iov = libc::iovec {
+            iov_base: data.as_mut_ptr() as *mut libc::c_void,
+            iov_len: data.len(),
+        };
+        let mut cmsg_buf = [0u64; CMSG_BUF_LEN / 8];
+        let mut msg: libc::msghdr = std::mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf.as_mut_ptr() as *mut libc::c_void;
+        msg.msg_controllen = CMSG_BUF_LEN as _;
+        match libc::recvmsg(stream.as_raw_fd(), &mut msg, libc::MSG_CMSG_CLOEXEC) {
+            n if n < 0 => return Err(std::io::Error::last_os_error()),
+            n if (n as usize) < data.len() => return Err(std::io::ErrorKind::UnexpectedEof.into()),
+            _ => (),
+        }
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        if cmsg.is_null()
+            || (*cmsg).cmsg_level != libc::SOL_SOCKET
+            || (*cmsg).cmsg_type != libc::SCM_RIGHTS
+        {
+            return Err(std::io::ErrorKind::InvalidData.into());
+        }
+        let fd = std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const i32);
+        Ok(std::os::fd::OwnedFd::from_raw_fd(fd))
+    }
+}
@@ -0,0 +1,65 @@
+use std::collections::VecDeque;
+
+pub const HISTORY_LEN_DEFAULT: usize = 4096;
+
+/// A bounded ring of the most recent events, with their sequence numbers,
+/// so that a reconnecting client can be caught up. Events are kept rather
+/// than frames because each connection may encode them differently.
+pub(crate) struct History<T> {
+    items: VecDeque<(u64, T)>,
+    len_max: usize,
+}
+
+pub(crate) enum Replay<'a, T> {
+    /// Everything after the client's sequence number, possibly nothing.
+    Tail(std::collections::vec_deque::Iter<'a, (u64, T)>),
+    /// The client's sequence number has fallen out of the history,
+    /// or it doesn't belong to this server at all.
+    Gap,
+}
+
+impl<T> History<T> {
+    pub(crate) fn new(len_max: usize) -> Self {
+        Self {
+            items: VecDeque::with_capacity(len_max),
+            len_max,
+        }
+    }
+
+    /// Gives back what it pushed out to make room, if anything,
+    /// or the item itself, when no history is kept.
+    pub(crate) fn push(&mut self, seq: u64, item: T) -> Option<(u64, T)> {
+        if self.len_max == 0 {
+            return Some((seq, item));
+        }
+        let evicted = match self.items.len() == self.len_max {
+            true => self.items.pop_front(),
+            false => None,
+        };
+        self.items.push_back((seq, item));
+        evicted
+    }
+
+    pub(crate) fn pop_oldest(&mut self) -> Option<(u64, T)> {
+        self.items.pop_front()
+    }
+
+    /// Sequence numbers are contiguous, so finding the start of
+    /// the tail is just an offset from the oldest item we have.
+    /// The last sequence number we assigned is `last_seq`.
+    pub(crate) fn after(&self, seq: u64, last_seq: u64) -> Replay<'_, T> {
+        if seq > last_seq {
+            return Replay::Gap;
+        }
+        if seq == last_seq {
+            return Replay::Tail(self.items.range(0..0));
+        }
+        match self.items.front() {
+            Some((oldest, _)) if seq + 1 >= *oldest => {
+                let skip = (seq + 1 - oldest) as usize;
+                Replay::Tail(self.items.range(skip..))
+            }
+            _ => Replay::Gap,
+        }
+    }
+}
@@ -1,4 +1,18 @@
+pub(crate) mod conn;
+pub(crate) mod frame;
+pub(crate) mod front_coding;
+pub(crate) mod handover;
+pub(crate) mod history;
+pub(crate) mod metrics;
+pub(crate) mod pipeline;
 pub(crate) mod unix_sock_stream_client;
 pub(crate) mod unix_sock_stream_server;
+pub use conn::CLIENT_QUEUE_BYTES_MAX;
+pub use frame::Encoding;
+pub use front_coding::EventView;
+pub use history::HISTORY_LEN_DEFAULT;
+pub use metrics::StageLatencies;
+pub use pipeline::PipelineOptions;
 pub use unix_sock_stream_client::Client;
+pub use unix_sock_stream_client::Message;
 pub use unix_sock_stream_server::Server;
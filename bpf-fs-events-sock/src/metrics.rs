@@ -0,0 +1,465 @@
+use bpf_fs_events::Histogram;
+use bpf_fs_events::HistogramSnapshot;
+use bpf_fs_events::KernelStat;
+use std::fmt::Write as _;
+use std::io::Read;
+use std::io::Write;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::sync::Mutex;
+
+/// Per-connection counters, registered with the server's metrics
+/// for as long as the connection is alive.
+#[derive(Default)]
+pub(crate) struct ClientMetrics {
+    pub(crate) id: u64,
+    pub(crate) queued_frames: AtomicU64,
+    pub(crate) queued_bytes: AtomicU64,
+    pub(crate) frames_sent: AtomicU64,
+    pub(crate) frames_dropped: AtomicU64,
+}
+
+/// How much of its time one of the pipeline's threads spent working,
+/// rather than waiting on its neighbours. The reader's includes waiting
+/// for room in the workers' queues, which is where backpressure shows.
+pub(crate) struct StageMetrics {
+    pub(crate) name: String,
+    pub(crate) busy_ns: AtomicU64,
+    pub(crate) started_at: std::time::Instant,
+}
+
+impl StageMetrics {
+    pub(crate) fn record_busy(&self, start: std::time::Instant) {
+        let busy = start.elapsed().as_nanos() as u64;
+        self.busy_ns.fetch_add(busy, Ordering::Relaxed);
+    }
+
+    fn utilization(&self) -> f64 {
+        let busy = self.busy_ns.load(Ordering::Relaxed) as f64;
+        let elapsed = self.started_at.elapsed().as_nanos() as f64;
+        match elapsed > 0.0 {
+            true => (busy / elapsed).min(1.0),
+            false => 0.0,
+        }
+    }
+}
+
+#[derive(Default)]
+pub(crate) struct ServerMetrics {
+    pub(crate) events_received: AtomicU64,
+    pub(crate) frames_sent: AtomicU64,
+    pub(crate) bytes_sent: AtomicU64,
+    pub(crate) frames_dropped: AtomicU64,
+    pub(crate) clients_accepted: AtomicU64,
+    /// Events the pipeline dropped rather than queue, for the memory budget
+    pub(crate) events_shed: AtomicU64,
+    /// Times clients were told to resync because events had been shed
+    pub(crate) gaps: AtomicU64,
+    pub(crate) budget: Option<Arc<bpf_fs_events::MemoryBudget>>,
+    pub(crate) clients: Mutex<Vec<Arc<ClientMetrics>>>,
+    /// Time spent turning an event into the bytes of a frame
+    pub(crate) serialize_ns: Histogram,
+    /// Time spent handing an event to every connection
+    pub(crate) fanout_ns: Histogram,
+    /// From a frame being queued for a connection to its last byte being written
+    pub(crate) enqueue_to_write_ns: Histogram,
+    /// The pipeline's threads, if there's a pipeline
+    pub(crate) stages: Mutex<Vec<Arc<StageMetrics>>>,
+}
+
+impl ServerMetrics {
+    pub(crate) fn add_stage(&self, name: &str) -> Arc<StageMetrics> {
+        let stage = Arc::new(StageMetrics {
+            name: name.to_string(),
+            busy_ns: AtomicU64::new(0),
+            started_at: std::time::Instant::now(),
+        });
+        self.stages.lock().unwrap().push(stage.clone());
+        stage
+    }
+
+    pub(crate) fn stage_utilization(&self) -> Vec<(String, f64)> {
+        let stages = self.stages.lock().unwrap();
+        stages
+            .iter()
+            .map(|stage| (stage.name.clone(), stage.utilization()))
+            .collect()
+    }
+}
+
+/// How long events spend in each stage on their way from the kernel to a client.
+pub struct StageLatencies {
+    pub kernel_to_callback: HistogramSnapshot,
+    pub callback_to_dequeue: HistogramSnapshot,
+    pub serialize: HistogramSnapshot,
+    pub enqueue_to_write: HistogramSnapshot,
+}
+
+impl StageLatencies {
+    pub(crate) fn snapshot(lib: &bpf_fs_events::Metrics, srv: &ServerMetrics) -> Self {
+        Self {
+            kernel_to_callback: lib.kernel_to_callback_ns.snapshot(),
+            callback_to_dequeue: lib.callback_to_dequeue_ns.snapshot(),
+            serialize: srv.serialize_ns.snapshot(),
+            enqueue_to_write: srv.enqueue_to_write_ns.snapshot(),
+        }
+    }
+
+    /// Each stage by name, in the order events go through them.
+    pub fn stages(&self) -> [(&'static str, &HistogramSnapshot); 4] {
+        [
+            ("kernel_to_callback", &self.kernel_to_callback),
+            ("callback_to_dequeue", &self.callback_to_dequeue),
+            ("serialize", &self.serialize),
+            ("enqueue_to_write", &self.enqueue_to_write),
+        ]
+    }
+}
+
+// Powers of two, in nanoseconds: about a microsecond to about a minute
+const EXPOSED_BUCKETS: std::ops::Range<u32> = 10..37;
+
+/// Writes the Prometheus text exposition format.
+/// https://prometheus.io/docs/instrumenting/exposition_formats/
+struct Exposition<'a> {
+    out: &'a mut String,
+}
+
+impl Exposition<'_> {
+    fn family(&mut self, name: &str, kind: &str, help: &str) {
+        let _ = writeln!(self.out, "# HELP {name} {help}");
+        let _ = writeln!(self.out, "# TYPE {name} {kind}");
+    }
+
+    fn sample(&mut self, name: &str, labels: &[(&str, &str)], value: impl std::fmt::Display) {
+        self.out.push_str(name);
+        for (idx, (k, v)) in labels.iter().enumerate() {
+            self.out.push(if idx == 0 { '{' } else { ',' });
+            let _ = write!(self.out, "{k}=\"{v}\"");
+        }
+        if !labels.is_empty() {
+            self.out.push('}');
+        }
+        let _ = writeln!(self.out, " {value}");
+    }
+
+    fn counter(&mut self, name: &str, help: &str, value: u64) {
+        self.family(name, "counter", help);
+        self.sample(name, &[], value);
+    }
+
+    fn gauge(&mut self, name: &str, help: &str, value: u64) {
+        self.family(name, "gauge", help);
+        self.sample(name, &[], value);
+    }
+
+    /// Nanoseconds are recorded, seconds are exposed, as is the convention.
+    /// The histograms are finer than this, but only the powers of two from about
+    /// a microsecond to about a minute are exposed, always the same ones,
+    /// so the series stay few, and stable between scrapes.
+    fn histogram(&mut self, name: &str, help: &str, histogram: &Histogram) {
+        let snapshot = histogram.snapshot();
+        self.family(name, "histogram", help);
+        for exp in EXPOSED_BUCKETS {
+            let bound = (1u64 << exp) - 1;
+            let cumulative = snapshot.count_at_or_below(bound);
+            let le = bound as f64 / 1e9;
+            let _ = writeln!(self.out, "{name}_bucket{{le=\"{le:e}\"}} {cumulative}");
+        }
+        let _ = writeln!(self.out, "{name}_bucket{{le=\"+Inf\"}} {}", snapshot.count);
+        let _ = writeln!(self.out, "{name}_sum {}", snapshot.sum as f64 / 1e9);
+        let _ = writeln!(self.out, "{name}_count {}", snapshot.count);
+    }
+}
+
+pub(crate) fn render(out: &mut String, lib: &bpf_fs_events::Metrics, srv: &ServerMetrics) {
+    use bpf_fs_events::EffectType;
+    let load = |n: &AtomicU64| n.load(Ordering::Relaxed);
+    let mut x = Exposition { out };
+
+    x.counter(
+        "fs_events_records_received_total",
+        "Records read off the kernel's event buffer.",
+        load(&lib.records_received),
+    );
+    x.counter(
+        "fs_events_lost_samples_total",
+        "Samples the kernel dropped because the event buffer was full.",
+        load(&lib.lost_samples),
+    );
+    x.family(
+        "fs_events_delivered_total",
+        "counter",
+        "Complete events handed to the consumer, by effect type.",
+    );
+    for (idx, count) in lib.events_by_effect.iter().enumerate() {
+        let Ok(effect) = EffectType::try_from(idx as u8) else {
+            continue;
+        };
+        let effect = match effect {
+            EffectType::Create => "create",
+            EffectType::Rename => "rename",
+            EffectType::Link => "link",
+            EffectType::Delete => "delete",
+            EffectType::Continuation => "continuation",
+            EffectType::Association => "association",
+        };
+        x.sample(
+            "fs_events_delivered_total",
+            &[("effect", effect)],
+            load(count),
+        );
+    }
+    x.histogram(
+        "fs_events_kernel_to_callback_seconds",
+        "Time from a probe firing to its event reaching our callback.",
+        &lib.kernel_to_callback_ns,
+    );
+    x.histogram(
+        "fs_events_callback_to_dequeue_seconds",
+        "Time from our callback to the consumer taking the event.",
+        &lib.callback_to_dequeue_ns,
+    );
+    x.family(
+        "fs_events_kernel_total",
+        "counter",
+        "Counters kept by the BPF programs, summed across CPUs.",
+    );
+    for stat in KernelStat::ALL {
+        x.sample(
+            "fs_events_kernel_total",
+            &[("stat", stat.name())],
+            lib.kernel_stat(stat),
+        );
+    }
+
+    x.counter(
+        "fs_events_server_events_received_total",
+        "Events the server took from the library.",
+        load(&srv.events_received),
+    );
+    x.counter(
+        "fs_events_server_frames_sent_total",
+        "Frames written to clients.",
+        load(&srv.frames_sent),
+    );
+    x.counter(
+        "fs_events_server_bytes_sent_total",
+        "Bytes written to clients.",
+        load(&srv.bytes_sent),
+    );
+    x.counter(
+        "fs_events_server_frames_dropped_total",
+        "Frames not queued for clients which had fallen too far behind.",
+        load(&srv.frames_dropped),
+    );
+    x.counter(
+        "fs_events_events_shed_total",
+        "Events dropped rather than queued, because the memory budget was spent.",
+        load(&lib.events_shed) + load(&srv.events_shed),
+    );
+    x.counter(
+        "fs_events_server_gaps_total",
+        "Times every client was told to resync because events had been shed.",
+        load(&srv.gaps),
+    );
+    if let Some(budget) = &srv.budget {
+        x.gauge(
+            "fs_events_memory_budget_bytes",
+            "The limit on event data buffered in the process.",
+            budget.limit() as u64,
+        );
+        x.gauge(
+            "fs_events_memory_used_bytes",
+            "Event data buffered in the process, in every queue which charges the budget.",
+            budget.used() as u64,
+        );
+        x.counter(
+            "fs_events_memory_refused_total",
+            "Times something was shed for want of room in the memory budget.",
+            budget.refused(),
+        );
+    }
+    x.counter(
+        "fs_events_server_clients_accepted_total",
+        "Client connections accepted.",
+        load(&srv.clients_accepted),
+    );
+    let clients = srv.clients.lock().unwrap();
+    x.gauge(
+        "fs_events_server_clients",
+        "Clients currently connected.",
+        clients.len() as u64,
+    );
+    let per_client: [(&str, &str, &str, fn(&ClientMetrics) -> &AtomicU64); 4] = [
+        (
+            "fs_events_client_queued_frames",
+            "gauge",
+            "Frames waiting to be written to a client.",
+            |c| &c.queued_frames,
+        ),
+        (
+            "fs_events_client_queued_bytes",
+            "gauge",
+            "Bytes waiting to be written to a client.",
+            |c| &c.queued_bytes,
+        ),
+        (
+            "fs_events_client_frames_sent_total",
+            "counter",
+            "Frames written to a client.",
+            |c| &c.frames_sent,
+        ),
+        (
+            "fs_events_client_frames_dropped_total",
+            "counter",
+            "Frames dropped because a client had fallen too far behind.",
+            |c| &c.frames_dropped,
+        ),
+    ];
+    for (name, kind, help, field) in per_client {
+        x.family(name, kind, help);
+        for client in clients.iter() {
+            let id = client.id.to_string();
+            x.sample(name, &[("client", &id)], load(field(client)));
+        }
+    }
+    drop(clients);
+
+    x.histogram(
+        "fs_events_server_serialize_seconds",
+        "Time spent serializing an event into a frame.",
+        &srv.serialize_ns,
+    );
+    x.histogram(
+        "fs_events_server_fanout_seconds",
+        "Time spent handing an event to every client.",
+        &srv.fanout_ns,
+    );
+    x.histogram(
+        "fs_events_server_enqueue_to_write_seconds",
+        "Time from a frame being queued for a client to it being written.",
+        &srv.enqueue_to_write_ns,
+    );
+    let stages = srv.stages.lock().unwrap();
+    if !stages.is_empty() {
+        x.family(
+            "fs_events_server_stage_busy_seconds_total",
+            "counter",
+            "Time each pipeline thread spent working rather than waiting.",
+        );
+        for stage in stages.iter() {
+            let busy = load(&stage.busy_ns) as f64 / 1e9;
+            x.sample(
+                "fs_events_server_stage_busy_seconds_total",
+                &[("stage", &stage.name)],
+                busy,
+            );
+        }
+    }
+}
+
+fn respond(stream: &mut dyn ReadWrite, body: &str) {
+    // We don't care what was asked for, only that something was.
+    let mut req = [0; 4096];
+    let _ = stream.read(&mut req);
+    let head = format!(
+        "HTTP/1.1 200 OK\r\n\
+         Content-Type: text/plain; version=0.0.4\r\n\
+         Content-Length: {}\r\n\
+         Connection: close\r\n\r\n",
+        body.len()
+    );
+    if let Err(e) = stream
+        .write_all(head.as_bytes())
+        .and(stream.write_all(body.as_bytes()))
+    {
+        eprintln!("metrics write error: {}", e);
+    }
+}
+
+trait ReadWrite: Read + Write {}
+impl<T: Read + Write> ReadWrite for T {}
+
+/// Where to serve metrics: loopback TCP, or a Unix socket path with a "unix:" prefix.
+/// Nothing else, so that a typo can't expose them, or name a file for us to remove.
+enum Endpoint<'a> {
+    Tcp(std::net::SocketAddr),
+    Unix(&'a str),
+}
+
+fn parse_endpoint(listen: &str) -> Result<Endpoint<'_>, std::io::Error> {
+    let invalid = |why: String| std::io::Error::new(std::io::ErrorKind::InvalidInput, why);
+    if let Some(path) = listen.strip_prefix("unix:") {
+        return match path.is_empty() {
+            true => Err(invalid("metrics: empty unix socket path".into())),
+            false => Ok(Endpoint::Unix(path)),
+        };
+    }
+    let addr = listen.parse::<std::net::SocketAddr>().map_err(|_| {
+        invalid(format!(
+            "metrics: {listen:?} is neither an ip:port nor a unix:<path>"
+        ))
+    })?;
+    match addr.ip().is_loopback() {
+        true => Ok(Endpoint::Tcp(addr)),
+        false => Err(invalid(format!(
+            "metrics: {addr} isn't a loopback address, and the metrics aren't for everyone"
+        ))),
+    }
+}
+
+// A stale socket from a previous server, but nothing else
+fn remove_stale_socket(path: &str) -> Result<(), std::io::Error> {
+    use std::os::unix::fs::FileTypeExt;
+    match std::fs::symlink_metadata(path) {
+        Ok(md) if md.file_type().is_socket() => std::fs::remove_file(path),
+        Ok(_) => Err(std::io::Error::new(
+            std::io::ErrorKind::AlreadyExists,
+            format!("metrics: {path} exists, and isn't a socket"),
+        )),
+        Err(_) => Ok(()),
+    }
+}
+
+/// Serves the metrics over HTTP, either on a loopback TCP address like
+/// "127.0.0.1:9464" or on a Unix socket, like "unix:/run/fs-events-metrics.sock".
+/// Every request gets the same answer, rendered fresh.
+pub(crate) fn spawn_endpoint(
+    listen: &str,
+    render: impl Fn(&mut String) + Send + 'static,
+) -> Result<std::thread::JoinHandle<()>, std::io::Error> {
+    let serve = move |stream: &mut dyn ReadWrite, body: &mut String| {
+        body.clear();
+        render(body);
+        respond(stream, body);
+    };
+    match parse_endpoint(listen)? {
+        Endpoint::Tcp(addr) => {
+            let srv = std::net::TcpListener::bind(addr)?;
+            Ok(std::thread::spawn(move || {
+                let mut body = String::new();
+                for stream in srv.incoming() {
+                    match stream {
+                        Ok(mut stream) => serve(&mut stream, &mut body),
+                        Err(e) => eprintln!("metrics accept error: {}", e),
+                    }
+                }
+            }))
+        }
+        Endpoint::Unix(path) => {
+            remove_stale_socket(path)?;
+            let srv = std::os::unix::net::UnixListener::bind(path)?;
+            Ok(std::thread::spawn(move || {
+                let mut body = String::new();
+                for stream in srv.incoming() {
+                    match stream {
+                        Ok(mut stream) => serve(&mut stream, &mut body),
+                        Err(e) => eprintln!("metrics accept error: {}", e),
+                    }
+                }
+            }))
+        }
+    }
+}
@@ -0,0 +1,271 @@
+use crate::metrics::ServerMetrics;
+use crate::metrics::StageMetrics;
+use crate::unix_sock_stream_server::Fanout;
+use crate::unix_sock_stream_server::Serializer;
+use crate::unix_sock_stream_server::POLL_TIMEOUT_IDLE;
+use crate::unix_sock_stream_server::POLL_TIMEOUT_PENDING;
+use bpf_fs_events::MemoryBudget;
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+use std::sync::mpsc::Receiver;
+use std::sync::mpsc::RecvTimeoutError;
+use std::sync::mpsc::SyncSender;
+use std::sync::Arc;
+
+/// How the server's pipeline is laid out: one reader, on the thread calling
+/// `Server::try_send_fs_events_blocking`, some workers, and one fanout thread.
+/// Events go to the workers in turn, and the fanout thread takes them back
+/// in the same turn, so they stay in order without any reordering.
+#[derive(Clone, Debug)]
+pub struct PipelineOptions {
+    /// Threads serializing events, at least one
+    pub workers: usize,
+    /// How many events may wait between the reader and each worker,
+    /// and between each worker and the fanout thread. When they're full,
+    /// the reader waits, and the kernel's buffer takes up the slack.
+    pub queue_len: usize,
+    /// CPUs to pin each stage to, or None to leave it to the scheduler.
+    /// Workers take theirs in turn, wrapping around.
+    pub reader_cpu: Option<usize>,
+    pub worker_cpus: Vec<usize>,
+    pub fanout_cpu: Option<usize>,
+}
+
+impl Default for PipelineOptions {
+    fn default() -> Self {
+        Self {
+            workers: 2,
+            queue_len: 1024,
+            reader_cpu: None,
+            worker_cpus: Vec::new(),
+            fanout_cpu: None,
+        }
+    }
+}
+
+enum Work {
+    Event(u64, bpf_fs_events::Event),
+    // Events were shed before whatever comes next
+    Gap,
+    // Answered once everything before it has been written out, as far as it can be
+    Drain(SyncSender<()>),
+}
+
+enum Done {
+    Event(u64, bpf_fs_events::Event, Option<Arc<Vec<u8>>>),
+    Gap,
+    Drain(SyncSender<()>),
+}
+
+/// The reader's end of the pipeline. Dropping it winds the other threads down.
+pub(crate) struct Pipeline {
+    workers: Vec<SyncSender<Work>>,
+    next: usize,
+    reader: Arc<StageMetrics>,
+    // Charged for events between the reader and the fanout thread
+    budget: Option<Arc<MemoryBudget>>,
+    // Set when we've shed events and haven't yet said so
+    shedding: bool,
+    metrics: Arc<ServerMetrics>,
+}
+
+fn pin_to(cpu: usize) -> Result<(), std::io::Error> {
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(cpu, &mut set);
+        match libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) {
+            0 => Ok(()),
+            _ => Err(std::io::Error::last_os_error()),
+        }
+    }
+}
+
+/// A thread for a stage, pinned before it does anything, if asked.
+fn spawn_stage(
+    name: &str,
+    cpu: Option<usize>,
+    run: impl FnOnce() + Send + 'static,
+) -> Result<(), std::io::Error> {
+    let pinned = name.to_string();
+    std::thread::Builder::new()
+        .name(format!("fs-events-{name}"))
+        .spawn(move || {
+            if let Some(cpu) = cpu {
+                if let Err(e) = pin_to(cpu) {
+                    eprintln!("error pinning {pinned} to cpu {cpu}: {e}");
+                }
+            }
+            run()
+        })?;
+    Ok(())
+}
+
+fn work(
+    rx: Receiver<Work>,
+    tx: SyncSender<Done>,
+    event_serializer: Serializer,
+    wants_serialized: Arc<AtomicBool>,
+    metrics: Arc<ServerMetrics>,
+    stage: Arc<StageMetrics>,
+) {
+    for work in rx {
+        let start = std::time::Instant::now();
+        let done = match work {
+            Work::Event(seq, event) => {
+                let serialized = wants_serialized.load(Ordering::Relaxed).then(|| {
+                    crate::unix_sock_stream_server::serialize(
+                        event_serializer,
+                        &metrics,
+                        seq,
+                        &event,
+                    )
+                });
+                Done::Event(seq, event, serialized)
+            }
+            Work::Gap => Done::Gap,
+            Work::Drain(ack) => Done::Drain(ack),
+        };
+        stage.record_busy(start);
+        if tx.send(done).is_err() {
+            return;
+        }
+    }
+}
+
+fn fan_out(
+    mut fanout: Fanout,
+    workers: Vec<Receiver<Done>>,
+    wants_serialized: Arc<AtomicBool>,
+    budget: Option<Arc<MemoryBudget>>,
+    stage: Arc<StageMetrics>,
+) {
+    let mut next = 0;
+    loop {
+        fanout.admit_pending();
+        wants_serialized.store(fanout.wants_serialized(), Ordering::Relaxed);
+        let timeout = match fanout.has_pending() {
+            true => POLL_TIMEOUT_PENDING,
+            false => POLL_TIMEOUT_IDLE,
+        };
+        let done = workers[next].recv_timeout(timeout);
+        let start = std::time::Instant::now();
+        if done.is_ok() {
+            next = (next + 1) % workers.len();
+        }
+        match done {
+            Ok(Done::Event(seq, event, serialized)) => {
+                if let Some(budget) = &budget {
+                    budget.release(event.buffered_size());
+                }
+                fanout.dispatch(seq, event, serialized);
+            }
+            Ok(Done::Gap) => fanout.gap(),
+            Ok(Done::Drain(ack)) => {
+                fanout.flush_clients();
+                let _ = ack.send(());
+            }
+            Err(RecvTimeoutError::Timeout) => fanout.flush_clients(),
+            Err(RecvTimeoutError::Disconnected) => return,
+        }
+        stage.record_busy(start);
+    }
+}
+
+impl Pipeline {
+    pub(crate) fn start(
+        opts: &PipelineOptions,
+        fanout: Fanout,
+        metrics: Arc<ServerMetrics>,
+    ) -> Result<Self, std::io::Error> {
+        if let Some(cpu) = opts.reader_cpu {
+            pin_to(cpu)?;
+        }
+        let wants_serialized = Arc::new(AtomicBool::new(fanout.wants_serialized()));
+        let event_serializer = fanout.event_serializer();
+        let mut to_workers = Vec::new();
+        let mut from_workers = Vec::new();
+        for idx in 0..opts.workers.max(1) {
+            let (work_tx, work_rx) = std::sync::mpsc::sync_channel(opts.queue_len);
+            let (done_tx, done_rx) = std::sync::mpsc::sync_channel(opts.queue_len);
+            let name = format!("worker{idx}");
+            let cpu = match opts.worker_cpus.is_empty() {
+                true => None,
+                false => Some(opts.worker_cpus[idx % opts.worker_cpus.len()]),
+            };
+            let stage = metrics.add_stage(&name);
+            let wants_serialized = wants_serialized.clone();
+            let metrics = metrics.clone();
+            spawn_stage(&name, cpu, move || {
+                work(
+                    work_rx,
+                    done_tx,
+                    event_serializer,
+                    wants_serialized,
+                    metrics,
+                    stage,
+                )
+            })?;
+            to_workers.push(work_tx);
+            from_workers.push(done_rx);
+        }
+        let stage = metrics.add_stage("fanout");
+        let budget = metrics.budget.clone();
+        spawn_stage("fanout", opts.fanout_cpu, move || {
+            fan_out(fanout, from_workers, wants_serialized, budget, stage)
+        })?;
+        eprintln!("pipeline started with {} workers", to_workers.len());
+        Ok(Self {
+            workers: to_workers,
+            next: 0,
+            reader: metrics.add_stage("reader"),
+            budget: metrics.budget.clone(),
+            shedding: false,
+            metrics,
+        })
+    }
+
+    /// Charges the budget for an event, or sheds it. The first event through
+    /// after some were shed is preceded by a gap.
+    pub(crate) fn admits(&mut self, event: &bpf_fs_events::Event) -> bool {
+        if let Some(budget) = &self.budget {
+            if !budget.try_charge(event.buffered_size()) {
+                self.metrics.events_shed.fetch_add(1, Ordering::Relaxed);
+                self.shedding = true;
+                return false;
+            }
+        }
+        if std::mem::take(&mut self.shedding) {
+            self.gap();
+        }
+        true
+    }
+
+    pub(crate) fn gap(&mut self) {
+        self.send_work(Work::Gap);
+    }
+
+    /// Waits for room, if the next worker is behind.
+    pub(crate) fn send(&mut self, seq: u64, event: bpf_fs_events::Event) {
+        self.send_work(Work::Event(seq, event));
+    }
+
+    fn send_work(&mut self, work: Work) {
+        // Only if a thread has died, in which case everything after is lost anyway
+        if self.workers[self.next].send(work).is_err() {
+            eprintln!("pipeline worker {} has gone", self.next);
+        }
+        self.next = (self.next + 1) % self.workers.len();
+    }
+
+    /// Waits until everything sent so far has been written to clients, as far
+    /// as they'd take it without blocking.
+    pub(crate) fn drain(&mut self) {
+        let (ack_tx, ack_rx) = std::sync::mpsc::sync_channel(1);
+        self.send_work(Work::Drain(ack_tx));
+        let _ = ack_rx.recv();
+    }
+
+    pub(crate) fn record_reader_busy(&self, start: std::time::Instant) {
+        self.reader.record_busy(start);
+    }
+}
@@ -1,4 +1,7 @@
-use std::io::Read;
+use crate::frame::Encoding;
+use crate::frame::FrameKind;
+use crate::frame::Greeting;
+use crate::front_coding::EventView;
 use std::io::Write;
 
 const BUF_MAX: usize = 4096 * 2;
@@ -6,26 +9,118 @@ const BUF_MAX: usize = 4096 * 2;
 pub struct Client {
     read_buf: [u8; BUF_MAX],
     sock: std::os::unix::net::UnixStream,
+    sock_path: String,
+    // The server's epoch and the last sequence number we saw from it.
+    // Both are what we present when resuming after a reconnect.
+    epoch: Option<u64>,
+    seq: u64,
+    encoding: Encoding,
+    // Holds the previous path for front-coded connections
+    event_view: EventView,
+}
+
+pub enum Message<'a> {
+    Event(&'a str),
+    /// On connections made with `Encoding::FrontCoded`.
+    CodedEvent(&'a EventView),
+    /// The server could not replay everything we missed.
+    /// Whatever state was built from earlier events should be rebuilt.
+    ResyncRequired,
 }
 
 impl Client {
     pub fn try_new(sock_path: &str) -> Result<Self, std::io::Error> {
+        Self::try_new_with_encoding(sock_path, Encoding::Serialized)
+    }
+
+    pub fn try_new_with_encoding(
+        sock_path: &str,
+        encoding: Encoding,
+    ) -> Result<Self, std::io::Error> {
         let read_buf = [0; BUF_MAX];
         let mut sock = std::os::unix::net::UnixStream::connect(sock_path)?;
         // Say hello
-        sock.write_all(b"hello")?;
-        Ok(Self { read_buf, sock })
+        let greeting = Greeting {
+            resume: None,
+            encoding,
+        };
+        sock.write_all(greeting.to_msg().as_bytes())?;
+        Ok(Self {
+            read_buf,
+            sock,
+            sock_path: sock_path.to_string(),
+            epoch: None,
+            seq: 0,
+            encoding,
+            event_view: EventView::new(),
+        })
+    }
+
+    /// Connects again and asks the server for everything after the last
+    /// event we read. If the server can't provide that, the next message
+    /// will be `Message::ResyncRequired`.
+    pub fn try_reconnect(&mut self) -> Result<(), std::io::Error> {
+        let mut sock = std::os::unix::net::UnixStream::connect(&self.sock_path)?;
+        let greeting = Greeting {
+            resume: self.epoch.map(|epoch| (epoch, self.seq)),
+            encoding: self.encoding,
+        };
+        sock.write_all(greeting.to_msg().as_bytes())?;
+        self.sock = sock;
+        // Front coding starts over on every connection
+        self.event_view = EventView::new();
+        Ok(())
+    }
+
+    /// The sequence number of the last event read.
+    pub fn last_seq(&self) -> u64 {
+        self.seq
     }
 
-    pub fn try_read(&mut self) -> Result<&str, std::io::ErrorKind> {
-        let n = self.sock.read(&mut self.read_buf);
-        match n {
-            Ok(0) => Err(std::io::ErrorKind::ConnectionReset),
-            Ok(n) => match std::str::from_utf8(&self.read_buf[..n]) {
-                Ok(msg) => Ok(msg),
-                Err(_) => Err(std::io::ErrorKind::InvalidData),
-            },
-            Err(e) => Err(e.kind()),
+    pub fn try_read(&mut self) -> Result<Message<'_>, std::io::ErrorKind> {
+        use std::io::Read;
+        loop {
+            let header = crate::frame::read_header(&mut self.sock)?;
+            if header.len > BUF_MAX {
+                return Err(std::io::ErrorKind::InvalidData);
+            }
+            let payload = &mut self.read_buf[..header.len];
+            match self.sock.read_exact(payload) {
+                Ok(_) => (),
+                Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => {
+                    return Err(std::io::ErrorKind::ConnectionReset)
+                }
+                Err(e) => return Err(e.kind()),
+            }
+            match header.kind {
+                FrameKind::Hello => {
+                    let epoch = payload
+                        .try_into()
+                        .map_err(|_| std::io::ErrorKind::InvalidData)?;
+                    let epoch = u64::from_le_bytes(epoch);
+                    // A new server (or our first) starts us at its head
+                    if self.epoch != Some(epoch) {
+                        self.epoch = Some(epoch);
+                        self.seq = header.seq;
+                    }
+                }
+                FrameKind::ResyncRequired => {
+                    self.seq = header.seq;
+                    return Ok(Message::ResyncRequired);
+                }
+                FrameKind::CodedEvent => {
+                    self.event_view.decode(payload)?;
+                    self.seq = header.seq;
+                    return Ok(Message::CodedEvent(&self.event_view));
+                }
+                FrameKind::Event => {
+                    self.seq = header.seq;
+                    return match std::str::from_utf8(&self.read_buf[..header.len]) {
+                        Ok(msg) => Ok(Message::Event(msg)),
+                        Err(_) => Err(std::io::ErrorKind::InvalidData),
+                    };
+                }
+            }
         }
     }
 }
@@ -1,22 +1,96 @@
+use crate::conn::Conn;
+use crate::frame::FrameKind;
+use crate::frame::Greeting;
+use crate::history::History;
+use crate::history::Replay;
+use crate::metrics::ServerMetrics;
+use crate::metrics::StageLatencies;
+use crate::pipeline::Pipeline;
+use crate::pipeline::PipelineOptions;
+use bpf_fs_events::MemoryBudget;
 use std::io::Read;
-use std::io::Write;
+use std::os::fd::AsRawFd;
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
 
 const BUF_MAX: usize = 4096 * 2;
 
+// How long to wait on the kernel for events. Shorter when there are
+// frames waiting on slow clients, so that we get back to them soon.
+pub(crate) const POLL_TIMEOUT_IDLE: std::time::Duration = std::time::Duration::from_millis(250);
+pub(crate) const POLL_TIMEOUT_PENDING: std::time::Duration = std::time::Duration::from_millis(5);
+
+// The kernel's counters are a syscall and a sum over CPUs to read
+const KERNEL_STATS_INTERVAL: std::time::Duration = std::time::Duration::from_secs(1);
+
+// How often the accept task checks whether it's to stop, in milliseconds
+const ACCEPT_POLL_MS: libc::c_int = 100;
+
+type Accepted = (std::os::unix::net::UnixStream, Greeting);
+
+pub(crate) type Serializer = fn(&bpf_fs_events::Event) -> Vec<u8>;
+
+/// Everything after an event has its sequence number: the clients, their
+/// encodings and queues, and the history. Run on the server's thread,
+/// or on the pipeline's fanout thread.
+pub(crate) struct Fanout {
+    clients: Vec<Conn>,
+    next_client_id: u64,
+    epoch: u64,
+    // The last sequence number fanned out, 0 before the first event.
+    seq: u64,
+    history: History<bpf_fs_events::Event>,
+    // Scratch space for encoding, reused across events and connections
+    payload_buf: Vec<u8>,
+    accepted_rx: std::sync::mpsc::Receiver<Accepted>,
+    event_serializer: Serializer,
+    // Charged by the history and the client queues
+    budget: Option<Arc<MemoryBudget>>,
+    metrics: Arc<ServerMetrics>,
+}
+
 pub struct Server<'a> {
-    clients: Vec<std::os::unix::net::UnixStream>,
     sock_path: String,
     pid_path: String,
-    accepted_rx: std::sync::mpsc::Receiver<std::os::unix::net::UnixStream>,
-    removed_tx: std::sync::mpsc::Sender<usize>,
-    removed_rx: std::sync::mpsc::Receiver<usize>,
+    // Distinguishes this server's sequence numbers from those of
+    // whichever server a client may have been connected to before.
+    epoch: u64,
+    // The last sequence number assigned, 0 before the first event.
+    seq: u64,
+    // Ours until the pipeline starts, if it does, and then its fanout thread's
+    fanout: Option<Fanout>,
+    pipeline_opts: Option<PipelineOptions>,
+    pipeline: Option<Pipeline>,
     watcher: bpf_fs_events::FsEvents<'a>,
-    event_serializer: fn(bpf_fs_events::Event) -> Vec<u8>,
-    _accept_task: std::thread::JoinHandle<()>,
+    metrics: Arc<ServerMetrics>,
+    kernel_stats_at: std::time::Instant,
+    // Kept to hand over to our replacement, which may take it from us
+    // through the handover listener.
+    listener: std::os::unix::net::UnixListener,
+    handover_listener: std::os::unix::net::UnixListener,
+    handed_over: bool,
+    // Stopped before we hand over, so that it can't take a client from our
+    // replacement, only to drop it when we go
+    accept_task: Option<std::thread::JoinHandle<()>>,
+    stop_accepting: Arc<AtomicBool>,
+    // To start accepting again, if a handover fails
+    accepted_tx: std::sync::mpsc::Sender<Accepted>,
+    _metrics_task: Option<std::thread::JoinHandle<()>>,
 }
 
 impl Drop for Server<'_> {
     fn drop(&mut self) {
+        // Everything is our replacement's now
+        if self.handed_over {
+            return;
+        }
+        if let Err(e) = self.watcher.unpin() {
+            eprintln!("error unpinning: {}", e);
+        }
+        if let Err(e) = std::fs::remove_file(crate::handover::path(&self.sock_path)) {
+            eprintln!("error removing handover socket file: {}", e);
+        }
         if let Err(e) = std::fs::remove_file(&self.sock_path) {
             eprintln!("error removing socket file: {}", e);
         }
@@ -26,13 +100,110 @@ impl Drop for Server<'_> {
     }
 }
 
-impl Server<'_> {
+/// The serialized form of an event, as a frame.
+pub(crate) fn serialize(
+    event_serializer: Serializer,
+    metrics: &ServerMetrics,
+    seq: u64,
+    event: &bpf_fs_events::Event,
+) -> Arc<Vec<u8>> {
+    let start = std::time::Instant::now();
+    let frame = crate::frame::encode(FrameKind::Event, seq, &event_serializer(event));
+    metrics.serialize_ns.record_since(start);
+    Arc::new(frame)
+}
+
+impl<'a> Server<'a> {
     pub fn try_new(
         sock_path: &str,
-        event_serializer: fn(bpf_fs_events::Event) -> Vec<u8>,
+        event_serializer: Serializer,
+    ) -> Result<Self, Box<dyn std::error::Error>> {
+        Self::try_new_with(sock_path, event_serializer, &Default::default())
+    }
+
+    /// If there's a server running at `sock_path` already, we take over from it.
+    /// When we adopted its pinned probes, and with them its event buffer, it
+    /// drains what it has and hands us its socket, and we carry on its sequence.
+    /// Otherwise its events and ours would overlap, so it's killed, and we start
+    /// a new epoch. So is it if it doesn't know how to hand over.
+    pub fn try_new_with(
+        sock_path: &str,
+        event_serializer: Serializer,
+        opts: &bpf_fs_events::Options,
     ) -> Result<Self, Box<dyn std::error::Error>> {
+        let watcher = bpf_fs_events::FsEvents::try_new_with(opts)?;
         let pid_path = format!("{sock_path}.pid");
-        if let Ok(pid) = std::fs::read_to_string(&pid_path) {
+        let handover = match watcher.adopted_pins() {
+            true => crate::handover::request(sock_path),
+            false => Ok(None),
+        };
+        let (listener, epoch, seq) = match handover {
+            Ok(Some(handover)) => {
+                eprintln!("took over from the server at seq {}", handover.seq);
+                (handover.listener, handover.epoch, handover.seq)
+            }
+            Ok(None) => Self::replace_by_force(sock_path, &pid_path)?,
+            Err(e) => {
+                eprintln!("handover failed: {}", e);
+                Self::replace_by_force(sock_path, &pid_path)?
+            }
+        };
+        std::fs::write(&pid_path, std::process::id().to_string())?;
+        let handover_path = crate::handover::path(sock_path);
+        if std::fs::metadata(&handover_path).is_ok() {
+            std::fs::remove_file(&handover_path)?;
+        }
+        let handover_listener = std::os::unix::net::UnixListener::bind(&handover_path)?;
+        handover_listener.set_nonblocking(true)?;
+        let (accepted_tx, accepted_rx) = std::sync::mpsc::channel();
+        let stop_accepting = Arc::new(AtomicBool::new(false));
+        let accept_task = Self::spawn_accept_task(
+            listener.try_clone()?,
+            accepted_tx.clone(),
+            stop_accepting.clone(),
+        );
+        let metrics = Arc::new(ServerMetrics {
+            budget: opts.memory_budget.clone(),
+            ..Default::default()
+        });
+        Ok(Self {
+            sock_path: sock_path.to_string(),
+            pid_path,
+            epoch,
+            seq,
+            fanout: Some(Fanout {
+                clients: Vec::new(),
+                next_client_id: 0,
+                epoch,
+                seq,
+                history: History::new(crate::history::HISTORY_LEN_DEFAULT),
+                payload_buf: Vec::with_capacity(BUF_MAX),
+                accepted_rx,
+                event_serializer,
+                budget: opts.memory_budget.clone(),
+                metrics: metrics.clone(),
+            }),
+            pipeline_opts: None,
+            pipeline: None,
+            watcher,
+            metrics,
+            kernel_stats_at: std::time::Instant::now(),
+            accept_task: Some(accept_task),
+            stop_accepting,
+            accepted_tx,
+            listener,
+            handover_listener,
+            handed_over: false,
+            _metrics_task: None,
+        })
+    }
+
+    /// The old way of taking over: kill whoever is in the pidfile, and start afresh.
+    fn replace_by_force(
+        sock_path: &str,
+        pid_path: &str,
+    ) -> Result<(std::os::unix::net::UnixListener, u64, u64), Box<dyn std::error::Error>> {
+        if let Ok(pid) = std::fs::read_to_string(pid_path) {
             if let Ok(pid) = pid.parse::<i32>() {
                 eprintln!("killing existing server process at pid {pid}");
                 unsafe {
@@ -50,85 +221,464 @@ impl Server<'_> {
                 eprintln!("ignoring pidfile with invalid pid at {pid_path}");
             }
         }
-        for path in &[sock_path, &pid_path] {
+        for path in &[sock_path, pid_path] {
             if std::fs::metadata(path).is_ok() {
                 std::fs::remove_file(path)?;
             }
         }
-        std::fs::write(&pid_path, std::process::id().to_string())?;
-        let (accepted_tx, accepted_rx) = std::sync::mpsc::channel();
-        let (removed_tx, removed_rx) = std::sync::mpsc::channel();
-        Ok(Self {
-            clients: Vec::new(),
-            sock_path: sock_path.to_string(),
-            pid_path,
-            accepted_rx,
-            removed_tx,
-            removed_rx,
-            watcher: bpf_fs_events::FsEvents::try_new()?,
-            event_serializer,
-            _accept_task: Self::spawn_accept_task(sock_path.to_string(), accepted_tx),
-        })
+        let listener = std::os::unix::net::UnixListener::bind(sock_path)?;
+        let epoch = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .map(|d| d.as_nanos() as u64)
+            .unwrap_or(0)
+            ^ (std::process::id() as u64) << 32;
+        Ok((listener, epoch, 0))
+    }
+
+    /// How many of the most recent events are kept around
+    /// for clients which reconnect and ask to resume.
+    pub fn with_history_len(mut self, len: usize) -> Self {
+        if let Some(fanout) = &mut self.fanout {
+            fanout.history = History::new(len);
+        }
+        self
+    }
+
+    /// Runs the server as a pipeline of threads, rather than all on the
+    /// caller's: the caller's only reads from the kernel, workers serialize,
+    /// and a fanout thread writes to clients. Started on the first call to
+    /// `try_send_fs_events_blocking`, which pins the caller's thread then.
+    pub fn with_pipeline(mut self, opts: PipelineOptions) -> Self {
+        self.pipeline_opts = Some(opts);
+        self
+    }
+
+    /// Serves metrics in the Prometheus text format over HTTP,
+    /// on a loopback address like "127.0.0.1:9464" or a Unix socket, like "unix:/run/m.sock".
+    pub fn with_metrics_endpoint(mut self, listen: &str) -> Result<Self, std::io::Error> {
+        let lib = self.watcher.metrics();
+        let srv = self.metrics.clone();
+        let render = move |out: &mut String| crate::metrics::render(out, &lib, &srv);
+        self._metrics_task = Some(crate::metrics::spawn_endpoint(listen, render)?);
+        Ok(self)
+    }
+
+    /// How long events have spent in each stage so far, from the kernel
+    /// to being written to a client. Serialization only counts when some
+    /// connection wants the serialized form, and writes only when there are clients.
+    pub fn stage_latencies(&self) -> StageLatencies {
+        StageLatencies::snapshot(&self.watcher.metrics(), &self.metrics)
+    }
+
+    /// How busy each of the pipeline's threads has been since it started,
+    /// from 0 to 1, by name. Empty without a pipeline.
+    pub fn stage_utilization(&self) -> Vec<(String, f64)> {
+        self.metrics.stage_utilization()
+    }
+
+    /// Has the kernel count runs and run time for each of our BPF programs.
+    /// They can be read back through `watcher().prog_stats()`.
+    pub fn with_prog_stats(mut self) -> Result<Self, std::io::Error> {
+        self.watcher.enable_prog_stats()?;
+        Ok(self)
+    }
+
+    pub fn watcher(&self) -> &bpf_fs_events::FsEvents<'a> {
+        &self.watcher
     }
 
     fn spawn_accept_task(
-        sock_path: String,
-        accepted_tx: std::sync::mpsc::Sender<std::os::unix::net::UnixStream>,
+        srv: std::os::unix::net::UnixListener,
+        accepted_tx: std::sync::mpsc::Sender<Accepted>,
+        stop: Arc<AtomicBool>,
     ) -> std::thread::JoinHandle<()> {
         std::thread::spawn(move || {
-            let srv = std::os::unix::net::UnixListener::bind(sock_path).unwrap();
-            srv.set_nonblocking(false).unwrap();
-            loop {
+            // Our replacement may be accepting on the same socket, and win the race
+            srv.set_nonblocking(true).unwrap();
+            while !stop.load(Ordering::Acquire) {
+                let mut pollfd = libc::pollfd {
+                    fd: srv.as_raw_fd(),
+                    events: libc::POLLIN,
+                    revents: 0,
+                };
+                if unsafe { libc::poll(&mut pollfd, 1, ACCEPT_POLL_MS) } <= 0 {
+                    continue;
+                }
                 let client = srv.accept();
                 match client {
                     Ok((mut stream, _)) => {
                         let mut buf = [0; BUF_MAX];
                         eprintln!("client connected");
-                        match stream.read(&mut buf) {
+                        let greeting = match stream.read(&mut buf) {
                             Ok(0) => {
                                 eprintln!("client disconnected");
                                 continue;
                             }
                             Ok(n) => match std::str::from_utf8(&buf[..n]) {
-                                Ok(msg) => eprintln!("client said: {}", msg),
+                                Ok(msg) => {
+                                    eprintln!("client said: {}", msg);
+                                    Greeting::parse(msg).unwrap_or(Greeting::hello())
+                                }
                                 Err(_) => {
                                     eprintln!("invalid utf8");
                                     continue;
                                 }
                             },
-                            Err(e) => eprintln!("read error: {}", e),
+                            Err(e) => {
+                                eprintln!("read error: {}", e);
+                                Greeting::hello()
+                            }
+                        };
+                        // Gone with the server
+                        if accepted_tx.send((stream, greeting)).is_err() {
+                            return;
                         }
-                        accepted_tx.send(stream).unwrap();
                     }
+                    Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => (),
                     Err(e) => eprintln!("accept error: {}", e),
                 }
             }
         })
     }
 
+    /// Whether we've handed over to a replacement, and should go.
+    pub fn handed_over(&self) -> bool {
+        self.handed_over
+    }
+
+    /// Hands everything over to a replacement which has asked for it. Its reader
+    /// is attached by now, so whatever we drain here is all we'll ever get.
+    fn hand_over(&mut self, mut stream: std::os::unix::net::UnixStream) {
+        if let Err(e) = crate::handover::read_request(&mut stream) {
+            return eprintln!("bad handover request: {}", e);
+        }
+        // Whoever it accepted meanwhile is admitted below, drained to, and then told
+        // to resync by our replacement, same as the rest of our clients
+        self.stop_accepting.store(true, Ordering::Release);
+        if let Some(accept_task) = self.accept_task.take() {
+            let _ = accept_task.join();
+        }
+        if let Some(fanout) = &mut self.fanout {
+            fanout.admit_pending();
+        }
+        while let Ok(Some(event)) = self.watcher.poll_immediate() {
+            self.dispatch(event);
+        }
+        // Best effort. Anything a client misses here, it's told to resync for.
+        match (&mut self.fanout, &mut self.pipeline) {
+            (Some(fanout), _) => fanout.flush_clients(),
+            (None, Some(pipeline)) => pipeline.drain(),
+            (None, None) => (),
+        }
+        match crate::handover::send(&stream, &self.listener, self.epoch, self.seq) {
+            Ok(_) => {
+                eprintln!("handed over at seq {}", self.seq);
+                self.handed_over = true;
+                // Its threads go once they've nothing left
+                self.pipeline = None;
+            }
+            Err(e) => {
+                eprintln!("handover failed: {}", e);
+                self.resume_accepting();
+            }
+        }
+    }
+
+    fn resume_accepting(&mut self) {
+        let listener = match self.listener.try_clone() {
+            Ok(listener) => listener,
+            Err(e) => return eprintln!("can't accept clients anymore: {}", e),
+        };
+        self.stop_accepting.store(false, Ordering::Release);
+        self.accept_task = Some(Self::spawn_accept_task(
+            listener,
+            self.accepted_tx.clone(),
+            self.stop_accepting.clone(),
+        ));
+    }
+
+    /// Events shed by the library, or by the pipeline, leave a gap before the
+    /// next one through. Shed events never get a sequence number.
+    fn dispatch(&mut self, event: bpf_fs_events::Event) {
+        self.metrics.events_received.fetch_add(1, Ordering::Relaxed);
+        let gap = self.watcher.take_gap() > 0;
+        match (&mut self.fanout, &mut self.pipeline) {
+            (Some(fanout), _) => {
+                if gap {
+                    fanout.gap();
+                }
+                self.seq += 1;
+                fanout.dispatch(self.seq, event, None);
+            }
+            (None, Some(pipeline)) => {
+                if gap {
+                    pipeline.gap();
+                }
+                if pipeline.admits(&event) {
+                    self.seq += 1;
+                    pipeline.send(self.seq, event);
+                }
+            }
+            (None, None) => (),
+        }
+    }
+
+    /// The reader's share of the pipeline: everything the kernel has for us.
+    fn read_pipelined(&mut self) -> Result<(), std::io::ErrorKind> {
+        let Some(event) = self.watcher.poll_with_timeout(POLL_TIMEOUT_IDLE)? else {
+            return Ok(());
+        };
+        let start = std::time::Instant::now();
+        self.dispatch(event);
+        while let Some(event) = self.watcher.poll_immediate()? {
+            self.dispatch(event);
+        }
+        if let Some(pipeline) = &self.pipeline {
+            pipeline.record_reader_busy(start);
+        }
+        Ok(())
+    }
+
     pub fn try_send_fs_events_blocking(&mut self) -> Result<(), std::io::ErrorKind> {
-        if let Ok(stream) = self.accepted_rx.try_recv() {
-            self.clients.push(stream);
-        }
-        if let Ok(client) = self.removed_rx.try_recv() {
-            self.clients.remove(client);
-        }
-        if let Some(event) = self.watcher.poll_indefinite()? {
-            let msg = (self.event_serializer)(event);
-            for idx in 0..self.clients.len() {
-                match self.clients[idx].write_all(&msg) {
-                    Ok(_) => (),
-                    Err(e) => match e.kind() {
-                        std::io::ErrorKind::BrokenPipe => {
-                            eprintln!("client disconnected");
-                            // We'll get it next time on errors this time
-                            let _ = self.removed_tx.send(idx);
-                        }
+        if self.handed_over {
+            return Ok(());
+        }
+        if let Some(opts) = self.pipeline_opts.take() {
+            if let Some(fanout) = self.fanout.take() {
+                let pipeline = Pipeline::start(&opts, fanout, self.metrics.clone());
+                self.pipeline = Some(pipeline.map_err(|e| e.kind())?);
+            }
+        }
+        if let Ok((stream, _)) = self.handover_listener.accept() {
+            self.hand_over(stream);
+            return Ok(());
+        }
+        if self.kernel_stats_at.elapsed() >= KERNEL_STATS_INTERVAL {
+            self.kernel_stats_at = std::time::Instant::now();
+            if let Err(e) = self.watcher.refresh_kernel_stats() {
+                eprintln!("error reading kernel stats: {:?}", e);
+            }
+        }
+        let Some(fanout) = &mut self.fanout else {
+            return self.read_pipelined();
+        };
+        fanout.admit_pending();
+        let timeout = match fanout.has_pending() {
+            true => POLL_TIMEOUT_PENDING,
+            false => POLL_TIMEOUT_IDLE,
+        };
+        match self.watcher.poll_with_timeout(timeout)? {
+            Some(event) => self.dispatch(event),
+            None => fanout.flush_clients(),
+        }
+        Ok(())
+    }
+}
+
+impl Fanout {
+    /// Queues an event for a connection in whichever encoding it asked for.
+    /// The serialized form is the same for every connection,
+    /// so it's made at most once per event and passed in here.
+    fn enqueue_event(
+        conn: &mut Conn,
+        seq: u64,
+        event: &bpf_fs_events::Event,
+        serialized_frame: &Arc<Vec<u8>>,
+        payload_buf: &mut Vec<u8>,
+        metrics: &ServerMetrics,
+    ) {
+        // Front coding is relative to the last frame queued, so a dropped event
+        // must not be encoded at all, or the client would decode garbage.
+        if !conn.has_room() {
+            return conn.drop_frame(metrics);
+        }
+        match &mut conn.front_encoder {
+            Some(encoder) => {
+                let start = std::time::Instant::now();
+                encoder.encode(event, payload_buf);
+                let frame = crate::frame::encode(FrameKind::CodedEvent, seq, payload_buf);
+                metrics.serialize_ns.record_since(start);
+                conn.enqueue(Arc::new(frame));
+            }
+            None => conn.enqueue(serialized_frame.clone()),
+        }
+    }
+
+    fn serialize(&self, seq: u64, event: &bpf_fs_events::Event) -> Arc<Vec<u8>> {
+        serialize(self.event_serializer, &self.metrics, seq, event)
+    }
+
+    pub(crate) fn event_serializer(&self) -> Serializer {
+        self.event_serializer
+    }
+
+    /// Whether any connection wants the serialized form of events.
+    pub(crate) fn wants_serialized(&self) -> bool {
+        self.clients.iter().any(|c| c.front_encoder.is_none())
+    }
+
+    pub(crate) fn has_pending(&self) -> bool {
+        self.clients.iter().any(Conn::has_pending)
+    }
+
+    pub(crate) fn admit_pending(&mut self) {
+        while let Ok((stream, greeting)) = self.accepted_rx.try_recv() {
+            self.admit(stream, greeting);
+        }
+    }
+
+    /// Says hello, then replays whatever the client missed, if it asked to resume.
+    /// Everything queued here comes before the client joins the live stream,
+    /// so it sees the events in sequence order without gaps or duplicates.
+    fn admit(&mut self, stream: std::os::unix::net::UnixStream, greeting: Greeting) {
+        let budget = self.budget.clone();
+        let mut conn = match Conn::try_new(stream, greeting.encoding, self.next_client_id, budget) {
+            Ok(conn) => conn,
+            Err(e) => return eprintln!("error setting up client: {}", e),
+        };
+        self.next_client_id += 1;
+        let hello = crate::frame::encode(FrameKind::Hello, self.seq, &self.epoch.to_le_bytes());
+        conn.enqueue(Arc::new(hello));
+        match greeting.resume {
+            None => (),
+            Some((epoch, seq)) if epoch == self.epoch => match self.history.after(seq, self.seq) {
+                Replay::Tail(events) => {
+                    eprintln!("client resumed after seq {seq}");
+                    let no_frame = Arc::new(Vec::new());
+                    for (seq, event) in events {
+                        let serialized = match conn.front_encoder {
+                            Some(_) => no_frame.clone(),
+                            None => serialize(self.event_serializer, &self.metrics, *seq, event),
+                        };
+                        Self::enqueue_event(
+                            &mut conn,
+                            *seq,
+                            event,
+                            &serialized,
+                            &mut self.payload_buf,
+                            &self.metrics,
+                        );
+                    }
+                }
+                Replay::Gap => {
+                    eprintln!("client at seq {seq} must resync, history exhausted");
+                    let resync = crate::frame::encode(FrameKind::ResyncRequired, self.seq, &[]);
+                    conn.enqueue(Arc::new(resync));
+                }
+            },
+            Some(_) => {
+                eprintln!("client from another server epoch must resync");
+                let resync = crate::frame::encode(FrameKind::ResyncRequired, self.seq, &[]);
+                conn.enqueue(Arc::new(resync));
+            }
+        }
+        self.metrics
+            .clients_accepted
+            .fetch_add(1, Ordering::Relaxed);
+        self.metrics
+            .clients
+            .lock()
+            .unwrap()
+            .push(conn.metrics.clone());
+        self.clients.push(conn);
+    }
+
+    /// Writes out what we can to every client, drops the ones which have gone away,
+    /// and tells the ones which had fallen behind, and have now caught up, to resync.
+    pub(crate) fn flush_clients(&mut self) {
+        let metrics = &self.metrics;
+        let seq = self.seq;
+        self.clients.retain_mut(|conn| {
+            if conn.take_caught_up() {
+                let resync = crate::frame::encode(FrameKind::ResyncRequired, seq, &[]);
+                conn.enqueue(Arc::new(resync));
+            }
+            match conn.flush(metrics) {
+                Ok(_) => true,
+                Err(e) => {
+                    match e.kind() {
+                        std::io::ErrorKind::BrokenPipe => eprintln!("client disconnected"),
                         _ => eprintln!("write error: {}", e),
-                    },
+                    }
+                    let id = conn.metrics.id;
+                    metrics.clients.lock().unwrap().retain(|c| c.id != id);
+                    false
                 }
             }
+        });
+    }
+
+    /// The serialized frame is made here if it's wanted and wasn't made upstream,
+    /// as when a client joined while the event was on its way.
+    pub(crate) fn dispatch(
+        &mut self,
+        seq: u64,
+        event: bpf_fs_events::Event,
+        serialized: Option<Arc<Vec<u8>>>,
+    ) {
+        self.seq = seq;
+        let serialized = match serialized {
+            Some(serialized) => serialized,
+            None if self.wants_serialized() => self.serialize(seq, &event),
+            None => Arc::new(Vec::new()),
+        };
+        let start = std::time::Instant::now();
+        self.make_room();
+        for conn in self.clients.iter_mut() {
+            Self::enqueue_event(
+                conn,
+                seq,
+                &event,
+                &serialized,
+                &mut self.payload_buf,
+                &self.metrics,
+            );
+        }
+        self.flush_clients();
+        self.metrics.fanout_ns.record_since(start);
+        self.remember(seq, event);
+    }
+
+    /// Into the history, which gives way when the budget's spent, here and
+    /// before any client's queue is charged, since it's only for clients which
+    /// may come back. The library's own queue is charged on the reader's
+    /// thread, and sheds what doesn't fit without waiting on us.
+    fn remember(&mut self, seq: u64, event: bpf_fs_events::Event) {
+        if let Some(budget) = &self.budget {
+            budget.charge(event.buffered_size());
+        }
+        self.make_room();
+        let evicted = self.history.push(seq, event);
+        if let (Some(budget), Some((_, old))) = (&self.budget, evicted) {
+            budget.release(old.buffered_size());
+        }
+    }
+
+    /// Evicts the oldest of the history until the budget isn't spent, if it can.
+    fn make_room(&mut self) {
+        let Some(budget) = &self.budget else {
+            return;
+        };
+        while budget.is_spent() {
+            match self.history.pop_oldest() {
+                Some((_, old)) => budget.release(old.buffered_size()),
+                None => break,
+            }
+        }
+    }
+
+    /// Events were shed, so everyone resyncs, and nobody resumes from before
+    /// the gap, since the sequence numbers on either side of it are contiguous.
+    pub(crate) fn gap(&mut self) {
+        self.metrics.gaps.fetch_add(1, Ordering::Relaxed);
+        while let Some((_, old)) = self.history.pop_oldest() {
+            if let Some(budget) = &self.budget {
+                budget.release(old.buffered_size());
+            }
+        }
+        for conn in self.clients.iter_mut() {
+            let resync = crate::frame::encode(FrameKind::ResyncRequired, self.seq, &[]);
+            conn.enqueue(Arc::new(resync));
         }
-        Ok(())
     }
 }
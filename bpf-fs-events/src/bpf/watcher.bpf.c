@@ -57,6 +57,8 @@
 
 #define U32_MAX 0xFFFFFFFF
 #define FMODE_CREATED 0x100000
+#define __O_TMPFILE 020000000
+#define MAX_ERRNO 4095
 
 /*  Stat, inode flags
     1. [Inode docs, not ext4-specific]
@@ -124,12 +126,24 @@ static const u8 PT_SOCKET = 5;
 static const u8 PT_CONT = 6;
 static const u8 PT_UNKNOWN = 7;
 
+/*  Event flags. Set when the path isn't what it looks like, so that userspace
+    can take a slow path for these events alone. Keep these in sync with
+    'EventFlags' in 'src/event.rs'. */
+static const u8 EF_NAME_TRUNCATED = 1 << 0;  // A name was cut short
+static const u8 EF_PATH_TRUNCATED = 1 << 1;  // Ran out of buffer, the path is missing its start
+static const u8 EF_DEPTH_EXHAUSTED = 1 << 2; // Ran out of depth, likewise
+static const u8 EF_READ_FAILED = 1 << 3;     // Couldn't read a dentry, likewise
+static const u8 EF_MODE_UNKNOWN = 1 << 4;    // No mode yet, so no path type
+
 static const u8 ET_CREATE = 0;
 static const u8 ET_RENAME = 1;
 static const u8 ET_LINK = 2;
 static const u8 ET_DELETE = 3;
 static const u8 ET_CONT = 4;
 static const u8 ET_ASSOC = 5;
+/*  Not effects on the filesystem, but records for userspace's process cache. */
+static const u8 ET_EXEC = 6;
+static const u8 ET_EXIT = 7;
 
 /*  pahole is our friend.
     Output for ringbuf+aligned buf cfg:
@@ -140,10 +154,19 @@ static const u8 ET_ASSOC = 5;
       u16 event_group_id; //    14     2
       u8  effect_type;    //    16     1
       u8  path_type;      //    17     1
-      u8  _pad[6];        //    18     6
-      u64 buf[32];        //    24   256
-      // size: 280, cachelines: 5, members: 8
-      // last cacheline: 24 bytes
+      u8  flags;          //    18     1
+      u8  _pad[5];        //    19     5
+      u64 path_hash;      //    24     8
+      u64 parent_hash;    //    32     8
+      u64 cgroup_id;      //    40     8
+      u32 tid;            //    48     4
+      u32 euid;           //    52     4
+      u32 egid;           //    56     4
+      u32 mount_id;       //    60     4
+      u8  comm[16];       //    64    16
+      u64 buf[32];        //    80   256
+      // size: 336, cachelines: 6, members: 16
+      // last cacheline: 16 bytes
     };
 */
 struct event {
@@ -153,8 +176,20 @@ struct event {
     u16 event_group_id;
     u8 effect_type;
     u8 path_type;
-    /*  Explicit padding for the gap of 6 bytes. */
-    u8 _pad[6];
+    /*  EF_*, for whatever's wrong with the path. */
+    u8 flags;
+    /*  Explicit padding for the gap of 5 bytes. */
+    u8 _pad[5];
+    /*  Of the path, and of its parent directory's path. See path_hash below. */
+    u64 path_hash;
+    u64 parent_hash;
+    /*  Who did it, and where, as of when they did. See event_context. */
+    u64 cgroup_id;
+    u32 tid;
+    u32 euid;
+    u32 egid;
+    u32 mount_id;
+    u8 comm[16];
 #if USE_ALIGNED_BUF
     u64 buf[EVENT_BUF_MAX];
 #else
@@ -181,6 +216,388 @@ struct {
 } events SEC(".maps");
 #endif
 
+/*  Counters for what happens in here which userspace can't otherwise see.
+    Indexes into the stats map, which is summed across CPUs by the reader.
+    Keep these in sync with 'KernelStat' in 'src/metrics.rs'. */
+#define ST_EVENTS 0
+#define ST_OUTPUT_FAILED 1
+#define ST_READ_FAILED 2
+#define ST_NAME_TRUNCATED 3
+#define ST_PATH_TRUNCATED 4
+#define ST_DEPTH_EXHAUSTED 5
+#define ST_IGNORED 6
+#define ST_SCRATCH_BUSY 7
+#define ST_MAX 8
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, ST_MAX);
+    __type(key, u32);
+    __type(value, u64);
+} stats SEC(".maps");
+
+static __always_inline void stat_inc(u32 idx)
+{
+    u64* count = bpf_map_lookup_elem(&stats, &idx);
+    if (count) *count += 1;
+}
+
+/*  Log2 histograms of how deep we walked for each path, and how many bytes
+    of names we read doing it. Slot i counts values which are i bits long,
+    so slot 0 is for 0, slot 1 for 1, slot 2 for 2 and 3, and so on.
+    Keep the slot count in sync with 'KERNEL_HISTOGRAM_SLOTS' in 'src/metrics.rs'. */
+#define HIST_SLOTS 32
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, HIST_SLOTS);
+    __type(key, u32);
+    __type(value, u64);
+} walk_depth_hist SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, HIST_SLOTS);
+    __type(key, u32);
+    __type(value, u64);
+} walk_bytes_hist SEC(".maps");
+
+/*  No loops, so nothing for the verifier to unroll. */
+static __always_inline u32 bit_len(u32 v)
+{
+    u32 len = 0;
+    if (v >> 16) { v >>= 16; len += 16; }
+    if (v >> 8) { v >>= 8; len += 8; }
+    if (v >> 4) { v >>= 4; len += 4; }
+    if (v >> 2) { v >>= 2; len += 2; }
+    if (v >> 1) { v >>= 1; len += 1; }
+    return len + v;
+}
+
+static __always_inline void hist_inc(void* hist, u32 value)
+{
+    u32 slot = bit_len(value);
+    if (slot >= HIST_SLOTS) slot = HIST_SLOTS - 1;
+    u64* count = bpf_map_lookup_elem(hist, &slot);
+    if (count) *count += 1;
+}
+
+/*  Picked by userspace at load, from what the kernel supports. See 'src/features.rs'.
+    In the perf buf build, whole events can go to a ringbuf instead (5.8+),
+    which is cheaper than the perf buf, and keeps events in order across CPUs.
+    The ring isn't created on kernels without them, so this must stay false there. */
+const volatile bool use_ring_output = false;
+
+#define RING_BYTES (1 << 22)
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, RING_BYTES);
+} ring SEC(".maps");
+
+/*  Shared mode, for several readers of one set of probes.
+    Each reader puts a ring of its own into a slot of the consumers map,
+    and claims the slot in consumer_pids, which only userspace uses.
+    We walk the path once, whoever is reading, and copy the event to each ring.
+    Keep these in sync with 'src/shared.rs'. Only for the perf buf build. */
+#define CONSUMERS_MAX 8
+
+const volatile bool use_shared_rings = false;
+
+struct consumer_ring {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, RING_BYTES);
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, CONSUMERS_MAX);
+    __type(key, u32);
+    __array(values, struct consumer_ring);
+} consumers SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, CONSUMERS_MAX);
+    __type(key, u32);
+    __type(value, u32);
+} consumer_pids SEC(".maps");
+
+/*  Scoping to some processes, like a pod's, rather than the whole host.
+    Checked before any walking, so everyone else's activity costs a lookup or two.
+    A cgroup matches if it, or any of its ancestors, is in scope_cgroups.
+    When both are used, a process must match both. Filled in by userspace,
+    see 'src/scope.rs'. Paths can be walked up to the process's own root,
+    through the mounts between, rather than to their filesystem's root,
+    so that they're what a container sees. */
+#define SCOPE_MAX 1024
+#define CGROUP_DEPTH_MAX 16
+
+const volatile bool use_cgroup_scope = false;
+const volatile bool use_mntns_scope = false;
+const volatile bool use_task_root = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, SCOPE_MAX);
+    __type(key, u64);
+    __type(value, u8);
+} scope_cgroups SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, SCOPE_MAX);
+    __type(key, u32);
+    __type(value, u8);
+} scope_mntns SEC(".maps");
+
+/*  Scoping to process trees, like a build job's, by a flag on each task
+    in them. Userspace flags the roots (and whatever they've already forked),
+    and the flag is passed on at each fork, so pids needn't be known ahead.
+    Task storage is 5.11+. Its map is only created when it's used. */
+const volatile bool use_task_scope = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, u8);
+} scope_tasks SEC(".maps");
+
+static __always_inline bool in_scope(void)
+{
+    /*  First, since it's the narrowest. */
+    if (use_task_scope) {
+        struct task_struct* task = bpf_get_current_task_btf();
+        if (! bpf_task_storage_get(&scope_tasks, task, 0, 0)) return false;
+    }
+    if (use_mntns_scope) {
+        struct task_struct* task = (struct task_struct*)bpf_get_current_task();
+        u32 mntns = BPF_CORE_READ(task, nsproxy, mnt_ns, ns.inum);
+        if (! bpf_map_lookup_elem(&scope_mntns, &mntns)) return false;
+    }
+    if (use_cgroup_scope) {
+        u64 cgroup = bpf_get_current_cgroup_id();
+        if (bpf_map_lookup_elem(&scope_cgroups, &cgroup)) return true;
+#pragma unroll
+        for (int level = 0; level < CGROUP_DEPTH_MAX; ++level) {
+            cgroup = bpf_get_current_ancestor_cgroup_id(level);
+            /*  No ancestors this deep */
+            if (! cgroup) return false;
+            if (bpf_map_lookup_elem(&scope_cgroups, &cgroup)) return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+/*  Filtering by filesystem: by device (the kernel's s_dev, not stat's st_dev),
+    or by type (s_magic, like TMPFS_MAGIC). Everything listed is either all we watch,
+    or all we don't, as fs_filter says. Filled in by userspace, see 'src/fs_filter.rs'. */
+#define FS_FILTER_ALL 0
+#define FS_FILTER_ONLY 1
+#define FS_FILTER_EXCEPT 2
+#define FS_FILTER_MAX 256
+
+const volatile u8 fs_filter = FS_FILTER_ALL;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, FS_FILTER_MAX);
+    __type(key, u32);
+    __type(value, u8);
+} fs_filter_devs SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, FS_FILTER_MAX);
+    __type(key, u64);
+    __type(value, u8);
+} fs_filter_magics SEC(".maps");
+
+static __always_inline bool fs_wanted(struct dentry* dentry)
+{
+    if (fs_filter == FS_FILTER_ALL) return true;
+    struct super_block* sb = BPF_CORE_READ(dentry, d_sb);
+    u32 dev = BPF_CORE_READ(sb, s_dev);
+    u64 magic = BPF_CORE_READ(sb, s_magic);
+    bool listed = bpf_map_lookup_elem(&fs_filter_devs, &dev)
+               || bpf_map_lookup_elem(&fs_filter_magics, &magic);
+    return fs_filter == FS_FILTER_ONLY ? listed : ! listed;
+}
+
+/*  Hashes, so that userspace can key on integers rather than hash path names again.
+    Keep these in sync with 'src/hash.rs'.
+
+    A name's hash is over its length and then each of its little-endian words,
+    with the last zero-padded. A path's is over its names, from the leaf up:
+      mix64(sum of component_hash(name at depth d) * PATH_HASH_PRIME^d),
+    with the leaf at depth 0. Which is what we can build walking up from the
+    leaf, and what a parent's is, less the leaf's term and divided through by the prime.
+    So we keep the leaf apart, sum up the parent's, and combine the two when done.
+    The root, and anything right under it, has a parent hash of mix64(0), which is 0. */
+#define PATH_HASH_PRIME 0x9e3779b97f4a7c15ULL
+#define HASH_WORDS_MAX (NAME_MAX / sizeof(u64))
+
+static __always_inline u64 mix64(u64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*  Words past len can be anything, they're masked off. */
+static __always_inline u64 component_hash(const u64* words, u32 len)
+{
+    u64 h = mix64(len);
+#pragma unroll
+    for (u32 i = 0; i < HASH_WORDS_MAX; ++i) {
+        if (i * sizeof(u64) >= len) break;
+        u64 word = words[i];
+        u32 left = len - i * sizeof(u64);
+        if (left < sizeof(u64)) word &= (1ULL << (8 * left)) - 1;
+        h = mix64(h ^ word);
+    }
+    return h;
+}
+
+struct path_hasher {
+    u64 leaf;
+    u64 parent;
+    u64 power;
+};
+
+static __always_inline void path_hash_add(struct path_hasher* hasher, u32 depth, u64 name)
+{
+    if (depth == 0) {
+        hasher->leaf = name;
+        hasher->power = 1;
+        return;
+    }
+    hasher->parent += name * hasher->power;
+    hasher->power *= PATH_HASH_PRIME;
+}
+
+static __always_inline void path_hash_done(struct path_hasher* hasher, struct event* event)
+{
+    event->path_hash = mix64(hasher->leaf + PATH_HASH_PRIME * hasher->parent);
+    event->parent_hash = mix64(hasher->parent);
+}
+
+/*  Ignore rules, for things like .git, node_modules and *.swp.
+    Any component of a path can match a name, and the last one can match a suffix.
+    Matching is by a hash of the bytes, so names are at most 16 bytes, suffixes 8.
+    Keep name_hash in sync with 'src/ignore.rs'. Only in the perf buf build's walk. */
+#define IGNORE_NAME_MAX 16
+#define IGNORE_SUFFIX_MAX 8
+#define IGNORE_RULES_MAX 1024
+
+const volatile bool use_ignore_rules = false;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, IGNORE_RULES_MAX);
+    __type(key, u64);
+    __type(value, u8);
+} ignored_names SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, IGNORE_RULES_MAX);
+    __type(key, u64);
+    __type(value, u8);
+} ignored_suffixes SEC(".maps");
+
+/*  Over up to 16 bytes, as two little-endian words, zero-padded. */
+static __always_inline u64 name_hash(u64 lo, u64 hi, u32 len)
+{
+    return mix64(lo ^ mix64(hi ^ len));
+}
+
+/*  Reads no more than the first 16, and last 8, bytes of the name. */
+static __always_inline bool ignored(struct qstr* name, bool leaf)
+{
+    u32 len = name->len;
+    if (len <= IGNORE_NAME_MAX) {
+        u64 words[2] = { 0, 0 };
+        if (read_len(words, len, name->name)) return false;
+        u64 key = name_hash(words[0], words[1], len);
+        if (bpf_map_lookup_elem(&ignored_names, &key)) return true;
+    }
+    if (! leaf) return false;
+    u32 tail_len = len < IGNORE_SUFFIX_MAX ? len : IGNORE_SUFFIX_MAX;
+    u64 tail = 0;
+    if (read_len(&tail, tail_len, name->name + len - tail_len)) return false;
+#pragma unroll
+    for (u32 suffix_len = 1; suffix_len <= IGNORE_SUFFIX_MAX; ++suffix_len) {
+        if (suffix_len > tail_len) break;
+        u64 suffix = tail >> (8 * (tail_len - suffix_len));
+        u64 key = name_hash(suffix, 0, suffix_len);
+        if (bpf_map_lookup_elem(&ignored_suffixes, &key)) return true;
+    }
+    return false;
+}
+
+/*  Where the walk stops, other than at the root of the filesystem. */
+static __always_inline struct dentry* task_root(void)
+{
+    if (! use_task_root) return 0;
+    struct task_struct* task = (struct task_struct*)bpf_get_current_task();
+    return BPF_CORE_READ(task, fs, root.dentry);
+}
+
+static __always_inline struct mount* real_mount(struct vfsmount* mnt)
+{
+    if (! mnt) return 0;
+    return (void*)mnt - bpf_core_field_offset(struct mount, mnt);
+}
+
+/*  The mount the task's root is on, which the walk doesn't cross out of. */
+static __always_inline struct mount* task_root_mount(void)
+{
+    if (! use_task_root) return 0;
+    struct task_struct* task = (struct task_struct*)bpf_get_current_task();
+    return real_mount(BPF_CORE_READ(task, fs, root.mnt));
+}
+
+/*  Mounts over mounts, at most, crossed from one name to the next. */
+#define MOUNT_CROSSINGS_MAX 4
+
+/*  Out of the mounts head is the root of, to where each is mounted, as d_path
+    does, short of the task's root mount, or the namespace's. Only where we know
+    the mount, and only toward a task's root; otherwise the walk stays on the
+    filesystem, and ends at its root. */
+static __always_inline void cross_mounts(
+        struct dentry** head,
+        struct mount** mnt,
+        struct mount* root_mnt)
+{
+#pragma unroll
+    for (u32 crossing = 0; crossing < MOUNT_CROSSINGS_MAX; ++crossing) {
+        struct mount* at = *mnt;
+        if (! at || at == root_mnt) return;
+        if (*head != BPF_CORE_READ(at, mnt.mnt_root)) return;
+        struct mount* parent = BPF_CORE_READ(at, mnt_parent);
+        if (! parent || parent == at) return;
+        *head = BPF_CORE_READ(at, mnt_mountpoint);
+        *mnt = parent;
+    }
+}
+
+/*  Whether the walk is at the task's root: its dentry, on its mount,
+    if we know which mount we're on. */
+static __always_inline bool at_task_root(
+        struct dentry* head,
+        struct mount* mnt,
+        struct dentry* root,
+        struct mount* root_mnt)
+{
+    return head == root && (! mnt || mnt == root_mnt);
+}
+
 #if USE_BPF_RINGBUF
 #define ev_map_reserve(ev_map, len) bpf_ringbuf_reserve(ev_map, len, 0)
 #define ev_map_submit(ev_map, flags) bpf_ringbuf_submit(ev_map, flags)
@@ -192,6 +609,35 @@ struct renamedata___x {
     struct new_mnt_idmap* new_mnt_idmap;
 } __attribute__((preserve_access_index));
 
+#if ! USE_BPF_RINGBUF
+static __always_inline void output_event(void* ctx, struct event* event)
+{
+    if (use_ring_output && ! use_shared_rings) {
+        if (bpf_ringbuf_output(&ring, event, sizeof(*event), 0))
+            stat_inc(ST_OUTPUT_FAILED);
+        else
+            stat_inc(ST_EVENTS);
+        return;
+    }
+    if (! use_shared_rings) {
+        if (bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, event, sizeof(*event)))
+            stat_inc(ST_OUTPUT_FAILED);
+        else
+            stat_inc(ST_EVENTS);
+        return;
+    }
+#pragma unroll
+    for (u32 slot = 0; slot < CONSUMERS_MAX; ++slot) {
+        void* ring = bpf_map_lookup_elem(&consumers, &slot);
+        if (! ring) continue;
+        if (bpf_ringbuf_output(ring, event, sizeof(*event), 0))
+            stat_inc(ST_OUTPUT_FAILED);
+        else
+            stat_inc(ST_EVENTS);
+    }
+}
+#endif
+
 #if USE_BPF_RINGBUF
 static __always_inline struct event* event_init(
         u8 effect_type,
@@ -201,40 +647,123 @@ static __always_inline struct event* event_init(
     struct event* event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
     if (! event) {
         elog("No event could be reserved");
+        stat_inc(ST_OUTPUT_FAILED);
         return 0;
     }
     u64 pid_tgid = bpf_get_current_pid_tgid();
     u32 pid = pid_tgid >> 32;  // A userspace "pid" is the kernel's "tgid"
     u32 tid = (u32)pid_tgid;   // And a "tid" is the kernel's "pid"
     event->timestamp = timestamp;
+    event->path_hash = 0;
+    event->parent_hash = 0;
+    event->flags = 0;
+    event->cgroup_id = 0;
+    event->euid = 0;
+    event->egid = 0;
+    event->mount_id = 0;
+    memset(event->comm, 0, sizeof(event->comm));
     event->buf_len = 0;
     event->event_group_id = (u16)timestamp;
     event->pid = pid;
+    event->tid = tid;
     event->effect_type = effect_type;
     event->path_type = path_type;
     return event;
 }
 #else
-static __always_inline struct event event_init(
+/*  Where the event is built, rather than on the stack, which it would take
+    most of, with the walk and its temporaries wanting the rest. We build one
+    event at a time, and it's sent (copied out) before we start on another,
+    except for the first of a pair, which is held back in its own slot
+    until the second is built. */
+#define SCRATCH_NEXT 0
+#define SCRATCH_HELD 1
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 2);
+    __type(key, u32);
+    __type(value, struct event);
+} event_scratch SEC(".maps");
+
+static __always_inline struct event* event_init_at(
+        u32 slot,
         u8 effect_type,
         u8 path_type,
         u64 timestamp)
 {
-    struct event event;
-    memset(&event, 0, sizeof(event));
+    struct event* event = bpf_map_lookup_elem(&event_scratch, &slot);
+    if (! event) return 0;
+    memset(event, 0, sizeof(*event));
     u64 pid_tgid = bpf_get_current_pid_tgid();
     u32 pid = pid_tgid >> 32;  // A userspace "pid" is the kernel's "tgid"
     u32 tid = (u32)pid_tgid;   // And a "tid" is the kernel's "pid"
-    event.timestamp = timestamp;
-    event.buf_len = 0;
-    event.event_group_id = (u16)timestamp;
-    event.pid = pid;
-    event.effect_type = effect_type;
-    event.path_type = path_type;
+    event->timestamp = timestamp;
+    event->buf_len = 0;
+    event->event_group_id = (u16)timestamp;
+    event->pid = pid;
+    event->tid = tid;
+    event->effect_type = effect_type;
+    event->path_type = path_type;
     return event;
 }
+
+static __always_inline struct event* event_init(
+        u8 effect_type,
+        u8 path_type,
+        u64 timestamp)
+{
+    return event_init_at(SCRATCH_NEXT, effect_type, path_type, timestamp);
+}
+
+/*  Whether this CPU's scratch space, event_scratch and name_scratch, is in use.
+    Only kprobes run with preemption off. Trampolines and tracepoints only keep
+    to their CPU, so on a preemptible kernel, a program can be preempted part
+    way through an event, and another, in whichever task runs next, would
+    build its own over it. The second gives up, and its event is counted as
+    dropped. Taken by adding and then looking, as older kernels can't exchange;
+    of two which overlap, at most one sees only itself. */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u32);
+} scratch_busy SEC(".maps");
+
+static __always_inline bool scratch_take(void)
+{
+    u32 zero = 0;
+    u32* busy = bpf_map_lookup_elem(&scratch_busy, &zero);
+    if (! busy) return false;
+    __sync_fetch_and_add(busy, 1);
+    if (*busy == 1) return true;
+    __sync_fetch_and_add(busy, -1);
+    stat_inc(ST_SCRATCH_BUSY);
+    return false;
+}
+
+static __always_inline void scratch_give(void)
+{
+    u32 zero = 0;
+    u32* busy = bpf_map_lookup_elem(&scratch_busy, &zero);
+    if (busy) __sync_fetch_and_add(busy, -1);
+}
 #endif
 
+/*  The rest of who and where, for events which end up in front of a user, so
+    that they don't have to go looking in /proc, where the process may be gone.
+    The mount is the one the path is on, where the probe knows it, and its id
+    is the one in /proc/<pid>/mountinfo. */
+static __always_inline void event_context(struct event* event, struct vfsmount* mnt)
+{
+    struct task_struct* task = (struct task_struct*)bpf_get_current_task();
+    event->cgroup_id = bpf_get_current_cgroup_id();
+    event->euid = BPF_CORE_READ(task, cred, euid.val);
+    event->egid = BPF_CORE_READ(task, cred, egid.val);
+    bpf_get_current_comm(event->comm, sizeof(event->comm));
+    struct mount* mount = real_mount(mnt);
+    if (mount) event->mount_id = BPF_CORE_READ(mount, mnt_id);
+}
+
 static __always_inline u8 path_type_from_mode(umode_t mode)
 {
     switch (mode & S_IFMT) {
@@ -269,10 +798,266 @@ path_type_from_dentry(struct dentry* dentry)
     return path_type_from_mode(mode);
 }
 
+/*  How to walk up a path, in the perf buf build.
+    Unrolled works everywhere. With bpf_loop (5.17+), there's one copy of the
+    loop body rather than SUBPATH_DEPTH_MAX of them, so the programs are far
+    smaller, verify far quicker, and stay hot in the icache.
+    Each probe is built with each of these, and userspace loads one of them.
+    WALK_CACHED is or'd in by LSM programs, the only ones with inode storage. */
+#define WALK_UNROLLED 0
+#define WALK_LOOP 1
+#define WALK_CACHED 2
+
+/*  What the ignore rules made of each directory's ancestors, kept on the
+    directory's inode, so that events in a directory under .git skip the walk,
+    and events in one which isn't skip the ancestors' rule lookups.
+    A verdict is (generation << 1 | ignored), and only good for its generation,
+    which is bumped whenever a directory is renamed (and so has new ancestors)
+    or the rules are filled, which they are before anything's attached,
+    so that zeroed storage is never good. A walk racing a directory's rename
+    can cache the old layout's verdict, until the next rename.
+    Not with task roots, where the ancestors we see depend on the process. */
+struct {
+    __uint(type, BPF_MAP_TYPE_INODE_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, u64);
+} dir_verdicts SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u32);
+} dir_verdict_generation SEC(".maps");
+
+static __always_inline bool dir_verdicts_used(u8 walk)
+{
+    return (walk & WALK_CACHED) && use_ignore_rules && ! use_task_root;
+}
+
+/*  Before a rename, since there's no LSM hook after one. */
+static __always_inline void dir_verdicts_moved(u8 walk, struct dentry* dentry)
+{
+    if (! dir_verdicts_used(walk)) return;
+    if (path_type_from_dentry(dentry) != PT_DIR) return;
+    u32 zero = 0;
+    u32* generation = bpf_map_lookup_elem(&dir_verdict_generation, &zero);
+    if (generation) __sync_fetch_and_add(generation, 1);
+}
+
+#if ! USE_BPF_RINGBUF
+/*  Where each name is read to before it's copied onto the event,
+    so that it's hashed from a fixed offset. The verifier won't let us
+    read the event's buffer at the variable offset it was copied to. */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u64[HASH_WORDS_MAX]);
+} name_scratch SEC(".maps");
+
+struct walk {
+    struct event* event;
+    struct dentry* head;
+    // The mount head is on, only when walking to the task's root
+    struct mount* mnt;
+    struct dentry* root;
+    struct mount* root_mnt;
+    u64* name;
+    struct path_hasher hasher;
+    u32 depth;
+    bool ignored;
+    // The ancestors are known not to be ignored
+    bool ancestors_clean;
+    // Carry on past an ignored name, for the other half of a pair
+    bool whole;
+};
+
+/*  One path component onto the event. Non-zero when we're done walking. */
+static __always_inline long walk_component(struct walk* w, u32 depth)
+{
+    struct event* event = w->event;
+    struct dentry* parent;
+    struct qstr head_name;
+    struct qstr parent_name;
+    cross_mounts(&w->head, &w->mnt, w->root_mnt);
+    if (read_ptr(&parent, &w->head->d_parent)
+        || read_concrete(&head_name, &w->head->d_name)
+        || read_concrete(&parent_name, &parent->d_name)) {
+        stat_inc(ST_READ_FAILED);
+        event->flags |= EF_READ_FAILED;
+        return 1;
+    }
+    if (parent == w->head || at_task_root(w->head, w->mnt, w->root, w->root_mnt)) {
+        tlog("Reached root at depth %d with name %s",
+             depth,
+             head_name.name);
+        return 1;
+    }
+    if (use_ignore_rules && ! w->ignored && (depth == 0 || ! w->ancestors_clean)
+        && ignored(&head_name, depth == 0)) {
+        w->ignored = true;
+        if (! w->whole) {
+            stat_inc(ST_IGNORED);
+            return 1;
+        }
+    }
+    u8 clamped_head_name_len = head_name.len;
+// Evidently half of our NAME_MAX (which is the same as our PATH_MAX for the perf array, re. stack size). Why?
+#define BPF_VERIFIER_MAGIC_NUMBER 128
+    if (clamped_head_name_len > NAME_MAX - BPF_VERIFIER_MAGIC_NUMBER) {
+        // What's ever more strange, is that removing this log...
+        wlog("Truncating path component to please BPF verifier");
+        stat_inc(ST_NAME_TRUNCATED);
+        event->flags |= EF_NAME_TRUNCATED;
+        clamped_head_name_len = NAME_MAX - BPF_VERIFIER_MAGIC_NUMBER;
+    }
+    if (event->buf_len > PATH_MAX - BPF_VERIFIER_MAGIC_NUMBER) {
+        // ... and/or this log will cause the verifier to fail.
+        wlog("Truncating full path to please BPF verifier");
+        stat_inc(ST_PATH_TRUNCATED);
+        event->flags |= EF_PATH_TRUNCATED;
+        event->buf_len = PATH_MAX - BPF_VERIFIER_MAGIC_NUMBER;
+    }
+    char* buf_at_next_path_offset = (char*)event->buf;
+    buf_at_next_path_offset += event->buf_len;
+    event->name_offsets[(SUBPATH_DEPTH_MAX - depth - 1) & (SUBPATH_DEPTH_MAX - 1)] = event->buf_len;
+    if (read_len(w->name, clamped_head_name_len, head_name.name)
+        || read_len(buf_at_next_path_offset, clamped_head_name_len, w->name)) {
+        elog("Failed to read dentry name");
+        stat_inc(ST_READ_FAILED);
+        event->flags |= EF_READ_FAILED;
+        return 1;
+    }
+    event->buf_len += clamped_head_name_len;
+    /*  Where this name ends is where the next starts. Written here too,
+        so that the outermost name we read has an end. */
+    if (depth + 1 < SUBPATH_DEPTH_MAX)
+        event->name_offsets[(SUBPATH_DEPTH_MAX - depth - 2) & (SUBPATH_DEPTH_MAX - 1)] = event->buf_len;
+    //tlog("event buf len: %d", event->buf_len);
+    path_hash_add(&w->hasher, depth, component_hash(w->name, clamped_head_name_len));
+    tlog("event buf len: %d, clamped head name len: %d, head name len: %d, head name: %s, event buf: %s",
+         event->buf_len,
+         clamped_head_name_len,
+         head_name.len,
+         head_name.name,
+         event->buf);
+    if (event->buf_len + parent_name.len > PATH_MAX) {
+        elog("Path too large, must truncate");
+        stat_inc(ST_PATH_TRUNCATED);
+        event->flags |= EF_PATH_TRUNCATED;
+        return 1;
+    }
+    w->head = parent;
+    return 0;
+}
+
+static long walk_step(u64 depth, void* ctx)
+{
+    struct walk* w = ctx;
+    if (depth >= SUBPATH_DEPTH_MAX) return 1;
+    if (walk_component(w, (u32)depth)) return 1;
+    w->depth = depth + 1;
+    return 0;
+}
+#endif
+
+#if ! USE_BPF_RINGBUF
+/*  The path from head, walked onto the event in scratch slot `slot`. Null if
+    the ignore rules drop it, unless `was_ignored` is given, for half of a pair:
+    then the path is walked whole regardless, and whether the rules would have
+    dropped it is left there, for the pair to be decided on together. */
+static __always_inline struct event* walk_to_event(
+        u8 walk,
+        struct dentry* head,
+        struct vfsmount* mnt,
+        u8 effect_type,
+        u8 guess_path_type,
+        u64 timestamp,
+        u32 slot,
+        bool* was_ignored)
+{
+    bool whole = was_ignored != 0;
+    u32 zero = 0;
+    u64* verdict = 0;
+    u32 generation = 0;
+    bool ancestors_clean = false;
+    if (dir_verdicts_used(walk) && ! whole) {
+        u32* current = bpf_map_lookup_elem(&dir_verdict_generation, &zero);
+        if (! current) return 0;
+        generation = *current;
+        /*  Dereferenced rather than read, so that the verifier knows it's an inode. */
+        verdict = bpf_inode_storage_get(
+                &dir_verdicts,
+                head->d_parent->d_inode,
+                0,
+                BPF_LOCAL_STORAGE_GET_F_CREATE);
+        if (verdict && *verdict >> 1 == generation) {
+            if (*verdict & 1) {
+                stat_inc(ST_IGNORED);
+                return 0;
+            }
+            ancestors_clean = true;
+        }
+    }
+    u8 path_type = guess_path_type == PT_UNKNOWN ? path_type_from_dentry(head) : guess_path_type;
+    u64* name = bpf_map_lookup_elem(&name_scratch, &zero);
+    if (! name) return 0;
+    struct event* event = event_init_at(slot, effect_type, path_type, timestamp);
+    if (! event) return 0;
+    event_context(event, mnt);
+    struct walk w = {
+        .event = event,
+        .head = head,
+        .mnt = use_task_root ? real_mount(mnt) : 0,
+        .root = task_root(),
+        .root_mnt = task_root_mount(),
+        .name = name,
+        .depth = 0,
+        .ignored = false,
+        .ancestors_clean = ancestors_clean,
+        .whole = whole,
+    };
+    if (walk & WALK_LOOP) {
+        bpf_loop(SUBPATH_DEPTH_MAX, walk_step, &w, 0);
+    } else {
+        u32 depth = 0;
+#pragma unroll
+        for (; depth < SUBPATH_DEPTH_MAX; ++depth)
+            if (walk_component(&w, depth)) break;
+        w.depth = depth;
+    }
+    if (w.depth == SUBPATH_DEPTH_MAX) {
+        stat_inc(ST_DEPTH_EXHAUSTED);
+        event->flags |= EF_DEPTH_EXHAUSTED;
+    }
+    if (verdict) {
+        /*  Ignored past the leaf, the directory's in an ignored subtree. If not,
+            it's only clean if we saw all the way up. */
+        if (w.ignored && w.depth > 0)
+            *verdict = (u64)generation << 1 | 1;
+        else if (! w.ignored && ! (event->flags & (EF_READ_FAILED | EF_PATH_TRUNCATED | EF_DEPTH_EXHAUSTED)))
+            *verdict = (u64)generation << 1;
+    }
+    if (w.ignored && ! whole) return 0;
+    if (was_ignored) *was_ignored = w.ignored;
+    if (path_type == PT_UNKNOWN) event->flags |= EF_MODE_UNKNOWN;
+    hist_inc(&walk_depth_hist, w.depth);
+    hist_inc(&walk_bytes_hist, event->buf_len);
+    path_hash_done(&w.hasher, event);
+    return event;
+}
+#endif
+
 static __always_inline u32 resolve_dents_to_events(
         // ctx, only for perf buf
-        struct pt_regs* ctx,
+        void* ctx,
+        // WALK_*, only for perf buf, and constant wherever we're inlined
+        u8 walk,
         struct dentry* head,
+        // The mount it's on, if we know it, else null
+        struct vfsmount* mnt,
         u8 effect_type,
         u8 guess_path_type,
         u64 timestamp,
@@ -299,6 +1084,11 @@ static __always_inline u32 resolve_dents_to_events(
         default : path_type = guess_path_type; break;
     }
     struct event* event;
+    struct dentry* root = task_root();
+    struct mount* root_mnt = task_root_mount();
+    struct mount* head_mnt = use_task_root ? real_mount(mnt) : 0;
+    struct path_hasher hasher = { 0, 0, 1 };
+    u8 flags = path_type == PT_UNKNOWN ? EF_MODE_UNKNOWN : 0;
 
     dlog("@%lu et: %d pt: %d", timestamp, effect_type, path_type);
 
@@ -313,10 +1103,15 @@ static __always_inline u32 resolve_dents_to_events(
               > /
             For example.
         */
-        if (read_ptr(&parent, &head->d_parent)) return 0;
-        if (read_concrete(&head_name, &head->d_name)) return 0;
-        if (read_concrete(&parent_name, &parent->d_name)) return 0;
-        if (parent == head) {
+        cross_mounts(&head, &head_mnt, root_mnt);
+        if (read_ptr(&parent, &head->d_parent)
+            || read_concrete(&head_name, &head->d_name)
+            || read_concrete(&parent_name, &parent->d_name)) {
+            stat_inc(ST_READ_FAILED);
+            flags |= EF_READ_FAILED;
+            break;
+        }
+        if (parent == head || at_task_root(head, head_mnt, root, root_mnt)) {
             tlog("Reached root at depth %d with name %s",
                  depth,
                  head_name.name);
@@ -327,84 +1122,158 @@ static __always_inline u32 resolve_dents_to_events(
         if (! event) return 0;
         u32 len = head_name.len;
         len &= (NAME_MAX - 1);
+        if (len != head_name.len) {
+            stat_inc(ST_NAME_TRUNCATED);
+            flags |= EF_NAME_TRUNCATED;
+        }
         if (read_len(event->buf, len, head_name.name)) {
             elog("Failed to read dentry name");
+            stat_inc(ST_READ_FAILED);
+            flags |= EF_READ_FAILED;
             ev_map_discard(event, 0);
-            return 0;
+            break;
         }
         tlog("%s", event->buf);
+        path_hash_add(&hasher, depth, component_hash(event->buf, len));
         total_len += len;
         event->buf_len = len;
         ev_map_submit(event, BPF_RB_NO_WAKEUP);
 
         if (total_len + parent_name.len > PATH_MAX) {
             elog("Path too large, must truncate");
+            stat_inc(ST_PATH_TRUNCATED);
+            flags |= EF_PATH_TRUNCATED;
             break;
         }
         head = parent;
     }
+    if (depth == SUBPATH_DEPTH_MAX) {
+        stat_inc(ST_DEPTH_EXHAUSTED);
+        flags |= EF_DEPTH_EXHAUSTED;
+    }
+    hist_inc(&walk_depth_hist, depth);
+    hist_inc(&walk_bytes_hist, total_len);
 
     event = event_init(effect_type, path_type, timestamp);
     if (! event) return 0;
+    event_context(event, mnt);
+    path_hash_done(&hasher, event);
+    event->flags = flags;
     ev_map_submit(event, last_event_submit_flags);
+    stat_inc(ST_EVENTS);
     return depth;
 #else
-    u8 path_type = guess_path_type == PT_UNKNOWN ? path_type_from_dentry(head) : guess_path_type;
-    struct event event = event_init(effect_type, path_type, timestamp);
-    u8 depth = 0;
-#pragma unroll
-    for (; depth < SUBPATH_DEPTH_MAX; ++depth) {
-        struct dentry* parent;
-        struct qstr head_name;
-        struct qstr parent_name;
-        if (read_ptr(&parent, &head->d_parent)) return 0;
-        if (read_concrete(&head_name, &head->d_name)) return 0;
-        if (read_concrete(&parent_name, &parent->d_name)) return 0;
-        if (parent == head) {
-            tlog("Reached root at depth %d with name %s",
-                 depth,
-                 head_name.name);
-            break;
-        }
-        u8 clamped_head_name_len = head_name.len;
-// Evidently half of our NAME_MAX (which is the same as our PATH_MAX for the perf array, re. stack size). Why?
-#define BPF_VERIFIER_MAGIC_NUMBER 128
-        if (clamped_head_name_len > NAME_MAX - BPF_VERIFIER_MAGIC_NUMBER) {
-            // What's ever more strange, is that removing this log...
-            wlog("Truncating path component to please BPF verifier");
-            clamped_head_name_len = NAME_MAX - BPF_VERIFIER_MAGIC_NUMBER;
-        }
-        if (event.buf_len > PATH_MAX - BPF_VERIFIER_MAGIC_NUMBER) {
-            // ... and/or this log will cause the verifier to fail.
-            wlog("Truncating full path to please BPF verifier");
-            event.buf_len = PATH_MAX - BPF_VERIFIER_MAGIC_NUMBER;
-        }
-        char* buf_at_next_path_offset = (char*)event.buf;
-        buf_at_next_path_offset += event.buf_len;
-        event.name_offsets[SUBPATH_DEPTH_MAX - depth - 1] = event.buf_len;
-        event.buf_len += clamped_head_name_len;
-        //tlog("event buf len: %d", event.buf_len);
-        if (read_len(buf_at_next_path_offset, clamped_head_name_len, head_name.name)) {
-            elog("Failed to read dentry name");
-            return 0;
-        }
-        tlog("event buf len: %d, clamped head name len: %d, head name len: %d, head name: %s, event buf: %s",
-             event.buf_len,
-             clamped_head_name_len,
-             head_name.len,
-             head_name.name,
-             event.buf);
-        if (event.buf_len + parent_name.len > PATH_MAX) {
-            elog("Path too large, must truncate");
-            break;
-        }
-        head = parent;
-    }
-    bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &event, sizeof(event));
+    if (! scratch_take()) return 0;
+    struct event* event
+            = walk_to_event(walk, head, mnt, effect_type, guess_path_type, timestamp, SCRATCH_NEXT, 0);
+    if (event) output_event(ctx, event);
+    scratch_give();
     return 0;
 #endif
 }
 
+/*  A rename's or a link's events: the association, with the path it's from,
+    and then the event with the path it's to. Either alone would be taken for
+    something else, so the ignore rules drop both or neither: both, only if
+    both paths are ignored, so that saving a file by renaming an ignored temp
+    file over it isn't lost. */
+static __always_inline void resolve_pair_to_events(
+        void* ctx,
+        u8 walk,
+        struct dentry* from,
+        struct vfsmount* from_mnt,
+        struct dentry* to,
+        struct vfsmount* to_mnt,
+        u8 effect_type,
+        u8 guess_path_type,
+        u64 timestamp)
+{
+#if USE_BPF_RINGBUF
+    resolve_dents_to_events(ctx, walk, from, from_mnt, ET_ASSOC, PT_UNKNOWN, timestamp, BPF_RB_NO_WAKEUP);
+    resolve_dents_to_events(
+            ctx, walk, to, to_mnt, effect_type, guess_path_type, timestamp, BPF_RB_FORCE_WAKEUP);
+#else
+    if (! scratch_take()) return;
+    bool from_ignored = false;
+    bool to_ignored = false;
+    struct event* assoc = walk_to_event(
+            walk, from, from_mnt, ET_ASSOC, PT_UNKNOWN, timestamp, SCRATCH_HELD, &from_ignored);
+    struct event* event = 0;
+    if (assoc)
+        event = walk_to_event(
+                walk, to, to_mnt, effect_type, guess_path_type, timestamp, SCRATCH_NEXT, &to_ignored);
+    if (event && from_ignored && to_ignored) {
+        // One for each of them
+        stat_inc(ST_IGNORED);
+        stat_inc(ST_IGNORED);
+    } else if (event) {
+        output_event(ctx, assoc);
+        output_event(ctx, event);
+    }
+    scratch_give();
+#endif
+}
+
+/*  Each probe is built six ways: as a kprobe or, where there's BTF and
+    trampolines (5.5+), as an fentry, which skips the int3 and pt_regs of a kprobe,
+    or, where the BPF LSM is enabled (5.7+, and "bpf" in lsm=), on the LSM hook
+    itself, where inode storage caches the ignore rules' verdicts on directories;
+    and with each of the walks. They're all named <variant>__<function>,
+    and userspace loads only one variant. The variants are no more than
+    a call into the handler below, with the walk as a constant.
+    An LSM program returns what the hook would, so we pass on what another
+    BPF LSM decided, and don't report what it denied. The arguments must be
+    all of the hook's, since its return value follows them. */
+#define UNPAREN(...) __VA_ARGS__
+#define probe_variants(fn, hook, call_args, ...)                               \
+    SEC("kprobe/" #fn)                                                         \
+    int BPF_KPROBE(kprobe__##fn, __VA_ARGS__)                                  \
+    { return on_##fn(ctx, WALK_UNROLLED, UNPAREN call_args); }                 \
+    SEC("kprobe/" #fn)                                                         \
+    int BPF_KPROBE(kprobe_loop__##fn, __VA_ARGS__)                             \
+    { return on_##fn(ctx, WALK_LOOP, UNPAREN call_args); }                     \
+    SEC("fentry/" #fn)                                                         \
+    int BPF_PROG(fentry__##fn, __VA_ARGS__)                                    \
+    { return on_##fn(ctx, WALK_UNROLLED, UNPAREN call_args); }                 \
+    SEC("fentry/" #fn)                                                         \
+    int BPF_PROG(fentry_loop__##fn, __VA_ARGS__)                               \
+    { return on_##fn(ctx, WALK_LOOP, UNPAREN call_args); }                     \
+    SEC("lsm/" #hook)                                                          \
+    int BPF_PROG(lsm__##fn, __VA_ARGS__, int ret)                              \
+    {                                                                          \
+        if (! ret) on_##fn(ctx, WALK_UNROLLED | WALK_CACHED, UNPAREN call_args); \
+        return ret;                                                            \
+    }                                                                          \
+    SEC("lsm/" #hook)                                                          \
+    int BPF_PROG(lsm_loop__##fn, __VA_ARGS__, int ret)                         \
+    {                                                                          \
+        if (! ret) on_##fn(ctx, WALK_LOOP | WALK_CACHED, UNPAREN call_args);   \
+        return ret;                                                            \
+    }
+
+/*  Likewise for what a function returned, as a kretprobe or an fexit.
+    A kretprobe has only the return value, so that's all the handler gets.
+    There's no LSM hook for these, so the LSM variant is an fexit too. */
+#define retprobe_variants(fn, ret_type, ret, ...)                              \
+    SEC("kretprobe/" #fn)                                                      \
+    int BPF_KRETPROBE(kprobe__##fn, ret_type ret)                              \
+    { return on_##fn(ctx, WALK_UNROLLED, ret); }                               \
+    SEC("kretprobe/" #fn)                                                      \
+    int BPF_KRETPROBE(kprobe_loop__##fn, ret_type ret)                         \
+    { return on_##fn(ctx, WALK_LOOP, ret); }                                   \
+    SEC("fexit/" #fn)                                                          \
+    int BPF_PROG(fentry__##fn, __VA_ARGS__, ret_type ret)                      \
+    { return on_##fn(ctx, WALK_UNROLLED, ret); }                               \
+    SEC("fexit/" #fn)                                                          \
+    int BPF_PROG(fentry_loop__##fn, __VA_ARGS__, ret_type ret)                 \
+    { return on_##fn(ctx, WALK_LOOP, ret); }                                   \
+    SEC("fexit/" #fn)                                                          \
+    int BPF_PROG(lsm__##fn, __VA_ARGS__, ret_type ret)                         \
+    { return on_##fn(ctx, WALK_UNROLLED, ret); }                               \
+    SEC("fexit/" #fn)                                                          \
+    int BPF_PROG(lsm_loop__##fn, __VA_ARGS__, ret_type ret)                    \
+    { return on_##fn(ctx, WALK_LOOP, ret); }
+
 /*  Probes for securty_path ops. */
 
 /*  This probe recognizes special files (character devices, block devices, etc.)
@@ -427,17 +1296,19 @@ int BPF_KPROBE(
 }
 #endif
 
-SEC("kprobe/security_path_unlink")
-
-int BPF_KPROBE(
-        kprobe__security_path_unlink,
+static __always_inline int on_security_path_unlink(
+        void* ctx,
+        u8 walk,
         struct path* dir,
         struct dentry* dentry)
 {
+    if (! in_scope() || ! fs_wanted(dentry)) return 0;
     tlog("security_path_unlink_enter");
     resolve_dents_to_events(
             ctx,
+            walk,
             dentry,
+            BPF_CORE_READ(dir, mnt),
             ET_DELETE,
             PT_UNKNOWN,
             bpf_ktime_get_ns(),
@@ -445,18 +1316,26 @@ int BPF_KPROBE(
     return 0;
 }
 
-SEC("kprobe/security_path_mkdir")
+probe_variants(
+        security_path_unlink,
+        path_unlink,
+        (dir, dentry),
+        struct path* dir,
+        struct dentry* dentry)
 
-int BPF_KPROBE(
-        kprobe__security_path_mkdir,
+static __always_inline int on_security_path_mkdir(
+        void* ctx,
+        u8 walk,
         struct path* dir,
-        struct dentry* dentry,
-        umode_t mode)
+        struct dentry* dentry)
 {
+    if (! in_scope() || ! fs_wanted(dentry)) return 0;
     tlog("security_path_mkdir_enter");
     resolve_dents_to_events(
             ctx,
+            walk,
             dentry,
+            BPF_CORE_READ(dir, mnt),
             ET_CREATE,
             PT_DIR,
             bpf_ktime_get_ns(),
@@ -464,17 +1343,27 @@ int BPF_KPROBE(
     return 0;
 }
 
-SEC("kprobe/security_path_rmdir")
+probe_variants(
+        security_path_mkdir,
+        path_mkdir,
+        (dir, dentry),
+        struct path* dir,
+        struct dentry* dentry,
+        umode_t mode)
 
-int BPF_KPROBE(
-        kprobe__security_path_rmdir,
+static __always_inline int on_security_path_rmdir(
+        void* ctx,
+        u8 walk,
         struct path* dir,
         struct dentry* dentry)
 {
+    if (! in_scope() || ! fs_wanted(dentry)) return 0;
     tlog("security_path_rmdir_enter");
     resolve_dents_to_events(
             ctx,
+            walk,
             dentry,
+            BPF_CORE_READ(dir, mnt),
             ET_DELETE,
             PT_DIR,
             bpf_ktime_get_ns(),
@@ -482,137 +1371,272 @@ int BPF_KPROBE(
     return 0;
 }
 
-SEC("kprobe/security_path_rename")
+probe_variants(
+        security_path_rmdir,
+        path_rmdir,
+        (dir, dentry),
+        struct path* dir,
+        struct dentry* dentry)
 
-int BPF_KPROBE(
-        kprobe__security_path_rename,
+static __always_inline int on_security_path_rename(
+        void* ctx,
+        u8 walk,
         struct path* old_dir,
         struct dentry* old_dentry,
         struct path* new_dir,
         struct dentry* new_dentry)
 {
+    /*  Whoever's renaming it, and wherever, it has new ancestors. */
+    dir_verdicts_moved(walk, old_dentry);
+    if (! in_scope() || ! fs_wanted(old_dentry)) return 0;
     tlog("security_path_rename_enter");
     u64 timestamp = bpf_ktime_get_ns();
-    resolve_dents_to_events(
+    resolve_pair_to_events(
             ctx,
+            walk,
             old_dentry,
-            ET_ASSOC,
-            PT_UNKNOWN,
-            timestamp,
-            BPF_RB_NO_WAKEUP);
-    resolve_dents_to_events(
-            ctx,
+            BPF_CORE_READ(old_dir, mnt),
             new_dentry,
+            BPF_CORE_READ(new_dir, mnt),
             ET_RENAME,
             PT_UNKNOWN,
-            timestamp,
-            BPF_RB_FORCE_WAKEUP);
+            timestamp);
     return 0;
 }
 
-SEC("kprobe/security_path_link")
+probe_variants(
+        security_path_rename,
+        path_rename,
+        (old_dir, old_dentry, new_dir, new_dentry),
+        struct path* old_dir,
+        struct dentry* old_dentry,
+        struct path* new_dir,
+        struct dentry* new_dentry,
+        unsigned int flags)
 
-int BPF_KPROBE(
-        kprobe__security_path_link,
+static __always_inline int on_security_path_link(
+        void* ctx,
+        u8 walk,
         struct dentry* old_dentry,
         struct path* new_dir,
         struct dentry* new_dentry)
 {
+    if (! in_scope() || ! fs_wanted(old_dentry)) return 0;
     tlog("security_path_link_enter");
     u64 timestamp = bpf_ktime_get_ns();
-    resolve_dents_to_events(
-            ctx,
-            old_dentry,
-            ET_ASSOC,
-            PT_UNKNOWN,
-            timestamp,
-            BPF_RB_NO_WAKEUP);
-    resolve_dents_to_events(
-            ctx,
-            new_dentry,
-            ET_LINK,
-            PT_HARDLINK,
-            timestamp,
-            BPF_RB_FORCE_WAKEUP);
+    /*  Links don't cross mounts, so the old one's on the new one's. */
+    struct vfsmount* mnt = BPF_CORE_READ(new_dir, mnt);
+    resolve_pair_to_events(
+            ctx, walk, old_dentry, mnt, new_dentry, mnt, ET_LINK, PT_HARDLINK, timestamp);
     return 0;
 }
 
-SEC("kprobe/security_path_symlink")
+probe_variants(
+        security_path_link,
+        path_link,
+        (old_dentry, new_dir, new_dentry),
+        struct dentry* old_dentry,
+        struct path* new_dir,
+        struct dentry* new_dentry)
 
-int BPF_KPROBE(
-        kprobe__security_path_symlink,
+static __always_inline int on_security_path_symlink(
+        void* ctx,
+        u8 walk,
         struct path* dir,
         struct dentry* dentry,
         char* old_name)
 {
+    if (! in_scope() || ! fs_wanted(dentry)) return 0;
     tlog("security_path_symlink_enter");
     u64 timestamp = bpf_ktime_get_ns();
+    struct vfsmount* mnt = BPF_CORE_READ(dir, mnt);
+#if USE_BPF_RINGBUF
     resolve_dents_to_events(
             ctx,
+            walk,
             dentry,
+            mnt,
             ET_ASSOC,
             PT_UNKNOWN,
             timestamp,
             BPF_RB_NO_WAKEUP);
-#if USE_BPF_RINGBUF
     struct event* assoc = event_init(ET_LINK, PT_SYMLINK, timestamp);
     if (! assoc) return 0;
+    event_context(assoc, mnt);
     u32 len = bpf_probe_read_str(assoc->buf, NAME_MAX, old_name);
     assoc->buf_len = len;
     ev_map_submit(assoc, BPF_RB_FORCE_WAKEUP);
+    stat_inc(ST_EVENTS);
 #else
-    struct event assoc = event_init(ET_LINK, PT_SYMLINK, timestamp);
-    u32 len = bpf_probe_read_str(assoc.buf, NAME_MAX, old_name);
-    assoc.buf_len = len;
-    bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &assoc, sizeof(assoc));
+    /*  Held back, so that the link goes only with it: there's no link without it,
+        if the ignore rules drop it. The target is only text, which they don't see. */
+    if (! scratch_take()) return 0;
+    struct event* path = walk_to_event(
+            walk, dentry, mnt, ET_ASSOC, PT_UNKNOWN, timestamp, SCRATCH_HELD, 0);
+    struct event* assoc = path ? event_init(ET_LINK, PT_SYMLINK, timestamp) : 0;
+    if (assoc) {
+        event_context(assoc, mnt);
+        u32 len = bpf_probe_read_str(assoc->buf, NAME_MAX, old_name);
+        assoc->buf_len = len;
+        output_event(ctx, path);
+        output_event(ctx, assoc);
+    }
+    scratch_give();
 #endif
     return 0;
 }
 
-/*  Probes for securty_file ops. */
+probe_variants(
+        security_path_symlink,
+        path_symlink,
+        (dir, dentry, old_name),
+        struct path* dir,
+        struct dentry* dentry,
+        char* old_name)
 
-/*  This probe doesn't always see the right file mode, it seems to me.
-    So, disabled for now. */
+/*  Creations we've reported from security_inode_create, by dentry, for a moment.
+    An open(O_CREAT) goes through there first, and then out of do_filp_open with
+    FMODE_CREATED set, and we want to report it once. An open which creates without
+    passing through security_inode_create, if there's a filesystem that does,
+    is reported on the way out. Entries are taken by the open, or age out, or
+    are evicted, since a create by mknod never has an open to take it.
+    The window is short, so that a freed and reused dentry isn't mistaken for one. */
+#define RECENT_CREATES_MAX 4096
+#define RECENT_CREATE_NS (250 * 1000 * 1000)
 
-#if 0
-SEC("kprobe/security_file_open")
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, RECENT_CREATES_MAX);
+    __type(key, u64);
+    __type(value, u64);
+} recent_creates SEC(".maps");
 
-int BPF_KPROBE(kprobe__security_file_open, struct file* file)
+/*  Probes for securty_inode ops. */
+
+static __always_inline int on_security_inode_create(
+        void* ctx,
+        u8 walk,
+        struct dentry* dentry,
+        umode_t mode)
 {
-    unsigned flags;
-    read_concrete(&flags, &file->f_flags);
-    if (! (flags & FMODE_CREATED)) { return 0; }
-    tlog("security_file_open_enter");
+    if (! in_scope() || ! fs_wanted(dentry)) return 0;
+    tlog("security_inode_create_enter");
+    /*  Walked to a task's root, a path needs its mount, which isn't known
+        here. The open reports it on the way out instead. */
+    if (use_task_root) return 0;
+    u64 key = (u64)dentry;
     u64 timestamp = bpf_ktime_get_ns();
-    struct path path;
-    read_concrete(&path, &file->f_path);
-    struct dentry* dentry;
-    read_ptr(&dentry, &path.dentry);
-    static const enum path_type path_type = PT_FILE;
-    resolve_dents_to_events(dentry, ET_CREATE, &path_type, timestamp, BPF_RB_FORCE_WAKEUP);
+    bpf_map_update_elem(&recent_creates, &key, &timestamp, BPF_ANY);
+    resolve_dents_to_events(
+            ctx,
+            walk,
+            dentry,
+            // Not known here
+            0,
+            ET_CREATE,
+            path_type_from_mode(mode),
+            timestamp,
+            BPF_RB_FORCE_WAKEUP);
     return 0;
 }
-#endif
-
-/*  Probes for securty_inode ops. */
-
-SEC("kprobe/security_inode_create")
 
-int BPF_KPROBE(
-        kprobe__security_inode_create,
+probe_variants(
+        security_inode_create,
+        inode_create,
+        (dentry, mode),
         struct inode* dir,
         struct dentry* dentry,
         umode_t mode)
+
+/*  Probes for file opens. These replace a probe on security_file_open,
+    which read FMODE_CREATED from f_flags rather than f_mode, and so
+    never saw quite the right thing. On the way out, the file is whole,
+    and its inode has a mode, so the path type is what it is. */
+
+static __always_inline int on_do_filp_open(void* ctx, u8 walk, struct file* file)
 {
-    tlog("security_inode_create_enter");
+    if ((unsigned long)file >= (unsigned long)-MAX_ERRNO) return 0;
+    fmode_t f_mode = BPF_CORE_READ(file, f_mode);
+    if (! (f_mode & FMODE_CREATED)) return 0;
+    /*  Nameless until it's linked, which we'll see then. */
+    if (BPF_CORE_READ(file, f_flags) & __O_TMPFILE) return 0;
+    struct dentry* dentry = BPF_CORE_READ(file, f_path.dentry);
+    if (! in_scope() || ! fs_wanted(dentry)) return 0;
+    struct vfsmount* mnt = BPF_CORE_READ(file, f_path.mnt);
+    tlog("do_filp_open_exit");
+    u64 key = (u64)dentry;
+    u64 timestamp = bpf_ktime_get_ns();
+    u64* reported_at = bpf_map_lookup_elem(&recent_creates, &key);
+    if (reported_at) {
+        bool recent = timestamp - *reported_at < RECENT_CREATE_NS;
+        bpf_map_delete_elem(&recent_creates, &key);
+        if (recent) return 0;
+    }
     resolve_dents_to_events(
             ctx,
+            walk,
             dentry,
+            mnt,
             ET_CREATE,
-            path_type_from_mode(mode),
-            bpf_ktime_get_ns(),
+            PT_UNKNOWN,
+            timestamp,
             BPF_RB_FORCE_WAKEUP);
     return 0;
 }
 
+retprobe_variants(
+        do_filp_open,
+        struct file*,
+        file,
+        int dfd,
+        struct filename* pathname,
+        const struct open_flags* op)
+
+/*  Process lifecycle, so that userspace can cache what it reads from /proc about
+    a process until the process execs or exits, and no longer. These are records
+    in the same stream as the events, so that they arrive in order with them.
+    Only loaded when userspace caches processes. See 'src/process.rs'. */
+
+static __always_inline int on_process(void* ctx, u8 effect_type)
+{
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    /*  A thread exiting leaves its process as it was. */
+    if (effect_type == ET_EXIT && (pid_tgid >> 32) != (u32)pid_tgid) return 0;
+    if (! in_scope()) return 0;
+#if USE_BPF_RINGBUF
+    struct event* event = event_init(effect_type, PT_UNKNOWN, bpf_ktime_get_ns());
+    if (! event) return 0;
+    ev_map_submit(event, 0);
+#else
+    if (! scratch_take()) return 0;
+    struct event* event = event_init(effect_type, PT_UNKNOWN, bpf_ktime_get_ns());
+    if (event) output_event(ctx, event);
+    scratch_give();
+#endif
+    return 0;
+}
+
+SEC("tp/sched/sched_process_exec")
+int tp__sched_process_exec(void* ctx)
+{
+    return on_process(ctx, ET_EXEC);
+}
+
+SEC("tp/sched/sched_process_exit")
+int tp__sched_process_exit(void* ctx)
+{
+    return on_process(ctx, ET_EXIT);
+}
+
+/*  Passes the scope_tasks flag on, to threads as well as processes.
+    Only loaded when scoping to process trees. */
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(tp_btf__sched_process_fork, struct task_struct* parent, struct task_struct* child)
+{
+    if (! bpf_task_storage_get(&scope_tasks, parent, 0, 0)) return 0;
+    u8* flag = bpf_task_storage_get(&scope_tasks, child, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (flag) *flag = 1;
+    return 0;
+}
+
 char LICENSE[] SEC("license") = "GPL";
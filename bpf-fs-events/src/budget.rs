@@ -0,0 +1,74 @@
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::AtomicUsize;
+use std::sync::atomic::Ordering;
+
+/// A limit on the bytes of event data buffered anywhere in the process:
+/// in `FsEvents`' queue, and in whichever queues its consumer charges too,
+/// like a server's client queues and history. Shared by `Arc`.
+/// Nothing waits on it. When it's spent, whoever was about to buffer
+/// something sheds it instead, in their own way, and a refusal is counted.
+#[derive(Debug)]
+pub struct MemoryBudget {
+    limit: usize,
+    used: AtomicUsize,
+    refused: AtomicU64,
+}
+
+impl MemoryBudget {
+    pub fn new(limit: usize) -> Self {
+        Self {
+            limit,
+            used: AtomicUsize::new(0),
+            refused: AtomicU64::new(0),
+        }
+    }
+
+    /// Charges `bytes` if they fit, and if not, counts a refusal.
+    pub fn try_charge(&self, bytes: usize) -> bool {
+        let charged = self
+            .used
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |used| {
+                used.checked_add(bytes).filter(|&used| used <= self.limit)
+            });
+        if charged.is_err() {
+            self.refused.fetch_add(1, Ordering::Relaxed);
+        }
+        charged.is_ok()
+    }
+
+    /// Charges `bytes` whether they fit or not, for what's already been
+    /// let in, like a frame after `admits` said there was room.
+    pub fn charge(&self, bytes: usize) {
+        self.used.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    pub fn release(&self, bytes: usize) {
+        self.used.fetch_sub(bytes, Ordering::Relaxed);
+    }
+
+    /// Whether there's room for anything at all, and if not, counts a refusal.
+    pub fn admits(&self) -> bool {
+        let admits = !self.is_spent();
+        if !admits {
+            self.refused.fetch_add(1, Ordering::Relaxed);
+        }
+        admits
+    }
+
+    pub fn is_spent(&self) -> bool {
+        self.used() >= self.limit
+    }
+
+    pub fn limit(&self) -> usize {
+        self.limit
+    }
+
+    pub fn used(&self) -> usize {
+        self.used.load(Ordering::Relaxed)
+    }
+
+    /// How many times something was shed for want of room
+    pub fn refused(&self) -> u64 {
+        self.refused.load(Ordering::Relaxed)
+    }
+}
@@ -0,0 +1,302 @@
+use crate::event::PathType;
+use std::collections::VecDeque;
+use std::ffi::CString;
+use std::ffi::OsStr;
+use std::os::fd::AsRawFd;
+use std::os::fd::FromRawFd;
+use std::os::fd::OwnedFd;
+use std::os::unix::ffi::OsStrExt;
+use std::path::PathBuf;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::AtomicUsize;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::sync::Condvar;
+use std::sync::Mutex;
+
+// Room for a few hundred entries per getdents64
+const DIRENT_BUF_LEN: usize = 32 << 10;
+
+// Offsets into a struct linux_dirent64
+const DIRENT_RECLEN: usize = 16;
+const DIRENT_NAME: usize = 19;
+
+/// What was at a path when it was looked at.
+#[derive(Clone, Copy, Debug)]
+pub struct SnapshotEntry {
+    pub path_type: PathType,
+    /// Permissions and type, as in st_mode
+    pub mode: u32,
+    pub ino: u64,
+    pub size: u64,
+    pub mtime_ns: i64,
+}
+
+fn path_type_of(mode: u32) -> PathType {
+    match mode & libc::S_IFMT {
+        libc::S_IFDIR => PathType::Dir,
+        libc::S_IFREG => PathType::File,
+        libc::S_IFLNK => PathType::Symlink,
+        libc::S_IFBLK => PathType::Blockdev,
+        libc::S_IFSOCK => PathType::Socket,
+        _ => PathType::Unknown,
+    }
+}
+
+/// The entry for `name`, relative to `dir`, and the device it's on. Relative to an
+/// open directory, the kernel only resolves the last component, and with
+/// AT_STATX_DONT_SYNC, network filesystems answer from what they have cached.
+fn stat_at(dir: libc::c_int, name: &[u8]) -> Result<(SnapshotEntry, u64), std::io::Error> {
+    let name = CString::new(name)?;
+    let mut stx: libc::statx = unsafe { std::mem::zeroed() };
+    let flags = libc::AT_SYMLINK_NOFOLLOW | libc::AT_STATX_DONT_SYNC;
+    let mask = libc::STATX_TYPE
+        | libc::STATX_MODE
+        | libc::STATX_INO
+        | libc::STATX_SIZE
+        | libc::STATX_MTIME;
+    if unsafe { libc::statx(dir, name.as_ptr(), flags, mask, &mut stx) } != 0 {
+        return Err(std::io::Error::last_os_error());
+    }
+    let mode = stx.stx_mode as u32;
+    let entry = SnapshotEntry {
+        path_type: path_type_of(mode),
+        mode,
+        ino: stx.stx_ino,
+        size: stx.stx_size,
+        mtime_ns: stx.stx_mtime.tv_sec * 1_000_000_000 + stx.stx_mtime.tv_nsec as i64,
+    };
+    let dev = libc::makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    Ok((entry, dev))
+}
+
+/// The directory `name`, relative to `dir`, as for `stat_at`, so that only its
+/// last component is looked up, and a symlink in its place isn't followed.
+fn open_dir_at(dir: libc::c_int, name: &[u8]) -> Result<OwnedFd, std::io::Error> {
+    let name = CString::new(name)?;
+    let flags = libc::O_RDONLY | libc::O_DIRECTORY | libc::O_NOFOLLOW | libc::O_CLOEXEC;
+    match unsafe { libc::openat(dir, name.as_ptr(), flags) } {
+        fd if fd < 0 => Err(std::io::Error::last_os_error()),
+        fd => Ok(unsafe { OwnedFd::from_raw_fd(fd) }),
+    }
+}
+
+// Paths go away while we crawl. That's what the events are for.
+fn is_gone(e: &std::io::Error) -> bool {
+    matches!(e.raw_os_error(), Some(libc::ENOENT) | Some(libc::ENOTDIR))
+}
+
+struct Dir {
+    path: PathBuf,
+    // Of the root it's under, for `same_filesystem`
+    dev: u64,
+    // Open until the last of its subdirectories is, which are opened relative to it.
+    // None for the roots, which are opened by their paths.
+    parent: Option<Arc<OwnedFd>>,
+}
+
+impl Dir {
+    fn open(&self) -> Result<OwnedFd, std::io::Error> {
+        match (&self.parent, self.path.file_name()) {
+            (Some(parent), Some(name)) => open_dir_at(parent.as_raw_fd(), name.as_bytes()),
+            _ => open_dir_at(libc::AT_FDCWD, self.path.as_os_str().as_bytes()),
+        }
+    }
+}
+
+/// What a crawl found, in no particular order.
+pub(crate) struct Crawled {
+    pub(crate) entries: Vec<(PathBuf, SnapshotEntry)>,
+    /// Directories and entries we couldn't read, other than those which went away
+    pub(crate) errors: u64,
+}
+
+/// A walk over many threads. Each has a deque of directories, and takes the most
+/// recently found from its own, depth first, so that what it reads is still cached.
+/// When its own runs dry, it steals the oldest from someone else's, which are
+/// the directories nearest the root, and likeliest to have the most under them.
+/// When there's nothing to steal, it sleeps until there is, or until nothing's left.
+struct Crawl {
+    queues: Vec<Mutex<VecDeque<Dir>>>,
+    // Directories queued or being read. Nothing's left when there are none.
+    pending: AtomicUsize,
+    // Threads waiting on `wake`, which those who push only wake if there are
+    sleeping: AtomicUsize,
+    idle: Mutex<()>,
+    wake: Condvar,
+    same_filesystem: bool,
+    errors: AtomicU64,
+}
+
+impl Crawl {
+    fn push(&self, me: usize, dir: Dir) {
+        self.pending.fetch_add(1, Ordering::SeqCst);
+        self.queues[me].lock().unwrap().push_back(dir);
+        if self.sleeping.load(Ordering::SeqCst) > 0 {
+            let _idle = self.idle.lock().unwrap();
+            self.wake.notify_one();
+        }
+    }
+
+    fn done(&self) {
+        if self.pending.fetch_sub(1, Ordering::SeqCst) == 1 {
+            let _idle = self.idle.lock().unwrap();
+            self.wake.notify_all();
+        }
+    }
+
+    /// The next directory to read, waiting for one if someone else is still reading,
+    /// and may find more. None once nothing's left.
+    fn next(&self, me: usize) -> Option<Dir> {
+        loop {
+            if let Some(dir) = self.take(me) {
+                return Some(dir);
+            }
+            let idle = self.idle.lock().unwrap();
+            self.sleeping.fetch_add(1, Ordering::SeqCst);
+            // Pushed since we looked, before it could see us sleeping
+            let dir = self.take(me);
+            if dir.is_some() || self.pending.load(Ordering::SeqCst) == 0 {
+                self.sleeping.fetch_sub(1, Ordering::SeqCst);
+                return dir;
+            }
+            let idle = self.wake.wait(idle).unwrap();
+            self.sleeping.fetch_sub(1, Ordering::SeqCst);
+            drop(idle);
+        }
+    }
+
+    fn take(&self, me: usize) -> Option<Dir> {
+        if let Some(dir) = self.queues[me].lock().unwrap().pop_back() {
+            return Some(dir);
+        }
+        let others = self.queues.len();
+        (1..others).find_map(|idx| {
+            let victim = (me + idx) % others;
+            self.queues[victim].lock().unwrap().pop_front()
+        })
+    }
+
+    fn error(&self, what: &str, path: &PathBuf, e: std::io::Error) {
+        if !is_gone(&e) {
+            log::debug!("crawl: can't {what} {}: {e}", path.display());
+            self.errors.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn run(&self, me: usize) -> Vec<(PathBuf, SnapshotEntry)> {
+        let mut found = Vec::new();
+        let mut buf = vec![0u8; DIRENT_BUF_LEN];
+        while let Some(dir) = self.next(me) {
+            self.read_dir(me, &dir, &mut buf, &mut found);
+            self.done();
+        }
+        found
+    }
+
+    fn read_dir(
+        &self,
+        me: usize,
+        dir: &Dir,
+        buf: &mut [u8],
+        found: &mut Vec<(PathBuf, SnapshotEntry)>,
+    ) {
+        let fd = match dir.open() {
+            Ok(fd) => Arc::new(fd),
+            Err(e) => return self.error("open", &dir.path, e),
+        };
+        loop {
+            let len = unsafe {
+                libc::syscall(
+                    libc::SYS_getdents64,
+                    fd.as_raw_fd(),
+                    buf.as_mut_ptr(),
+                    buf.len(),
+                )
+            };
+            if len < 0 {
+                return self.error("read", &dir.path, std::io::Error::last_os_error());
+            }
+            if len == 0 {
+                return;
+            }
+            let mut at = 0;
+            while at < len as usize {
+                let reclen =
+                    u16::from_ne_bytes([buf[at + DIRENT_RECLEN], buf[at + DIRENT_RECLEN + 1]]);
+                let name = &buf[at + DIRENT_NAME..at + reclen as usize];
+                let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+                at += reclen as usize;
+                if name == b"." || name == b".." {
+                    continue;
+                }
+                let path = dir.path.join(OsStr::from_bytes(name));
+                let (entry, dev) = match stat_at(fd.as_raw_fd(), name) {
+                    Ok(stat) => stat,
+                    Err(e) => {
+                        self.error("stat", &path, e);
+                        continue;
+                    }
+                };
+                if let PathType::Dir = entry.path_type {
+                    if !self.same_filesystem || dev == dir.dev {
+                        let dev = dir.dev;
+                        self.push(
+                            me,
+                            Dir {
+                                path: path.clone(),
+                                dev,
+                                parent: Some(fd.clone()),
+                            },
+                        );
+                    }
+                }
+                found.push((path, entry));
+            }
+        }
+    }
+}
+
+/// Every path under the roots, and the roots, over `threads` threads.
+/// Symlinks aren't followed. Roots which don't exist are skipped.
+pub(crate) fn crawl(roots: &[PathBuf], threads: usize, same_filesystem: bool) -> Crawled {
+    let threads = threads.max(1);
+    let crawl = Crawl {
+        queues: (0..threads).map(|_| Default::default()).collect(),
+        pending: AtomicUsize::new(0),
+        sleeping: AtomicUsize::new(0),
+        idle: Mutex::new(()),
+        wake: Condvar::new(),
+        same_filesystem,
+        errors: AtomicU64::new(0),
+    };
+    let mut entries = Vec::new();
+    for (idx, root) in roots.iter().enumerate() {
+        let (entry, dev) = match stat_at(libc::AT_FDCWD, root.as_os_str().as_bytes()) {
+            Ok(stat) => stat,
+            Err(e) => {
+                crawl.error("stat", root, e);
+                continue;
+            }
+        };
+        if let PathType::Dir = entry.path_type {
+            let path = root.clone();
+            let parent = None;
+            crawl.push(idx % threads, Dir { path, dev, parent });
+        }
+        entries.push((root.clone(), entry));
+    }
+    std::thread::scope(|scope| {
+        let crawl = &crawl;
+        let workers: Vec<_> = (0..threads)
+            .map(|me| scope.spawn(move || crawl.run(me)))
+            .collect();
+        for worker in workers {
+            entries.extend(worker.join().unwrap());
+        }
+    });
+    Crawled {
+        entries,
+        errors: crawl.errors.into_inner(),
+    }
+}
@@ -24,6 +24,48 @@ pub enum EffectType {
     Association,
 }
 
+/// What's wrong with an event's path, if anything. Paths are read in the kernel
+/// under tight limits, so that they're cheap, and the kernel flags what didn't fit.
+/// Events without any flags can be trusted as they are; for the others, the path
+/// is only a hint, and should be looked up again, say under /proc/<pid>/fd or by
+/// rescanning the directory.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct EventFlags(u8);
+
+// Keep these in sync with the EF_* flags in 'src/bpf/watcher.bpf.c'
+impl EventFlags {
+    pub const NONE: EventFlags = EventFlags(0);
+    /// A name was cut short
+    pub const NAME_TRUNCATED: EventFlags = EventFlags(1 << 0);
+    /// The path was too long, and is missing some of its start
+    pub const PATH_TRUNCATED: EventFlags = EventFlags(1 << 1);
+    /// The path was too deep, and is missing some of its start
+    pub const DEPTH_EXHAUSTED: EventFlags = EventFlags(1 << 2);
+    /// Part of the path couldn't be read, and it's missing some of its start
+    pub const READ_FAILED: EventFlags = EventFlags(1 << 3);
+    /// The path had no mode yet, so its type is unknown
+    pub const MODE_UNKNOWN: EventFlags = EventFlags(1 << 4);
+
+    pub fn contains(self, flags: EventFlags) -> bool {
+        self.0 & flags.0 == flags.0
+    }
+
+    pub fn is_empty(self) -> bool {
+        self.0 == 0
+    }
+
+    /// Whether the path is all there, whatever its type
+    pub fn is_path_complete(self) -> bool {
+        self.0 & !Self::MODE_UNKNOWN.0 == 0
+    }
+}
+
+impl From<u8> for EventFlags {
+    fn from(value: u8) -> Self {
+        EventFlags(value)
+    }
+}
+
 // If we want to make associated events represent something other than
 // moved-to paths, like on a rename event, we can make a structure like this:
 //   pub struct EventFragment {
@@ -36,13 +78,49 @@ pub enum EffectType {
 // Which is just a subset of the Event struct. In the Event struct, we can
 // associate an Option<EventFragment> with the Event instead of a String.
 
+#[derive(Clone)]
 pub struct Event {
     pub path_name: String,
     pub associated: Option<String>,
     pub timestamp: u64,
     pub pid: u32,
+    /// The thread, within `pid`
+    pub tid: u32,
+    /// Effective ids
+    pub euid: u32,
+    pub egid: u32,
+    /// The thread's name, as in /proc/<pid>/task/<tid>/comm, NUL-padded. See `comm`.
+    pub comm: [u8; 16],
+    /// The cgroup (v2) of the process, as its directory's inode number
+    pub cgroup_id: u64,
+    /// The mount the path is on, as in /proc/<pid>/mountinfo, or 0 if the probe
+    /// didn't know it, as for creations by security_inode_create
+    pub mount_id: u32,
     pub path_type: PathType,
     pub effect_type: EffectType,
+    /// Of `path_name`, from the kernel, as `path_hash` would give
+    pub path_hash: u64,
+    /// Of `path_name`'s parent directory, likewise
+    pub parent_hash: u64,
+    /// Whether `path_name` is to be trusted
+    pub flags: EventFlags,
+}
+
+impl Event {
+    pub fn comm(&self) -> std::borrow::Cow<'_, str> {
+        let len = self
+            .comm
+            .iter()
+            .position(|&b| b == 0)
+            .unwrap_or(self.comm.len());
+        String::from_utf8_lossy(&self.comm[..len])
+    }
+
+    /// Roughly what the event takes up, with its paths, for a `MemoryBudget`.
+    pub fn buffered_size(&self) -> usize {
+        let associated = self.associated.as_ref().map_or(0, String::capacity);
+        std::mem::size_of::<Self>() + self.path_name.capacity() + associated
+    }
 }
 
 unsafe impl plain::Plain for RawEvent {}
@@ -72,42 +150,75 @@ impl RawEvent {
     // And return a list of pairs of offsets:
     //   [(0, 9), (9, 15), (15, 20)]
     #[cfg(feature = "ev-array")]
-    fn reordered_name_offsets(&self) -> Vec<(u16, u16)> {
-        let mut reordered = Vec::with_capacity(64);
-        for idx in (1..self.name_offsets.len()).rev() {
-            let end = self.name_offsets[idx - 1] as u16;
-            if end == 0 {
-                log::trace!("idx: {idx}, @ end: {end}");
-                break;
-            } else {
-                let beg = self.name_offsets[idx] as u16;
-                log::trace!("idx: {idx}, beg: {beg}, end: {end}");
-                reordered.push((beg, end));
-            }
-        }
-        reordered.reverse();
-        reordered
+    fn reordered_name_offsets(&self) -> impl Iterator<Item = (usize, usize)> + '_ {
+        // Without collecting them, for `reordered_buf_into`, which mustn't allocate.
+        // The pairs run from the last one found, backwards, to the first.
+        let offsets = &self.name_offsets;
+        let first = first_name_offset(offsets);
+        log::trace!("names at offsets {first}..{}", offsets.len());
+        (first..offsets.len()).map(move |idx| (offsets[idx] as usize, offsets[idx - 1] as usize))
     }
 
+    /// Into `name`, which is cleared first, reusing whatever it has allocated.
+    /// The names are copied in as bytes and checked once, as a whole, rather than
+    /// name by name; std's check skips through ASCII a word at a time, and
+    /// paths are nearly all ASCII. Names which aren't UTF-8 are made so, lossily.
     #[cfg(feature = "ev-array")]
-    pub(crate) fn reordered_buf_to_string(&self) -> String {
-        let name_offsets = self.reordered_name_offsets();
+    pub(crate) fn reordered_buf_into(&self, name: &mut String) {
         let buf = self.buf_as_bytes();
-        let mut name = String::with_capacity(256);
-        for (beg, end) in name_offsets {
-            let span = &buf[beg as usize..end as usize];
-            let utf8 = std::str::from_utf8(span).unwrap();
-            name.push_str("/");
-            name.push_str(utf8);
+        let mut bytes = std::mem::take(name).into_bytes();
+        bytes.clear();
+        for (beg, end) in self.reordered_name_offsets() {
+            bytes.push(b'/');
+            bytes.extend_from_slice(&buf[beg..end]);
         }
-        log::trace!("raw name offsets: {:?}, raw buf: {:?}, name: {}", self.name_offsets, buf, name);
-        name
+        *name = match String::from_utf8(bytes) {
+            Ok(utf8) => utf8,
+            Err(e) => String::from_utf8_lossy(e.as_bytes()).into_owned(),
+        };
+        log::trace!(
+            "raw name offsets: {:?}, raw buf: {:?}, name: {}",
+            self.name_offsets,
+            buf,
+            name
+        );
     }
 }
 
-impl From<MaybeUninit<u8>> for EffectType {
-    fn from(value: MaybeUninit<u8>) -> Self {
-        EffectType::from(unsafe { value.assume_init() })
+// The high bit of every byte in a word, and the rest
+#[cfg(feature = "ev-array")]
+const HIGH_BITS: u64 = 0x8080_8080_8080_8080;
+#[cfg(feature = "ev-array")]
+const LOW_BITS: u64 = !HIGH_BITS;
+
+/// Where the pairs of name offsets start: two past the last zero, not counting
+/// the last offset, which is the innermost name's start, and always zero.
+/// Found a word at a time, from the end, with the high bit set in each byte
+/// which is zero (and only those). Most paths are shallow enough for the
+/// last word to have a zero in it, so this is usually one word's work.
+#[cfg(feature = "ev-array")]
+fn first_name_offset(offsets: &[u8]) -> usize {
+    let words = offsets.len() / 8;
+    for word in (0..words).rev() {
+        let at = word * 8;
+        let mut bytes = u64::from_le_bytes(offsets[at..at + 8].try_into().unwrap());
+        if word == words - 1 {
+            bytes |= 0xff << 56;
+        }
+        let zeros = !(((bytes & LOW_BITS) + LOW_BITS) | bytes | LOW_BITS);
+        if zeros != 0 {
+            let last_zero = at + (63 - zeros.leading_zeros() as usize) / 8;
+            return last_zero + 2;
+        }
+    }
+    1
+}
+
+impl TryFrom<MaybeUninit<u8>> for EffectType {
+    type Error = std::io::ErrorKind;
+
+    fn try_from(value: MaybeUninit<u8>) -> Result<Self, Self::Error> {
+        EffectType::try_from(unsafe { value.assume_init() })
     }
 }
 
@@ -132,16 +243,160 @@ impl From<u8> for PathType {
     }
 }
 
-impl From<u8> for EffectType {
-    fn from(value: u8) -> Self {
+/// Fallible, as records other than events share the stream, like the process
+/// lifecycle's, which a stale probe may still be sending when nobody's asked.
+impl TryFrom<u8> for EffectType {
+    type Error = std::io::ErrorKind;
+
+    fn try_from(value: u8) -> Result<Self, Self::Error> {
         match value {
-            0 => EffectType::Create,
-            1 => EffectType::Rename,
-            2 => EffectType::Link,
-            3 => EffectType::Delete,
-            4 => EffectType::Continuation,
-            5 => EffectType::Association,
-            _ => unreachable!(),
+            0 => Ok(EffectType::Create),
+            1 => Ok(EffectType::Rename),
+            2 => Ok(EffectType::Link),
+            3 => Ok(EffectType::Delete),
+            4 => Ok(EffectType::Continuation),
+            5 => Ok(EffectType::Association),
+            _ => Err(std::io::ErrorKind::InvalidData),
+        }
+    }
+}
+
+impl From<PathType> for u8 {
+    fn from(value: PathType) -> Self {
+        match value {
+            PathType::Dir => 0,
+            PathType::File => 1,
+            PathType::Symlink => 2,
+            PathType::Hardlink => 3,
+            PathType::Blockdev => 4,
+            PathType::Socket => 5,
+            PathType::Continuation => 6,
+            PathType::Unknown => 7,
+        }
+    }
+}
+
+impl From<EffectType> for u8 {
+    fn from(value: EffectType) -> Self {
+        match value {
+            EffectType::Create => 0,
+            EffectType::Rename => 1,
+            EffectType::Link => 2,
+            EffectType::Delete => 3,
+            EffectType::Continuation => 4,
+            EffectType::Association => 5,
+        }
+    }
+}
+
+#[cfg(all(test, feature = "ev-array"))]
+mod tests {
+    use super::*;
+
+    // As it was found before, an offset at a time
+    fn first_name_offset_scalar(offsets: &[u8]) -> usize {
+        let mut first = offsets.len();
+        while first > 1 && offsets[first - 2] != 0 {
+            first -= 1;
+        }
+        first
+    }
+
+    // Offsets as a path `depth` names deep would have them, from the end
+    fn offsets_at_depth(depth: usize) -> [u8; 64] {
+        let mut offsets = [0u8; 64];
+        for (idx, offset) in offsets.iter_mut().rev().take(depth + 1).enumerate() {
+            *offset = (idx * 4) as u8;
+        }
+        offsets
+    }
+
+    #[test]
+    fn first_name_offset_finds_each_zero() {
+        assert_eq!(
+            first_name_offset(&[0; 64]),
+            first_name_offset_scalar(&[0; 64])
+        );
+        assert_eq!(
+            first_name_offset(&[255; 64]),
+            first_name_offset_scalar(&[255; 64])
+        );
+        // The last zero on either side of each word boundary, among every value
+        // the trick could confuse with one: 1 and 0x80 and 255 especially
+        for fill in [1, 0x7f, 0x80, 0x81, 0xfe, 255] {
+            for zero in 0..64 {
+                let mut offsets = [fill; 64];
+                offsets[zero] = 0;
+                assert_eq!(
+                    first_name_offset(&offsets),
+                    first_name_offset_scalar(&offsets),
+                    "zero at {zero} among {fill}s"
+                );
+                offsets[..zero].fill(0);
+                assert_eq!(
+                    first_name_offset(&offsets),
+                    first_name_offset_scalar(&offsets),
+                    "zeros up to {zero} before {fill}s"
+                );
+            }
+        }
+        for depth in 0..64 {
+            let offsets = offsets_at_depth(depth);
+            assert_eq!(
+                first_name_offset(&offsets),
+                first_name_offset_scalar(&offsets)
+            );
+        }
+    }
+
+    #[test]
+    fn first_name_offset_agrees_on_any_offsets() {
+        // A xorshift, so that the same arrays are tried each time
+        let mut state = 0x9e37_79b9_7f4a_7c15u64;
+        let mut next = || {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            state
+        };
+        for _ in 0..100_000 {
+            let mut offsets = [0u8; 64];
+            for offset in offsets.iter_mut() {
+                let random = next();
+                // Mostly zeros, so that they land everywhere
+                *offset = match random % 4 {
+                    0 => 0,
+                    _ => (random >> 8) as u8,
+                };
+            }
+            assert_eq!(
+                first_name_offset(&offsets),
+                first_name_offset_scalar(&offsets),
+                "{offsets:?}"
+            );
+        }
+    }
+
+    /// Not a check, but a benchmark, for want of a harness:
+    ///   cargo test --release -p bpf-fs-events -- --ignored --nocapture
+    #[test]
+    #[ignore]
+    fn first_name_offset_bench() {
+        const ROUNDS: u32 = 10_000_000;
+        for depth in [2, 7, 15, 40] {
+            let offsets = offsets_at_depth(depth);
+            let time = |find: fn(&[u8]) -> usize| {
+                let start = std::time::Instant::now();
+                for _ in 0..ROUNDS {
+                    std::hint::black_box(find(std::hint::black_box(&offsets)));
+                }
+                start.elapsed().as_secs_f64() * 1e9 / ROUNDS as f64
+            };
+            let scalar = time(first_name_offset_scalar);
+            let by_word = time(first_name_offset);
+            println!(
+                "depth {depth}: {scalar:.2}ns an offset at a time, {by_word:.2}ns a word at a time"
+            );
         }
     }
 }
@@ -0,0 +1,136 @@
+use std::path::Path;
+
+// Tracing programs are typed against the kernel's own BTF, found here
+const VMLINUX_BTF: &str = "/sys/kernel/btf/vmlinux";
+// The LSMs which are enabled, as in lsm= on the kernel's command line
+const ACTIVE_LSMS: &str = "/sys/kernel/security/lsm";
+
+/// What the kernel can do for us, which decides which of the skeleton's
+/// variants are loaded. Each program comes as a kprobe, an fentry or an LSM
+/// program, with an unrolled walk or a bpf_loop one; events go to a perf
+/// buffer or a ringbuf.
+/// We take the fastest the kernel has, so one build does its best everywhere.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Features {
+    /// fentry programs (5.5+, with BTF), which are cheaper to enter than kprobes
+    pub fentry: bool,
+    /// LSM programs (5.7+, with the BPF LSM enabled), which cache what the
+    /// ignore rules make of each directory on its inode. Implies fentry.
+    pub lsm: bool,
+    /// Whole events into a ringbuf (5.8+), rather than the perf buffer
+    pub ringbuf: bool,
+    /// The path walk as a bpf_loop (5.17+), rather than unrolled
+    pub bpf_loop: bool,
+}
+
+fn probed(what: &str, result: std::ffi::c_int) -> bool {
+    match result {
+        1 => true,
+        0 => {
+            log::info!("no support for {what}");
+            false
+        }
+        err => {
+            let err = std::io::Error::from_raw_os_error(-err);
+            log::warn!("couldn't tell if there's support for {what}: {err}");
+            false
+        }
+    }
+}
+
+impl Features {
+    /// Asks the kernel, by loading tiny programs and creating tiny maps.
+    /// Logs what we found, and what we chose.
+    pub fn probe() -> Self {
+        let null = std::ptr::null();
+        let tracing = probed("tracing programs", unsafe {
+            libbpf_sys::libbpf_probe_bpf_prog_type(libbpf_sys::BPF_PROG_TYPE_TRACING, null)
+        });
+        let btf = Path::new(VMLINUX_BTF).exists();
+        if !btf {
+            log::info!("no kernel BTF at {VMLINUX_BTF}");
+        }
+        let lsm_progs = probed("LSM programs", unsafe {
+            libbpf_sys::libbpf_probe_bpf_prog_type(libbpf_sys::BPF_PROG_TYPE_LSM, null)
+        });
+        // Built in, but only there if it's been enabled at boot
+        let bpf_lsm = std::fs::read_to_string(ACTIVE_LSMS)
+            .map(|lsms| lsms.trim().split(',').any(|lsm| lsm == "bpf"))
+            .unwrap_or(false);
+        if lsm_progs && !bpf_lsm {
+            log::info!("the BPF LSM isn't enabled");
+        }
+        let ringbuf = probed("ringbufs", unsafe {
+            libbpf_sys::libbpf_probe_bpf_map_type(libbpf_sys::BPF_MAP_TYPE_RINGBUF, null)
+        });
+        let bpf_loop = probed("bpf_loop", unsafe {
+            libbpf_sys::libbpf_probe_bpf_helper(
+                libbpf_sys::BPF_PROG_TYPE_KPROBE,
+                libbpf_sys::BPF_FUNC_loop,
+                null,
+            )
+        });
+        let features = Self {
+            fentry: tracing && btf,
+            lsm: tracing && btf && lsm_progs && bpf_lsm,
+            ringbuf,
+            bpf_loop,
+        };
+        log::info!("using {features}");
+        features
+    }
+
+    /// What to try next, for when our programs load, but won't attach.
+    /// LSM programs before fentry, and fentry before kprobes. Trampolines came
+    /// to some architectures much later than to x86, for one.
+    pub(crate) fn fallback(self) -> Option<Self> {
+        if self.lsm {
+            Some(Self { lsm: false, ..self })
+        } else if self.fentry {
+            Some(Self {
+                fentry: false,
+                ..self
+            })
+        } else {
+            None
+        }
+    }
+
+    /// Our programs are named <variant>__<function>.
+    fn prog_variant(&self) -> &'static str {
+        match (self.lsm, self.fentry, self.bpf_loop) {
+            (true, _, false) => "lsm",
+            (true, _, true) => "lsm_loop",
+            (false, false, false) => "kprobe",
+            (false, false, true) => "kprobe_loop",
+            (false, true, false) => "fentry",
+            (false, true, true) => "fentry_loop",
+        }
+    }
+
+    pub(crate) fn loads_prog(&self, name: &str) -> bool {
+        name.split("__").next() == Some(self.prog_variant())
+    }
+}
+
+impl std::fmt::Display for Features {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(
+            f,
+            "{} probes, {} walk, {} output",
+            match (self.lsm, self.fentry) {
+                (true, _) => "lsm",
+                (false, true) => "fentry",
+                (false, false) => "kprobe",
+            },
+            match self.bpf_loop {
+                true => "bpf_loop",
+                false => "unrolled",
+            },
+            match self.ringbuf {
+                true => "ringbuf",
+                false => "perf buffer",
+            },
+        )
+    }
+}
@@ -0,0 +1,107 @@
+use libbpf_rs::MapFlags;
+use libbpf_rs::MapHandle;
+use std::path::PathBuf;
+
+/// A filesystem, as far as the kernel's filter is concerned.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum Filesystem {
+    /// Whatever is mounted here, by its device. Has to be a mount point: any other
+    /// path is on the filesystem of the mount above it, which it would filter.
+    Mount(PathBuf),
+    /// Every filesystem of a type, by its superblock magic, like 0x01021994 for tmpfs
+    Magic(u64),
+}
+
+/// Which filesystems to watch. Checked first thing in each probe, from the
+/// dentry's superblock, so filtered-out filesystems cost a couple of lookups.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub enum FsFilter {
+    #[default]
+    All,
+    Only(Vec<Filesystem>),
+    Except(Vec<Filesystem>),
+}
+
+// From 'include/uapi/linux/magic.h', for the ones we're most often asked to skip
+const MAGICS: &[(&str, u64)] = &[
+    ("tmpfs", 0x01021994),
+    ("proc", 0x9fa0),
+    ("sysfs", 0x62656572),
+    ("devpts", 0x1cd1),
+    ("cgroup2", 0x63677270),
+    ("overlay", 0x794c7630),
+    ("ext4", 0xef53),
+    ("xfs", 0x58465342),
+    ("btrfs", 0x9123683e),
+];
+
+impl std::str::FromStr for Filesystem {
+    type Err = String;
+
+    /// A mount path, a type name from the table above, or a magic number in hex.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        if s.starts_with('/') {
+            return Ok(Filesystem::Mount(PathBuf::from(s)));
+        }
+        if let Some((_, magic)) = MAGICS.iter().find(|(name, _)| *name == s) {
+            return Ok(Filesystem::Magic(*magic));
+        }
+        match u64::from_str_radix(s.trim_start_matches("0x"), 16) {
+            Ok(magic) => Ok(Filesystem::Magic(magic)),
+            Err(_) => Err(format!("not a mount path, filesystem type or magic: {s}")),
+        }
+    }
+}
+
+// Mode values for 'fs_filter' in 'src/bpf/watcher.bpf.c'
+const MODE_ALL: u8 = 0;
+const MODE_ONLY: u8 = 1;
+const MODE_EXCEPT: u8 = 2;
+
+impl FsFilter {
+    pub(crate) fn mode(&self) -> u8 {
+        match self {
+            FsFilter::All => MODE_ALL,
+            FsFilter::Only(_) => MODE_ONLY,
+            FsFilter::Except(_) => MODE_EXCEPT,
+        }
+    }
+
+    fn filesystems(&self) -> &[Filesystem] {
+        match self {
+            FsFilter::All => &[],
+            FsFilter::Only(filesystems) | FsFilter::Except(filesystems) => filesystems,
+        }
+    }
+}
+
+/// Fills the filter maps, replacing whatever a previous owner of pinned maps left.
+pub(crate) fn fill(
+    filter: &FsFilter,
+    devs: &MapHandle,
+    magics: &MapHandle,
+) -> Result<(), Box<dyn std::error::Error>> {
+    crate::scope::clear(devs)?;
+    crate::scope::clear(magics)?;
+    let mut mounts = None;
+    for filesystem in filter.filesystems() {
+        match filesystem {
+            Filesystem::Mount(path) => {
+                let mounts = match &mut mounts {
+                    Some(mounts) => mounts,
+                    None => mounts.insert(crate::mountinfo::mounts()?),
+                };
+                let mount = crate::mountinfo::mounted_at(mounts, &std::fs::canonicalize(path)?)
+                    .ok_or_else(|| format!("nothing is mounted at {}", path.display()))?;
+                let dev = mount.dev;
+                devs.update(&dev.to_ne_bytes(), &[1], MapFlags::ANY)?;
+                log::info!("filtering device {dev:#x}, mounted at {}", path.display());
+            }
+            Filesystem::Magic(magic) => {
+                magics.update(&magic.to_ne_bytes(), &[1], MapFlags::ANY)?;
+                log::info!("filtering filesystems of type {magic:#x}");
+            }
+        }
+    }
+    Ok(())
+}
@@ -0,0 +1,36 @@
+// Keep these in sync with 'src/bpf/watcher.bpf.c'
+const PATH_HASH_PRIME: u64 = 0x9e3779b97f4a7c15;
+
+/// The finalizer from MurmurHash3
+pub(crate) fn mix64(mut h: u64) -> u64 {
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    h
+}
+
+/// Over the length, then each little-endian word, the last zero-padded.
+fn component_hash(name: &[u8]) -> u64 {
+    name.chunks(8).fold(mix64(name.len() as u64), |h, chunk| {
+        let mut word = [0u8; 8];
+        word[..chunk.len()].copy_from_slice(chunk);
+        mix64(h ^ u64::from_le_bytes(word))
+    })
+}
+
+/// The hash the kernel gives each event's `path_hash`, and its `parent_hash`
+/// (which is the hash of the parent's path). Empty components, as from
+/// doubled or trailing slashes, are skipped, so "/a//b/" hashes as "/a/b".
+/// Stable across builds and hosts, so it's fine to store.
+pub fn path_hash(path: &str) -> u64 {
+    let (sum, _) = path.split('/').filter(|name| !name.is_empty()).rev().fold(
+        (0u64, 1u64),
+        |(sum, power), name| {
+            let term = component_hash(name.as_bytes()).wrapping_mul(power);
+            (sum.wrapping_add(term), power.wrapping_mul(PATH_HASH_PRIME))
+        },
+    );
+    mix64(sum)
+}
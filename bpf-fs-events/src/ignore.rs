@@ -0,0 +1,93 @@
+use crate::hash::mix64;
+use libbpf_rs::MapFlags;
+use libbpf_rs::MapHandle;
+
+// Keep these in sync with 'src/bpf/watcher.bpf.c'
+const NAME_MAX: usize = 16;
+const SUFFIX_MAX: usize = 8;
+
+/// Paths to skip in the kernel, during the walk, before they're ever copied out.
+/// A path is skipped if any of its components is one of `names`, or if its last
+/// component ends in one of `suffixes`. Names can be at most 16 bytes long,
+/// and suffixes 8, since the kernel only looks that far into each name.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct IgnoreRules {
+    pub names: Vec<String>,
+    pub suffixes: Vec<String>,
+}
+
+impl IgnoreRules {
+    /// What nearly everyone skips: version control, build output and editor droppings.
+    pub fn common() -> Self {
+        let owned = |all: &[&str]| all.iter().map(|s| s.to_string()).collect();
+        Self {
+            names: owned(&[
+                ".git",
+                ".hg",
+                ".svn",
+                "node_modules",
+                "target",
+                "__pycache__",
+            ]),
+            suffixes: owned(&[".o", ".tmp", ".swp", ".swo", ".swx", "~"]),
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.names.is_empty() && self.suffixes.is_empty()
+    }
+}
+
+/// The kernel's hash of a name: two little-endian words, zero-padded, and the length.
+fn name_hash(name: &[u8]) -> u64 {
+    let mut words = [0u8; NAME_MAX];
+    words[..name.len()].copy_from_slice(name);
+    let lo = u64::from_le_bytes(words[..8].try_into().unwrap());
+    let hi = u64::from_le_bytes(words[8..].try_into().unwrap());
+    mix64(lo ^ mix64(hi ^ name.len() as u64))
+}
+
+fn insert(map: &MapHandle, rule: &str, max: usize) -> Result<(), Box<dyn std::error::Error>> {
+    if rule.is_empty() || rule.len() > max || rule.contains('/') {
+        return Err(
+            format!("can't ignore {rule:?}: must be 1 to {max} bytes, without a '/'").into(),
+        );
+    }
+    map.update(
+        &name_hash(rule.as_bytes()).to_ne_bytes(),
+        &[1],
+        MapFlags::ANY,
+    )?;
+    Ok(())
+}
+
+/// Fills the rule maps, replacing whatever a previous owner of pinned maps left.
+/// Every verdict the kernel cached on a directory under the old rules is stale
+/// once the generation's bumped, and none is good before the first bump.
+pub(crate) fn fill(
+    rules: &IgnoreRules,
+    names: &MapHandle,
+    suffixes: &MapHandle,
+    generation: &MapHandle,
+) -> Result<(), Box<dyn std::error::Error>> {
+    crate::scope::clear(names)?;
+    crate::scope::clear(suffixes)?;
+    for name in &rules.names {
+        insert(names, name, NAME_MAX)?;
+    }
+    for suffix in &rules.suffixes {
+        insert(suffixes, suffix, SUFFIX_MAX)?;
+    }
+    let key = 0u32.to_ne_bytes();
+    let current = match generation.lookup(&key, MapFlags::ANY)? {
+        Some(value) => u32::from_ne_bytes(value[..4].try_into()?),
+        None => 0,
+    };
+    generation.update(&key, &current.wrapping_add(1).to_ne_bytes(), MapFlags::ANY)?;
+    log::info!(
+        "ignoring {} names and {} suffixes",
+        rules.names.len(),
+        rules.suffixes.len()
+    );
+    Ok(())
+}
@@ -1,6 +1,50 @@
+use crate::budget::MemoryBudget;
 use crate::event::EffectType;
 use crate::event::Event;
 use crate::event::RawEvent;
+use crate::metrics::Metrics;
+use crate::pool::PathPool;
+use crate::process::ProcessCache;
+use std::collections::VecDeque;
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+use std::sync::Mutex;
+
+/// A complete event, with when our callback got it, for the latency histograms,
+/// and how many events were shed just before it, for the memory budget.
+pub(crate) type Received = (Event, u64, u64);
+
+/// Between our callback and `FsEvents`. A deque rather than a channel, as it
+/// keeps its capacity, where a channel allocates as it goes.
+pub(crate) type Queue = Arc<Mutex<VecDeque<Received>>>;
+
+fn receive(metrics: &Metrics, event: &Event) -> u64 {
+    let now = crate::metrics::monotonic_ns();
+    let effect_type = u8::from(event.effect_type) as usize;
+    metrics.events_by_effect[effect_type].fetch_add(1, Ordering::Relaxed);
+    metrics
+        .kernel_to_callback_ns
+        .record(now.saturating_sub(event.timestamp));
+    now
+}
+
+/// Charges the budget for an event about to be queued. None if it's shed instead,
+/// or else how many were shed since the last one queued, for it to carry.
+fn charge(
+    budget: &Option<Arc<MemoryBudget>>,
+    metrics: &Metrics,
+    shed: &mut u64,
+    event: &Event,
+) -> Option<u64> {
+    if let Some(budget) = budget {
+        if !budget.try_charge(event.buffered_size()) {
+            metrics.events_shed.fetch_add(1, Ordering::Relaxed);
+            *shed += 1;
+            return None;
+        }
+    }
+    Some(std::mem::take(shed))
+}
 
 #[derive(Clone, Copy)]
 enum Continuation {
@@ -11,9 +55,26 @@ enum Continuation {
 #[cfg(feature = "ev-array")]
 type PathAcc = String;
 
+// Associations waiting on their events, at most. Each thread has one at a time.
+#[cfg(feature = "ev-array")]
+const ASSOCIATIONS_PENDING_MAX: usize = 64;
+
+/// An association, waiting on the event it goes with, which its thread
+/// sends right after it, with the same timestamp. Events from other CPUs
+/// may come in between, so it's matched to its event by both.
+#[cfg(feature = "ev-array")]
+struct Association {
+    tid: u32,
+    timestamp: u64,
+    path: String,
+}
+
 struct PartialPaths {
     path_name: PathAcc,
+    #[cfg(feature = "ev-ringbuf")]
     associated: Option<PathAcc>,
+    #[cfg(feature = "ev-array")]
+    associated: Vec<Association>,
     // event_group_id: u16,
     state: Continuation,
 }
@@ -48,7 +109,7 @@ impl PartialPaths {
     fn new() -> Self {
         Self {
             path_name: PathAcc::new(),
-            associated: None,
+            associated: Default::default(),
             // event_group_id: 0,
             state: Continuation::Pending,
         }
@@ -81,13 +142,17 @@ impl PartialPaths {
             self.event_group_id = event.event_group_id;
         }
         */
+        let Ok(effect_type) = EffectType::try_from(event.effect_type) else {
+            log::debug!("dropping a record of unknown effect {}", event.effect_type);
+            return None;
+        };
         eprintln!(
             "  effect type: {:?}, path type: {:?}, path name: {}",
-            EffectType::from(event.effect_type),
+            effect_type,
             crate::event::PathType::from(event.path_type),
             event.path_name_buf_to_str()
         );
-        match EffectType::from(event.effect_type) {
+        match effect_type {
             EffectType::Continuation => {
                 let path_name = event.path_name_buf_to_str().to_string();
                 match self.associated {
@@ -116,33 +181,86 @@ impl PartialPaths {
                     associated,
                     timestamp: event.timestamp,
                     pid: event.pid,
+                    tid: event.tid,
+                    euid: event.euid,
+                    egid: event.egid,
+                    comm: event.comm,
+                    cgroup_id: event.cgroup_id,
+                    mount_id: event.mount_id,
                     path_type: event.path_type.into(),
                     effect_type: terminal_effect_type,
+                    path_hash: event.path_hash,
+                    parent_hash: event.parent_hash,
+                    flags: event.flags.into(),
                 })
             }
         }
     }
 
+    /// The association `event` goes with, if its thread sent one. One which doesn't
+    /// go with it, as when the kernel lost the event it did go with, is dropped.
     #[cfg(feature = "ev-array")]
-    fn continue_with(&mut self, event: &RawEvent) -> Option<Event> {
-        match EffectType::from(event.effect_type) {
+    fn associated_with(
+        &mut self,
+        event: &RawEvent,
+        effect_type: EffectType,
+        pool: &PathPool,
+    ) -> Option<String> {
+        let idx = self.associated.iter().position(|a| a.tid == event.tid)?;
+        let association = self.associated.remove(idx);
+        let partner = matches!(effect_type, EffectType::Rename | EffectType::Link);
+        if partner && association.timestamp == event.timestamp {
+            return Some(association.path);
+        }
+        pool.put(association.path);
+        None
+    }
+
+    #[cfg(feature = "ev-array")]
+    fn continue_with(&mut self, event: &RawEvent, pool: &PathPool) -> Option<Event> {
+        let Ok(effect_type) = EffectType::try_from(event.effect_type) else {
+            log::debug!("dropping a record of unknown effect {}", event.effect_type);
+            return None;
+        };
+        match effect_type {
             EffectType::Association => {
-                self.associated = Some(event.reordered_buf_to_string());
+                let mut path = pool.take();
+                event.reordered_buf_into(&mut path);
+                // Only if the event it went with never came, or the thread's gone
+                let stale = match self.associated.iter().position(|a| a.tid == event.tid) {
+                    Some(idx) => Some(idx),
+                    None if self.associated.len() == ASSOCIATIONS_PENDING_MAX => Some(0),
+                    None => None,
+                };
+                if let Some(idx) = stale {
+                    pool.put(self.associated.remove(idx).path);
+                }
+                self.associated.push(Association {
+                    tid: event.tid,
+                    timestamp: event.timestamp,
+                    path,
+                });
                 None
             }
             terminal_effect_type => {
-                let associated = match &self.associated {
-                    Some(associated) => Some(associated.clone()),
-                    None => None,
-                };
-                self.associated = None;
+                let mut path_name = pool.take();
+                event.reordered_buf_into(&mut path_name);
                 Some(Event {
-                    path_name: event.reordered_buf_to_string(),
-                    associated,
+                    path_name,
+                    associated: self.associated_with(event, terminal_effect_type, pool),
                     timestamp: event.timestamp,
                     pid: event.pid,
+                    tid: event.tid,
+                    euid: event.euid,
+                    egid: event.egid,
+                    comm: event.comm,
+                    cgroup_id: event.cgroup_id,
+                    mount_id: event.mount_id,
                     path_type: event.path_type.into(),
                     effect_type: terminal_effect_type,
+                    path_hash: event.path_hash,
+                    parent_hash: event.parent_hash,
+                    flags: event.flags.into(),
                 })
             }
         }
@@ -151,15 +269,27 @@ impl PartialPaths {
 
 #[cfg(feature = "ev-ringbuf")]
 pub(crate) fn accumulating_event_stream_proxy(
-    tx: std::sync::mpsc::Sender<Event>,
+    queue: Queue,
+    metrics: std::sync::Arc<Metrics>,
+    processes: Option<std::sync::Arc<ProcessCache>>,
+    budget: Option<Arc<MemoryBudget>>,
+    _pool: Arc<PathPool>,
 ) -> impl FnMut(&[u8]) -> i32 {
     let mut path_parsing_state = PartialPaths::new();
+    let mut shed = 0;
     move |data: &[u8]| {
         let event = match plain::from_bytes(data) {
             Ok(event) => event,
             // Big oops, unexpected event format, mismatch between BPF and Rust types
             Err(_) => return 1,
         };
+        metrics.records_received.fetch_add(1, Ordering::Relaxed);
+        if processes
+            .as_ref()
+            .is_some_and(|processes| processes.take(event))
+        {
+            return 0;
+        }
         // Event paths may be sent in pieces. Accumulating them here...
         let event = path_parsing_state.continue_with(event);
         match event {
@@ -167,11 +297,14 @@ pub(crate) fn accumulating_event_stream_proxy(
             None => 0,
             // Sending them along when we do
             Some(complete_event) => {
-                match tx.send(complete_event) {
-                    Ok(_) => 0,
-                    // If the receiver has not been dropped, of course.
-                    Err(_) => 1,
-                }
+                let Some(shed_before) = charge(&budget, &metrics, &mut shed, &complete_event)
+                else {
+                    return 0;
+                };
+                let received_at = receive(&metrics, &complete_event);
+                let mut queue = queue.lock().unwrap();
+                queue.push_back((complete_event, received_at, shed_before));
+                0
             }
         }
     }
@@ -179,16 +312,38 @@ pub(crate) fn accumulating_event_stream_proxy(
 
 #[cfg(feature = "ev-array")]
 pub(crate) fn accumulating_event_stream_proxy(
-    tx: std::sync::mpsc::Sender<Event>,
+    queue: Queue,
+    metrics: std::sync::Arc<Metrics>,
+    processes: Option<std::sync::Arc<ProcessCache>>,
+    budget: Option<Arc<MemoryBudget>>,
+    pool: Arc<PathPool>,
 ) -> impl FnMut(i32, &[u8]) -> () {
     let mut path_parsing_state = PartialPaths::new();
+    let mut shed = 0;
     move |_cpu: i32, event_as_bytes: &[u8]| {
         // Copying these bytes into an event ensures the correct alignment
         let mut event = crate::event::RawEvent::default();
         match plain::copy_from_bytes(&mut event, event_as_bytes) {
             Ok(_) => {
-                if let Some(complete_event) = path_parsing_state.continue_with(&event) {
-                    let _ = tx.send(complete_event);
+                metrics.records_received.fetch_add(1, Ordering::Relaxed);
+                if processes
+                    .as_ref()
+                    .is_some_and(|processes| processes.take(&event))
+                {
+                    return;
+                }
+                if let Some(complete_event) = path_parsing_state.continue_with(&event, &pool) {
+                    let Some(shed_before) = charge(&budget, &metrics, &mut shed, &complete_event)
+                    else {
+                        pool.put(complete_event.path_name);
+                        if let Some(associated) = complete_event.associated {
+                            pool.put(associated);
+                        }
+                        return;
+                    };
+                    let received_at = receive(&metrics, &complete_event);
+                    let mut queue = queue.lock().unwrap();
+                    queue.push_back((complete_event, received_at, shed_before));
                 }
             }
             Err(e) => {
@@ -197,3 +352,107 @@ pub(crate) fn accumulating_event_stream_proxy(
         }
     }
 }
+
+#[cfg(all(test, feature = "ev-array"))]
+mod tests {
+    use super::*;
+    use crate::pool::PooledEvent;
+    use std::cell::Cell;
+
+    thread_local! {
+        // Per thread, so that other tests running alongside don't count
+        static ALLOCATIONS: Cell<u64> = const { Cell::new(0) };
+    }
+
+    /// Counts each thread's heap allocations, then leaves them to the system allocator.
+    struct Counting;
+
+    unsafe impl std::alloc::GlobalAlloc for Counting {
+        unsafe fn alloc(&self, layout: std::alloc::Layout) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|n| n.set(n.get() + 1));
+            std::alloc::System.alloc(layout)
+        }
+
+        unsafe fn alloc_zeroed(&self, layout: std::alloc::Layout) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|n| n.set(n.get() + 1));
+            std::alloc::System.alloc_zeroed(layout)
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: std::alloc::Layout, size: usize) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|n| n.set(n.get() + 1));
+            std::alloc::System.realloc(ptr, layout, size)
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: std::alloc::Layout) {
+            std::alloc::System.dealloc(ptr, layout)
+        }
+    }
+
+    #[global_allocator]
+    static COUNTING: Counting = Counting;
+
+    /// A record as the probes write it: the names innermost first, their
+    /// offsets from the end of `name_offsets` on, and one more for the end.
+    fn raw_event(path: &str, effect_type: EffectType, tid: u32, timestamp: u64) -> RawEvent {
+        let mut event = RawEvent::default();
+        let buf = unsafe {
+            std::slice::from_raw_parts_mut(event.buf.as_mut_ptr() as *mut u8, event.buf.len() * 8)
+        };
+        let last = event.name_offsets.len() - 1;
+        let names = path.split('/').filter(|name| !name.is_empty()).rev();
+        for (depth, name) in names.enumerate() {
+            let at = event.buf_len as usize;
+            event.name_offsets[last - depth] = at as u8;
+            buf[at..at + name.len()].copy_from_slice(name.as_bytes());
+            event.buf_len += name.len() as u16;
+            event.name_offsets[last - depth - 1] = event.buf_len as u8;
+        }
+        event.effect_type = effect_type.into();
+        event.tid = tid;
+        event.timestamp = timestamp;
+        event
+    }
+
+    #[test]
+    fn decoding_allocates_nothing_once_warm() {
+        let pool = Arc::new(PathPool::new());
+        let mut paths = PartialPaths::new();
+        let records = [
+            raw_event("/home/user/notes.txt", EffectType::Create, 1, 1),
+            raw_event("/home/user/.notes.txt.swp", EffectType::Association, 2, 2),
+            raw_event("/home/user/notes.txt", EffectType::Rename, 2, 2),
+            raw_event(
+                "/var/lib/some/deeper/tree/of/files",
+                EffectType::Delete,
+                3,
+                3,
+            ),
+        ];
+        let renamed = paths.continue_with(&records[1], &pool);
+        let renamed = renamed.or_else(|| paths.continue_with(&records[2], &pool));
+        let renamed = renamed.unwrap();
+        assert_eq!(renamed.path_name, "/home/user/notes.txt");
+        assert_eq!(
+            renamed.associated.as_deref(),
+            Some("/home/user/.notes.txt.swp")
+        );
+        drop(PooledEvent::new(renamed, pool.clone()));
+        // The first round fills the pool, and the rest take from it
+        let mut allocated = 0;
+        let mut decoded = 0;
+        for round in 0..1000 {
+            let before = ALLOCATIONS.with(Cell::get);
+            for record in &records {
+                if let Some(event) = paths.continue_with(record, &pool) {
+                    decoded += 1;
+                    drop(PooledEvent::new(event, pool.clone()));
+                }
+            }
+            if round > 0 {
+                allocated += ALLOCATIONS.with(Cell::get) - before;
+            }
+        }
+        assert_eq!(allocated, 0);
+        assert_eq!(decoded, 3 * 1000);
+    }
+}
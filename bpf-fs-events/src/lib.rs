@@ -1,28 +1,144 @@
+mod budget;
+mod crawl;
 mod event;
+mod features;
+mod fs_filter;
+mod hash;
+mod ignore;
 mod ingest;
+mod mask;
+mod metrics;
+mod mountinfo;
+mod pool;
+mod process;
+mod prog_stats;
+mod scope;
+mod shared;
 mod skel_watcher;
+mod snapshot;
+pub use budget::MemoryBudget;
 use core::time::Duration;
+pub use crawl::SnapshotEntry;
 pub use event::EffectType;
 pub use event::Event;
+pub use event::EventFlags;
 pub use event::PathType;
+pub use features::Features;
+pub use fs_filter::Filesystem;
+pub use fs_filter::FsFilter;
+pub use hash::path_hash;
+pub use ignore::IgnoreRules;
 use libbpf_rs::skel::OpenSkel;
 use libbpf_rs::skel::Skel;
 use libbpf_rs::skel::SkelBuilder;
+pub use mask::EffectMask;
+pub use metrics::Histogram;
+pub use metrics::HistogramSnapshot;
+pub use metrics::KernelHistogram;
+pub use metrics::KernelStat;
+pub use metrics::Metrics;
+pub use metrics::EFFECT_TYPE_COUNT;
+pub use metrics::HISTOGRAM_BUCKETS;
+pub use metrics::KERNEL_HISTOGRAM_SLOTS;
+pub use pool::PooledEvent;
+pub use pool::PATH_POOL_CAPACITY;
+pub use process::ProcessCache;
+pub use process::ProcessInfo;
+pub use process::PROCESS_CACHE_CAPACITY;
+pub use prog_stats::ProgStats;
+pub use scope::Scope;
 use skel_watcher::*;
+pub use snapshot::Snapshot;
+pub use snapshot::SnapshotOptions;
 use std::future::Future;
+use std::path::Path;
+use std::path::PathBuf;
 use std::pin::Pin;
+use std::sync::Arc;
 use std::task::{Context, Poll};
 
 #[cfg(feature = "ev-array")]
-type EvBuf<'a> = libbpf_rs::PerfBuffer<'a>;
+enum EvBuf<'a> {
+    Perf(libbpf_rs::PerfBuffer<'a>),
+    // Whole events, on kernels with ringbufs, or our own ring from the shared probes
+    Ring(libbpf_rs::RingBuffer<'a>),
+}
 #[cfg(feature = "ev-ringbuf")]
 type EvBuf<'a> = libbpf_rs::RingBuffer<'a>;
 
+/// Where to pin, by convention. Must be on a bpffs.
+pub const PIN_DIR_DEFAULT: &str = "/sys/fs/bpf/fs-events";
+
+/// Where shared probes are pinned, unless there's a pin dir in the options.
+/// Not under `PIN_DIR_DEFAULT`, which a server removes when it shuts down.
+pub const SHARED_PIN_DIR_DEFAULT: &str = "/sys/fs/bpf/fs-events-shared";
+
+// Next to the pins, the config their programs were loaded with
+const PINNED_CONFIG: &str = "config";
+
+/// How to set up an `FsEvents`. The defaults are what `FsEvents::try_new` does.
+#[derive(Clone, Debug, Default)]
+pub struct Options {
+    /// Pin our links and maps here, or adopt them if someone already has.
+    /// Pinned probes stay attached, and keep filling the event buffer,
+    /// while the process reading it is replaced.
+    pub pin_dir: Option<PathBuf>,
+    /// Share one set of probes with every other `FsEvents` on the host which asks to.
+    /// The first of us loads and pins them; the rest attach as readers, each with a
+    /// ring of its own. Paths are walked once per syscall, however many of us there are,
+    /// and the last of us to go removes the pins. Only for the perf buffer build.
+    pub shared: bool,
+    /// Only attach the probes for these effects. Can be changed later, with
+    /// `FsEvents::set_effects`, though not widened if we adopt pinned probes.
+    /// Shared probes are always attached in full.
+    pub effects: EffectMask,
+    /// Only watch these processes. Not for shared probes, which watch the whole host.
+    pub scope: Scope,
+    /// Only watch some filesystems, or skip some. Not for shared probes either.
+    pub filesystems: FsFilter,
+    /// Skip paths like these in the kernel, part way through walking them.
+    /// Not for shared probes, nor the ringbuf build.
+    pub ignore: IgnoreRules,
+    /// Cache what /proc says about the processes behind events, for
+    /// `FsEvents::process`, until the kernel says they've exec'd or exited.
+    /// Not for shared probes.
+    pub process_cache: bool,
+    /// Charge events against this while they wait for the consumer,
+    /// and drop them when it's spent. See `FsEvents::take_gap`.
+    pub memory_budget: Option<Arc<MemoryBudget>>,
+}
+
+impl Options {
+    fn pin_dir(&self) -> Option<PathBuf> {
+        match (&self.pin_dir, self.shared) {
+            (None, true) => Some(PathBuf::from(SHARED_PIN_DIR_DEFAULT)),
+            (pin_dir, _) => pin_dir.clone(),
+        }
+    }
+}
+
 pub struct FsEvents<'cls> {
-    // Need to hold this to keep the attached probes alive
-    _skel: WatcherSkel<'cls>,
+    skel: WatcherSkel<'cls>,
+    // Need to hold these to keep the attached probes alive, by program name
+    links: Vec<(String, libbpf_rs::Link)>,
+    pin_dir: Option<PathBuf>,
+    // Which of the pin dir's maps are ours, to remove them and nothing else
+    pinned_maps: Vec<String>,
+    adopted: bool,
+    features: Features,
     ev_buf: EvBuf<'cls>,
-    rx: std::sync::mpsc::Receiver<Event>,
+    queue: ingest::Queue,
+    // Paths for the callback to decode into, which pooled events give back
+    pool: Arc<pool::PathPool>,
+    metrics: Arc<Metrics>,
+    // Events shed before those we've handed out, not yet taken
+    gap: std::cell::Cell<u64>,
+    // Run-time stats stay enabled for as long as this is open
+    prog_stats_fd: Option<std::os::fd::OwnedFd>,
+    shared: Option<shared::Consumer>,
+    processes: Option<Arc<ProcessCache>>,
+    // What we were opened with, for which programs we loaded
+    opts: Options,
 }
 
 fn bump_memlock_rlimit() -> Result<(), std::io::Error> {
@@ -32,7 +148,178 @@ fn bump_memlock_rlimit() -> Result<(), std::io::Error> {
     Ok(())
 }
 
-fn open_skel_interface<'a>() -> Result<WatcherSkel<'a>, Box<dyn std::error::Error>> {
+/// Our variant of each probe, and the other programs if the options need them.
+fn loads_prog(features: Features, opts: &Options, name: &str) -> bool {
+    if process::is_lifecycle_prog(name) {
+        return opts.process_cache;
+    }
+    if scope::is_fork_prog(name) {
+        return !opts.scope.process_trees.is_empty();
+    }
+    features.loads_prog(name)
+}
+
+/// Pinned maps are reused by libbpf when the skeleton is loaded. If every
+/// program's link is pinned too, the programs needn't be loaded (and verified)
+/// again: we adopt the links, and with them whichever programs they hold.
+/// Only the links for the options' effects need be pinned, but then the effects can't be
+/// widened later, as the rest of the programs were never loaded.
+/// Programs keep the read-only config they were loaded with, so if the pinned
+/// ones' isn't `config`, none of their links are adopted, and ours replace them.
+fn pin_or_reuse(
+    obj: &mut libbpf_rs::OpenObject,
+    dir: &Path,
+    features: Features,
+    opts: &Options,
+    config: &str,
+) -> Result<Pinning, std::io::Error> {
+    let to_io = |_| std::io::Error::from(std::io::ErrorKind::Other);
+    std::fs::create_dir_all(dir.join("maps"))?;
+    std::fs::create_dir_all(dir.join("links"))?;
+    let mut maps = Vec::new();
+    let mut new_maps = Vec::new();
+    for map in obj.maps_iter_mut() {
+        // Internal maps, like .rodata, belong to the programs which use them
+        if !map.name().contains('.') {
+            let path = dir.join("maps").join(map.name());
+            if !path.exists() {
+                new_maps.push(map.name().to_string());
+            }
+            map.set_pin_path(path).map_err(to_io)?;
+            maps.push(map.name().to_string());
+        }
+    }
+    let pinned_config = std::fs::read_to_string(dir.join(PINNED_CONFIG));
+    if !pinned_config.is_ok_and(|pinned| pinned == config) {
+        for prog in obj.progs_iter() {
+            unpin_link(dir, prog.name());
+        }
+    }
+    let adopting = obj
+        .progs_iter()
+        .filter(|prog| loads_prog(features, opts, prog.name()))
+        .filter(|prog| mask::wants_prog(opts.effects, prog.name()))
+        .all(|prog| dir.join("links").join(prog.name()).exists());
+    if adopting {
+        for prog in obj.progs_iter_mut() {
+            prog.set_autoload(false).map_err(to_io)?;
+        }
+    }
+    Ok(Pinning {
+        maps,
+        new_maps,
+        adopting,
+    })
+}
+
+/// The maps `pin_or_reuse` has libbpf pin, or reuse, by name.
+#[derive(Default)]
+struct Pinning {
+    maps: Vec<String>,
+    // Those nobody had pinned before, to take back if we fail
+    new_maps: Vec<String>,
+    adopting: bool,
+}
+
+/// The link, and whether it was pinned already, rather than attached by us.
+fn attach_or_adopt(
+    prog: &mut libbpf_rs::Program,
+    pin_dir: Option<&Path>,
+) -> Result<(libbpf_rs::Link, bool), Box<dyn std::error::Error>> {
+    let Some(dir) = pin_dir else {
+        return Ok((prog.attach()?, false));
+    };
+    let path = dir.join("links").join(prog.name());
+    if let Ok(link) = libbpf_rs::Link::open(&path) {
+        log::info!("adopted pinned link at {}", path.display());
+        return Ok((link, true));
+    }
+    // Stale, if it's there at all
+    unpin_link(dir, prog.name());
+    let mut link = prog.attach()?;
+    link.pin(&path)?;
+    Ok((link, false))
+}
+
+fn unpin_link(dir: &Path, prog_name: &str) {
+    let _ = std::fs::remove_file(dir.join("links").join(prog_name));
+}
+
+fn remove_dir_if_empty(dir: &Path) -> Result<(), std::io::Error> {
+    match std::fs::remove_dir(dir) {
+        Err(e) if matches!(e.raw_os_error(), Some(libc::ENOTEMPTY) | Some(libc::ENOENT)) => Ok(()),
+        removed => removed,
+    }
+}
+
+/// Removes the pins which are ours, by name, and then the pin directories,
+/// if that left them empty. Anything else in there belongs to someone else.
+fn remove_pins<'a>(
+    dir: &Path,
+    maps: &[String],
+    links: impl Iterator<Item = &'a str>,
+) -> Result<(), std::io::Error> {
+    let remove = |path: PathBuf| match std::fs::remove_file(path) {
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => Ok(()),
+        removed => removed,
+    };
+    for name in maps {
+        remove(dir.join("maps").join(name))?;
+    }
+    for name in links {
+        remove(dir.join("links").join(name))?;
+    }
+    remove_dir_if_empty(&dir.join("maps"))?;
+    remove_dir_if_empty(&dir.join("links"))
+}
+
+/// Why `open_skel_interface` failed, and whether another variant of our
+/// programs might not.
+struct OpenFailed {
+    error: Box<dyn std::error::Error>,
+    // Loading or attaching them, rather than anything which would fail
+    // the same for every variant, like a cgroup which isn't there
+    by_programs: bool,
+}
+
+impl OpenFailed {
+    fn programs(error: impl Into<Box<dyn std::error::Error>>) -> Self {
+        Self {
+            error: error.into(),
+            by_programs: true,
+        }
+    }
+
+    fn other(error: impl Into<Box<dyn std::error::Error>>) -> Self {
+        Self {
+            error: error.into(),
+            by_programs: false,
+        }
+    }
+}
+
+fn remove_config(dir: &Path) -> Result<(), std::io::Error> {
+    match std::fs::remove_file(dir.join(PINNED_CONFIG)) {
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => Ok(()),
+        removed => removed,
+    }
+}
+
+/// What `open_skel_interface` loaded, attached and pinned.
+struct Opened<'a> {
+    skel: WatcherSkel<'a>,
+    links: Vec<(String, libbpf_rs::Link)>,
+    // By name, under the pin dir's maps
+    pinned_maps: Vec<String>,
+    // Whether the links were all pinned already, and we took them over
+    adopted: bool,
+}
+
+fn open_skel_interface<'a>(
+    opts: &Options,
+    pin_dir: Option<&Path>,
+    features: Features,
+) -> Result<Opened<'a>, OpenFailed> {
     let skel_builder = if cfg!(debug_assertions) {
         let mut skel = WatcherSkelBuilder::default();
         skel.obj_builder.debug(true);
@@ -40,55 +327,553 @@ fn open_skel_interface<'a>() -> Result<WatcherSkel<'a>, Box<dyn std::error::Erro
     } else {
         WatcherSkelBuilder::default()
     };
-    let mut skel = skel_builder.open()?.load()?;
-    skel.attach()?;
-    Ok(skel)
+    let mut open_skel = skel_builder.open().map_err(OpenFailed::other)?;
+    // What the programs are loaded with, which pinned ones must have been too
+    #[cfg(feature = "ev-array")]
+    let config = {
+        let rodata = open_skel.rodata_mut();
+        rodata.use_shared_rings = opts.shared;
+        rodata.use_ring_output = features.ringbuf;
+        rodata.use_cgroup_scope = !opts.scope.cgroups.is_empty();
+        rodata.use_mntns_scope = !opts.scope.mount_namespaces.is_empty();
+        rodata.use_task_root = opts.scope.relative_paths;
+        rodata.fs_filter = opts.filesystems.mode();
+        rodata.use_ignore_rules = !opts.ignore.is_empty();
+        rodata.use_task_scope = !opts.scope.process_trees.is_empty();
+        format!("{:#?}\n", *rodata)
+    };
+    #[cfg(feature = "ev-ringbuf")]
+    let config = String::new();
+    if !features.ringbuf {
+        // Couldn't be created here. Nothing loaded uses them, with use_ring_output unset.
+        let mut maps = open_skel.maps_mut();
+        maps.ring()
+            .set_autocreate(false)
+            .map_err(OpenFailed::other)?;
+        maps.consumers()
+            .set_autocreate(false)
+            .map_err(OpenFailed::other)?;
+    }
+    if opts.scope.process_trees.is_empty() {
+        // Nor can task storage be on older kernels, and it's only for process trees
+        let mut maps = open_skel.maps_mut();
+        maps.scope_tasks()
+            .set_autocreate(false)
+            .map_err(OpenFailed::other)?;
+    }
+    if !features.lsm || opts.ignore.is_empty() {
+        // Nor inode storage, without the BPF LSM, and it's only for ignore rules
+        let mut maps = open_skel.maps_mut();
+        maps.dir_verdicts()
+            .set_autocreate(false)
+            .map_err(OpenFailed::other)?;
+    }
+    for prog in open_skel.open_object_mut().progs_iter_mut() {
+        let load = loads_prog(features, opts, prog.name());
+        prog.set_autoload(load).map_err(OpenFailed::other)?;
+    }
+    let pinning = match pin_dir {
+        Some(dir) => pin_or_reuse(open_skel.open_object_mut(), dir, features, opts, &config)
+            .map_err(OpenFailed::other)?,
+        None => Pinning::default(),
+    };
+    // Should this fail, libbpf takes back whichever maps it pinned
+    let mut skel = open_skel.load().map_err(OpenFailed::programs)?;
+    let mut links = Vec::new();
+    let mut new_links = Vec::new();
+    if let Err(e) = fill_and_attach(
+        &mut skel,
+        opts,
+        features,
+        pin_dir,
+        &mut links,
+        &mut new_links,
+    ) {
+        // Or what we pinned would stay attached, and we might be trying again
+        if let Some(dir) = pin_dir {
+            let removed = remove_pins(dir, &pinning.new_maps, new_links.iter().map(String::as_str))
+                .and_then(|_| remove_dir_if_empty(dir));
+            if let Err(e) = removed {
+                log::warn!("couldn't remove our pins from {}: {e}", dir.display());
+            }
+        }
+        return Err(e);
+    }
+    if let Some(dir) = pin_dir {
+        std::fs::write(dir.join(PINNED_CONFIG), config).map_err(OpenFailed::other)?;
+    }
+    Ok(Opened {
+        skel,
+        links,
+        pinned_maps: pinning.maps,
+        adopted: pinning.adopting,
+    })
+}
+
+/// Fills the maps the options need, and attaches the programs to go with them,
+/// into `links`. Those we pinned ourselves are also in `new_links`, by name.
+fn fill_and_attach(
+    skel: &mut WatcherSkel,
+    opts: &Options,
+    features: Features,
+    pin_dir: Option<&Path>,
+    links: &mut Vec<(String, libbpf_rs::Link)>,
+    new_links: &mut Vec<String>,
+) -> Result<(), OpenFailed> {
+    // Before attaching, so that nothing out of scope slips through. Even with
+    // nothing to fill, pinned maps are cleared of what the last owner left.
+    {
+        let maps = skel.maps();
+        scope::fill(&opts.scope, maps.scope_cgroups(), maps.scope_mntns())
+            .map_err(OpenFailed::other)?;
+    }
+    {
+        let maps = skel.maps();
+        fs_filter::fill(
+            &opts.filesystems,
+            maps.fs_filter_devs(),
+            maps.fs_filter_magics(),
+        )
+        .map_err(OpenFailed::other)?;
+    }
+    {
+        let maps = skel.maps();
+        ignore::fill(
+            &opts.ignore,
+            maps.ignored_names(),
+            maps.ignored_suffixes(),
+            maps.dir_verdict_generation(),
+        )
+        .map_err(OpenFailed::other)?;
+    }
+    // Every program of our variant is loaded (unless adopted), so that any of them can be attached later
+    for prog in skel.object_mut().progs_iter_mut() {
+        if !loads_prog(features, opts, prog.name()) {
+            // Pinned by someone before us, with other options or on another variant.
+            // It would stay attached, and send us what we never asked for.
+            if let Some(dir) = pin_dir {
+                unpin_link(dir, prog.name());
+            }
+            continue;
+        }
+        if !mask::wants_prog(opts.effects, prog.name()) {
+            // Someone before us wanted this one. They'll detach it when they go.
+            if let Some(dir) = pin_dir {
+                unpin_link(dir, prog.name());
+            }
+            continue;
+        }
+        let (link, adopted) = attach_or_adopt(prog, pin_dir).map_err(OpenFailed::programs)?;
+        if !adopted && pin_dir.is_some() {
+            new_links.push(prog.name().to_string());
+        }
+        links.push((prog.name().to_string(), link));
+    }
+    // After attaching, unlike the rest of the scope, so that the fork program sees every fork after
+    if !opts.scope.process_trees.is_empty() {
+        scope::flag_process_trees(&opts.scope.process_trees, skel.maps().scope_tasks())
+            .map_err(OpenFailed::other)?;
+    }
+    Ok(())
 }
 
 impl FsEvents<'_> {
     pub fn try_new() -> Result<Self, Box<dyn std::error::Error>> {
+        Self::try_new_with(&Options::default())
+    }
+
+    pub fn try_new_with(opts: &Options) -> Result<Self, Box<dyn std::error::Error>> {
+        if opts.shared && opts.effects != EffectMask::ALL {
+            return Err("shared probes are always attached for every effect".into());
+        }
+        let filtered =
+            !opts.scope.is_host() || opts.filesystems != FsFilter::All || !opts.ignore.is_empty();
+        if opts.shared && filtered {
+            return Err("shared probes always watch the whole host, unfiltered".into());
+        }
+        if opts.shared && opts.process_cache {
+            return Err("the process cache isn't available with shared probes".into());
+        }
+        // Before anything's loaded or pinned. The programs' config is only set
+        // with ev-array, so nothing would be filtered.
+        #[cfg(feature = "ev-ringbuf")]
+        {
+            if opts.shared {
+                return Err("sharing probes needs the ev-array feature".into());
+            }
+            if !opts.scope.is_host() {
+                return Err("scopes need the ev-array feature".into());
+            }
+            if opts.filesystems != FsFilter::All {
+                return Err("filesystem filters need the ev-array feature".into());
+            }
+            if !opts.ignore.is_empty() {
+                return Err("ignore rules need the ev-array feature".into());
+            }
+        }
         bump_memlock_rlimit()?;
-        let mut skel = open_skel_interface()?;
-        let mut maps = skel.maps_mut();
-        let (tx, rx) = std::sync::mpsc::channel();
+        let pin_dir = opts.pin_dir();
+        // Nobody else loads, joins or tears down the shared probes while we do
+        let _lock = match (&pin_dir, opts.shared) {
+            (Some(dir), true) => Some(shared::DirLock::take(dir)?),
+            _ => None,
+        };
+        let mut features = Features::probe();
+        if opts.shared && !features.ringbuf {
+            return Err("sharing probes needs a kernel with ringbufs".into());
+        }
+        let Opened {
+            mut skel,
+            links,
+            pinned_maps,
+            adopted,
+        } = loop {
+            match open_skel_interface(opts, pin_dir.as_deref(), features) {
+                Ok(opened) => break opened,
+                Err(failed) => match (failed.by_programs, features.fallback()) {
+                    (true, Some(next)) => {
+                        let e = failed.error;
+                        log::warn!("{features} failed ({e}), falling back to {next}");
+                        features = next;
+                    }
+                    _ => return Err(failed.error),
+                },
+            }
+        };
+        let queue = ingest::Queue::default();
+        let pool = Arc::new(pool::PathPool::new());
+        let metrics = Arc::new(Metrics::default());
+        let processes = match opts.process_cache {
+            true => Some(Arc::new(ProcessCache::new(PROCESS_CACHE_CAPACITY))),
+            false => None,
+        };
         #[cfg(feature = "ev-array")]
-        {
-            let on_event = ingest::accumulating_event_stream_proxy(tx);
+        let (ev_buf, shared) = if opts.shared {
+            let maps = skel.maps();
+            let consumer = shared::join(maps.consumers(), maps.consumer_pids())?;
+            let mut on_event = ingest::accumulating_event_stream_proxy(
+                queue.clone(),
+                metrics.clone(),
+                processes.clone(),
+                opts.memory_budget.clone(),
+                pool.clone(),
+            );
+            let mut ev_buf = libbpf_rs::RingBufferBuilder::new();
+            ev_buf.add(&consumer.ring, move |data: &[u8]| {
+                on_event(0, data);
+                0
+            })?;
+            (EvBuf::Ring(ev_buf.build()?), Some(consumer))
+        } else if features.ringbuf {
+            let maps = skel.maps();
+            let mut on_event = ingest::accumulating_event_stream_proxy(
+                queue.clone(),
+                metrics.clone(),
+                processes.clone(),
+                opts.memory_budget.clone(),
+                pool.clone(),
+            );
+            let mut ev_buf = libbpf_rs::RingBufferBuilder::new();
+            ev_buf.add(maps.ring(), move |data: &[u8]| {
+                on_event(0, data);
+                0
+            })?;
+            (EvBuf::Ring(ev_buf.build()?), None)
+        } else {
+            let mut maps = skel.maps_mut();
+            let on_event = ingest::accumulating_event_stream_proxy(
+                queue.clone(),
+                metrics.clone(),
+                processes.clone(),
+                opts.memory_budget.clone(),
+                pool.clone(),
+            );
+            let lost_metrics = metrics.clone();
+            let on_lost = move |_cpu: i32, count: u64| {
+                lost_metrics
+                    .lost_samples
+                    .fetch_add(count, std::sync::atomic::Ordering::Relaxed);
+            };
             let ev_buf = libbpf_rs::PerfBufferBuilder::new(maps.events())
                 .sample_cb(on_event)
+                .lost_cb(on_lost)
                 .build()?;
-            Ok(Self {
-                _skel: skel,
-                ev_buf,
-                rx,
-            })
-        }
+            (EvBuf::Perf(ev_buf), None)
+        };
         #[cfg(feature = "ev-ringbuf")]
-        {
-            let on_event = ingest::accumulating_event_stream_proxy(tx);
+        let (ev_buf, shared) = {
+            let mut maps = skel.maps_mut();
+            let on_event = ingest::accumulating_event_stream_proxy(
+                queue.clone(),
+                metrics.clone(),
+                processes.clone(),
+                opts.memory_budget.clone(),
+                pool.clone(),
+            );
             let mut ev_buf = libbpf_rs::RingBufferBuilder::new();
             ev_buf.add(maps.events(), on_event)?;
-            let ev_buf = ev_buf.build()?;
-            Ok(Self {
-                _skel: skel,
-                ev_buf,
-                rx,
-            })
+            (ev_buf.build()?, None)
+        };
+        Ok(Self {
+            skel,
+            links,
+            pin_dir,
+            pinned_maps,
+            adopted,
+            features,
+            ev_buf,
+            queue,
+            pool,
+            metrics,
+            gap: Default::default(),
+            prog_stats_fd: None,
+            shared,
+            processes,
+            opts: opts.clone(),
+        })
+    }
+
+    /// Attaches the probes for effects we now want, and detaches those for effects we don't.
+    /// Probes we keep are left alone, so no events are missed from them in between.
+    /// Having adopted pinned probes, we loaded none of our own, so the mask can only be
+    /// widened to probes which are still pinned; otherwise, nothing is changed.
+    pub fn set_effects(&mut self, effects: EffectMask) -> Result<(), Box<dyn std::error::Error>> {
+        if self.shared.is_some() {
+            return Err("shared probes are always attached for every effect".into());
+        }
+        let pin_dir = self.pin_dir.as_deref();
+        if let (true, Some(dir)) = (self.adopted, pin_dir) {
+            let unloaded = self.skel.object().progs_iter().find(|prog| {
+                let name = prog.name();
+                loads_prog(self.features, &self.opts, name)
+                    && mask::wants_prog(effects, name)
+                    && !self.links.iter().any(|(linked, _)| linked == name)
+                    && !dir.join("links").join(name).exists()
+            });
+            if let Some(prog) = unloaded {
+                let name = prog.name();
+                return Err(format!("{name} wasn't loaded, as we adopted pinned probes").into());
+            }
+        }
+        for prog in self.skel.object_mut().progs_iter_mut() {
+            if !loads_prog(self.features, &self.opts, prog.name()) {
+                continue;
+            }
+            let name = prog.name().to_string();
+            let wanted = mask::wants_prog(effects, &name);
+            let attached = self.links.iter().position(|(linked, _)| *linked == name);
+            match (wanted, attached) {
+                (true, None) => {
+                    let (link, _) = attach_or_adopt(prog, pin_dir)?;
+                    self.links.push((name, link));
+                }
+                (false, Some(idx)) => {
+                    // Pinned links stay attached while they're pinned
+                    if let Some(dir) = pin_dir {
+                        unpin_link(dir, &name);
+                    }
+                    self.links.swap_remove(idx);
+                }
+                _ => (),
+            }
+        }
+        Ok(())
+    }
+
+    /// A listing of the roots which this stream carries on from, taken with the
+    /// stream running, so that nothing which happens meanwhile is missed. See `Snapshot`.
+    /// Events polled before this are from before it, and should be handled first.
+    pub fn snapshot(&self, opts: &SnapshotOptions) -> Result<Snapshot, Box<dyn std::error::Error>> {
+        snapshot::take(self, opts)
+    }
+
+    /// What /proc says about a process, read once per exec.
+    /// None if the process has gone, or we weren't asked to cache processes.
+    pub fn process(&self, pid: u32) -> Option<Arc<ProcessInfo>> {
+        self.processes.as_ref()?.get(pid)
+    }
+
+    /// The cache behind `process`, to share with other threads.
+    pub fn process_cache(&self) -> Option<Arc<ProcessCache>> {
+        self.processes.clone()
+    }
+
+    /// Which of the skeleton's variants we loaded, for what this kernel supports.
+    pub fn features(&self) -> Features {
+        self.features
+    }
+
+    /// Whether we took over pinned probes, and with them the event buffer, which
+    /// whoever pinned them may still be reading from. Shared probes don't count:
+    /// each of their consumers has a ring of its own.
+    pub fn adopted_pins(&self) -> bool {
+        self.adopted && self.shared.is_none()
+    }
+
+    /// Counters for everything that has happened so far, and how long
+    /// events spent getting to us. Shared, so that it can be read from other threads.
+    pub fn metrics(&self) -> Arc<Metrics> {
+        self.metrics.clone()
+    }
+
+    /// Reads the kernel's counters into `Metrics::kernel`.
+    /// These live in a per-CPU map, so this is a syscall and a sum over CPUs.
+    pub fn refresh_kernel_stats(&self) -> Result<(), std::io::ErrorKind> {
+        let maps = self.skel.maps();
+        let totals = sum_percpu_u64s(maps.stats(), KernelStat::COUNT)?;
+        for (stat, total) in KernelStat::ALL.iter().zip(totals) {
+            self.metrics.kernel[*stat as usize].store(total, std::sync::atomic::Ordering::Relaxed);
+        }
+        Ok(())
+    }
+
+    /// One of the kernel's histograms, summed across CPUs, by slot.
+    pub fn kernel_histogram(&self, which: KernelHistogram) -> Result<Vec<u64>, std::io::ErrorKind> {
+        let maps = self.skel.maps();
+        let hist = match which {
+            KernelHistogram::WalkDepth => maps.walk_depth_hist(),
+            KernelHistogram::WalkBytes => maps.walk_bytes_hist(),
+        };
+        sum_percpu_u64s(hist, KERNEL_HISTOGRAM_SLOTS)
+    }
+
+    /// Has the kernel count how often, and for how long, each of our programs runs.
+    /// That's a little overhead on every run, of every BPF program on the system,
+    /// until we're dropped. Needs CAP_SYS_ADMIN, or CAP_BPF and CAP_PERFMON.
+    pub fn enable_prog_stats(&mut self) -> Result<(), std::io::Error> {
+        if self.prog_stats_fd.is_none() {
+            self.prog_stats_fd = Some(prog_stats::enable()?);
+        }
+        Ok(())
+    }
+
+    /// Run counts and times for each of our attached programs, since they were loaded.
+    /// Only runs while stats were enabled, by us or anyone else, are counted.
+    /// Adopted programs were loaded by whoever pinned them, so they're found through their links.
+    pub fn prog_stats(&self) -> Result<Vec<ProgStats>, std::io::Error> {
+        use std::os::fd::AsFd;
+        self.links
+            .iter()
+            .map(|(name, link)| prog_stats::read_linked(name, link.as_fd()))
+            .collect()
+    }
+
+    /// Removes our pins, for a clean shutdown rather than a handover, and the pin
+    /// dir, if nothing else was pinned there. The probes stay attached until every
+    /// process holding their links lets go. Shared probes are unpinned by whoever
+    /// reads from them last, when they're dropped.
+    pub fn unpin(&self) -> Result<(), std::io::Error> {
+        match &self.pin_dir {
+            Some(_) if self.shared.is_some() => Ok(()),
+            Some(dir) => {
+                remove_pins(dir, &self.pinned_maps, self.link_names())?;
+                remove_config(dir)?;
+                remove_dir_if_empty(dir)
+            }
+            None => Ok(()),
         }
     }
 
+    fn link_names(&self) -> impl Iterator<Item = &str> {
+        self.links.iter().map(|(name, _)| name.as_str())
+    }
+
+    fn leave_shared(&self, consumer: &shared::Consumer) -> Result<(), Box<dyn std::error::Error>> {
+        let Some(dir) = &self.pin_dir else {
+            return Ok(());
+        };
+        let _lock = shared::DirLock::take(dir)?;
+        let maps = self.skel.maps();
+        if consumer.leave(maps.consumers(), maps.consumer_pids())? {
+            // The directory itself stays, as it's what we lock
+            log::info!("last consumer of the shared probes, unpinning");
+            remove_pins(dir, &self.pinned_maps, self.link_names())?;
+            remove_config(dir)?;
+        }
+        Ok(())
+    }
+
     pub fn poll_with_timeout(
         &self,
         duration: Duration,
     ) -> Result<Option<Event>, std::io::ErrorKind> {
-        match self.ev_buf.poll(duration) {
-            Ok(_) => match self.rx.try_recv() {
-                Ok(event) => Ok(Some(event)),
-                Err(std::sync::mpsc::TryRecvError::Empty) => Ok(None),
-                Err(_) => Err(std::io::ErrorKind::Other),
-            },
-            Err(_) => Err(std::io::ErrorKind::Other),
+        if self.ev_buf.poll(duration).is_err() {
+            return Err(std::io::ErrorKind::Other);
+        }
+        let received = self.queue.lock().unwrap().pop_front();
+        Ok(received.map(|received| self.dequeued(received)))
+    }
+
+    /// Every event from before `through`, by its timestamp, which comes in within
+    /// `settle`, wherever it is in the queue, and by timestamp. Each CPU has its
+    /// own buffer, so events don't come in in order, and one from before can be
+    /// behind one from after, or still on its way in. The rest are left queued.
+    pub(crate) fn take_through(
+        &self,
+        through: u64,
+        settle: Duration,
+    ) -> Result<Vec<Event>, std::io::ErrorKind> {
+        let deadline = std::time::Instant::now() + settle;
+        loop {
+            let left = deadline.saturating_duration_since(std::time::Instant::now());
+            if self.ev_buf.poll(left).is_err() {
+                return Err(std::io::ErrorKind::Other);
+            }
+            if left.is_zero() {
+                break;
+            }
+        }
+        let mut taken = Vec::new();
+        {
+            // Around once, keeping the rest in order, and the queue's capacity
+            let mut queue = self.queue.lock().unwrap();
+            for _ in 0..queue.len() {
+                let received = queue.pop_front().unwrap();
+                match received.0.timestamp <= through {
+                    true => taken.push(received),
+                    false => queue.push_back(received),
+                }
+            }
+        }
+        let mut taken: Vec<Event> = (taken.into_iter())
+            .map(|received| self.dequeued(received))
+            .collect();
+        taken.sort_by_key(|event| event.timestamp);
+        Ok(taken)
+    }
+
+    // Once it's off the queue, for the metrics and the budget
+    fn dequeued(&self, (event, received_at, shed_before): ingest::Received) -> Event {
+        let waited = metrics::monotonic_ns().saturating_sub(received_at);
+        self.metrics.callback_to_dequeue_ns.record(waited);
+        if let Some(budget) = &self.opts.memory_budget {
+            budget.release(event.buffered_size());
         }
+        self.gap.set(self.gap.get() + shed_before);
+        event
+    }
+
+    /// Like `poll_with_timeout`, but the event's paths are reused once it's dropped.
+    /// Read this way, and dropped before too many more are read (see
+    /// `PATH_POOL_CAPACITY`), events cost no allocations once we're warmed up.
+    pub fn poll_pooled_with_timeout(
+        &self,
+        duration: Duration,
+    ) -> Result<Option<PooledEvent>, std::io::ErrorKind> {
+        let event = self.poll_with_timeout(duration)?;
+        Ok(event.map(|event| PooledEvent::new(event, self.pool.clone())))
+    }
+
+    pub fn poll_pooled_immediate(&self) -> Result<Option<PooledEvent>, std::io::ErrorKind> {
+        self.poll_pooled_with_timeout(Duration::from_secs(0))
+    }
+
+    /// How many events were shed for the memory budget, before the event last
+    /// polled, since this was last asked. A gap is only seen once an event
+    /// makes it through after it, so it's to be asked after each poll, and
+    /// the gap comes before that event.
+    pub fn take_gap(&self) -> u64 {
+        self.gap.take()
     }
 
     pub fn poll_immediate(&self) -> Result<Option<Event>, std::io::ErrorKind> {
@@ -100,6 +885,44 @@ impl FsEvents<'_> {
     }
 }
 
+/// Sums a per-CPU array of u64s, for each of its first `len` keys.
+fn sum_percpu_u64s(map: &libbpf_rs::Map, len: usize) -> Result<Vec<u64>, std::io::ErrorKind> {
+    (0..len as u32)
+        .map(|key| {
+            let per_cpu = match map.lookup_percpu(&key.to_ne_bytes(), libbpf_rs::MapFlags::ANY) {
+                Ok(Some(per_cpu)) => per_cpu,
+                Ok(None) => return Ok(0),
+                Err(_) => return Err(std::io::ErrorKind::Other),
+            };
+            Ok(per_cpu
+                .iter()
+                .filter_map(|value| value.get(..8)?.try_into().ok())
+                .map(u64::from_ne_bytes)
+                .sum())
+        })
+        .collect()
+}
+
+#[cfg(feature = "ev-array")]
+impl EvBuf<'_> {
+    fn poll(&self, timeout: Duration) -> Result<(), libbpf_rs::Error> {
+        match self {
+            EvBuf::Perf(ev_buf) => ev_buf.poll(timeout),
+            EvBuf::Ring(ev_buf) => ev_buf.poll(timeout),
+        }
+    }
+}
+
+impl Drop for FsEvents<'_> {
+    fn drop(&mut self) {
+        if let Some(consumer) = &self.shared {
+            if let Err(e) = self.leave_shared(consumer) {
+                log::error!("leaving the shared probes: {e}");
+            }
+        }
+    }
+}
+
 impl Future for FsEvents<'_> {
     type Output = Result<Event, std::io::ErrorKind>;
 
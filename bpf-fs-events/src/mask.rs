@@ -0,0 +1,54 @@
+use crate::event::EffectType;
+
+/// Which effects to watch for. The probes for anything else are left
+/// detached, so they cost nothing at all.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct EffectMask(u8);
+
+fn bit(effect_type: EffectType) -> u8 {
+    1 << u8::from(effect_type)
+}
+
+impl EffectMask {
+    pub const NONE: EffectMask = EffectMask(0);
+    pub const ALL: EffectMask = EffectMask(0b1111);
+
+    pub fn with(self, effect_type: EffectType) -> Self {
+        Self(self.0 | bit(effect_type))
+    }
+
+    pub fn contains(self, effect_type: EffectType) -> bool {
+        self.0 & bit(effect_type) != 0
+    }
+}
+
+impl Default for EffectMask {
+    fn default() -> Self {
+        EffectMask::ALL
+    }
+}
+
+impl FromIterator<EffectType> for EffectMask {
+    fn from_iter<I: IntoIterator<Item = EffectType>>(iter: I) -> Self {
+        iter.into_iter().fold(EffectMask::NONE, EffectMask::with)
+    }
+}
+
+/// What each of our programs reports, going by the function in its name.
+/// Associations ride along with whatever they're associated with.
+pub(crate) fn effect_of_prog(name: &str) -> Option<EffectType> {
+    match name.rsplit("__").next()? {
+        "security_path_unlink" | "security_path_rmdir" => Some(EffectType::Delete),
+        "security_path_mkdir" | "security_inode_create" | "do_filp_open" => {
+            Some(EffectType::Create)
+        }
+        "security_path_rename" => Some(EffectType::Rename),
+        "security_path_link" | "security_path_symlink" => Some(EffectType::Link),
+        _ => None,
+    }
+}
+
+/// Programs we don't know the effect of are always wanted.
+pub(crate) fn wants_prog(mask: EffectMask, name: &str) -> bool {
+    effect_of_prog(name).map_or(true, |effect_type| mask.contains(effect_type))
+}
@@ -0,0 +1,232 @@
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+
+/// The kernel's own counters, summed across CPUs.
+/// The order matches the ST_* indices in 'src/bpf/watcher.bpf.c'.
+#[derive(Clone, Copy, Debug)]
+pub enum KernelStat {
+    /// Events submitted to the event buffer
+    Events,
+    /// Events which could not be submitted, because the buffer was full
+    OutputFailed,
+    /// Events abandoned because some kernel memory couldn't be read
+    ReadFailed,
+    /// Path components cut short to please the verifier
+    NameTruncated,
+    /// Paths cut short at their length limit
+    PathTruncated,
+    /// Paths cut short at their depth limit
+    DepthExhausted,
+    /// Events dropped by the ignore rules, part way up the path
+    Ignored,
+    /// Events dropped because a program which preempted another, on the same
+    /// CPU, found it using the CPU's scratch space
+    ScratchBusy,
+}
+
+impl KernelStat {
+    pub const COUNT: usize = 8;
+    pub const ALL: [KernelStat; KernelStat::COUNT] = [
+        KernelStat::Events,
+        KernelStat::OutputFailed,
+        KernelStat::ReadFailed,
+        KernelStat::NameTruncated,
+        KernelStat::PathTruncated,
+        KernelStat::DepthExhausted,
+        KernelStat::Ignored,
+        KernelStat::ScratchBusy,
+    ];
+
+    pub fn name(self) -> &'static str {
+        match self {
+            KernelStat::Events => "events",
+            KernelStat::OutputFailed => "output_failed",
+            KernelStat::ReadFailed => "read_failed",
+            KernelStat::NameTruncated => "name_truncated",
+            KernelStat::PathTruncated => "path_truncated",
+            KernelStat::DepthExhausted => "depth_exhausted",
+            KernelStat::Ignored => "ignored",
+            KernelStat::ScratchBusy => "scratch_busy",
+        }
+    }
+}
+
+/// Log2 histograms kept by the kernel, of the path walks done for each event.
+/// Slot i counts values which are i bits long: 0, then 1, then 2 and 3, and so on.
+/// The order matches the *_hist maps in 'src/bpf/watcher.bpf.c'.
+#[derive(Clone, Copy, Debug)]
+pub enum KernelHistogram {
+    /// How many path components were walked up to the root
+    WalkDepth,
+    /// How many bytes of names were read on the way
+    WalkBytes,
+}
+
+pub const KERNEL_HISTOGRAM_SLOTS: usize = 32;
+
+impl KernelHistogram {
+    pub const ALL: [KernelHistogram; 2] = [KernelHistogram::WalkDepth, KernelHistogram::WalkBytes];
+
+    pub fn name(self) -> &'static str {
+        match self {
+            KernelHistogram::WalkDepth => "walk_depth",
+            KernelHistogram::WalkBytes => "walk_bytes",
+        }
+    }
+
+    /// The largest value counted in a slot.
+    pub fn slot_upper_bound(slot: usize) -> u64 {
+        (1u64 << slot) - 1
+    }
+}
+
+/// Enough for every effect type we might hand to a consumer.
+pub const EFFECT_TYPE_COUNT: usize = 6;
+
+/// Counters for what goes on in the library.
+/// They're shared with whoever wants to export them, and are only ever
+/// read and written with relaxed ordering; they don't synchronize anything.
+#[derive(Default)]
+pub struct Metrics {
+    /// Records read off the kernel's buffer, including associations
+    pub records_received: AtomicU64,
+    /// Complete events handed to the consumer, indexed by effect type
+    pub events_by_effect: [AtomicU64; EFFECT_TYPE_COUNT],
+    /// Samples the kernel dropped because the perf buffer was full
+    pub lost_samples: AtomicU64,
+    /// Complete events we dropped rather than queue, for the memory budget
+    pub events_shed: AtomicU64,
+    /// As of the last `FsEvents::refresh_kernel_stats`, indexed by `KernelStat`
+    pub kernel: [AtomicU64; KernelStat::COUNT],
+    /// From the probe's timestamp to the record reaching our callback
+    pub kernel_to_callback_ns: Histogram,
+    /// From our callback to the consumer taking the event
+    pub callback_to_dequeue_ns: Histogram,
+}
+
+impl Metrics {
+    pub fn events_delivered(&self) -> u64 {
+        self.events_by_effect
+            .iter()
+            .map(|n| n.load(Ordering::Relaxed))
+            .sum()
+    }
+
+    pub fn kernel_stat(&self, stat: KernelStat) -> u64 {
+        self.kernel[stat as usize].load(Ordering::Relaxed)
+    }
+}
+
+// Each power of two is split into this many linear sub-buckets,
+// which keeps every recorded value within about 6% of the truth.
+const SUB_BUCKET_BITS: u32 = 4;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+
+pub const HISTOGRAM_BUCKETS: usize = (u64::BITS - SUB_BUCKET_BITS + 1) as usize * SUB_BUCKETS;
+
+/// A lock-free histogram of nanosecond latencies, in the manner of HdrHistogram:
+/// log-linear buckets with a fixed relative precision over the whole u64 range.
+/// Values below `SUB_BUCKETS` get a bucket each. Above that, each power of two
+/// is split into `SUB_BUCKETS` equal parts. Recording is a few relaxed atomic
+/// adds, so it's fine to do from any thread, on every event.
+pub struct Histogram {
+    buckets: [AtomicU64; HISTOGRAM_BUCKETS],
+    count: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self {
+            buckets: std::array::from_fn(|_| AtomicU64::new(0)),
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+}
+
+impl Histogram {
+    fn bucket_of(value: u64) -> usize {
+        if value < SUB_BUCKETS as u64 {
+            return value as usize;
+        }
+        let shift = u64::BITS - value.leading_zeros() - SUB_BUCKET_BITS - 1;
+        let top = (value >> shift) as usize - SUB_BUCKETS;
+        (shift as usize + 1) * SUB_BUCKETS + top
+    }
+
+    /// The largest value which lands in a bucket.
+    pub fn bucket_upper_bound(bucket: usize) -> u64 {
+        if bucket < SUB_BUCKETS {
+            return bucket as u64;
+        }
+        let shift = (bucket / SUB_BUCKETS - 1) as u32;
+        let top = (SUB_BUCKETS + bucket % SUB_BUCKETS) as u64;
+        ((top + 1) << shift).wrapping_sub(1)
+    }
+
+    pub fn record(&self, value: u64) {
+        self.buckets[Self::bucket_of(value)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+        self.max.fetch_max(value, Ordering::Relaxed);
+    }
+
+    pub fn record_since(&self, start: std::time::Instant) {
+        self.record(start.elapsed().as_nanos() as u64);
+    }
+
+    /// Not an atomic snapshot: records which land while this runs
+    /// may be in the buckets and not the count, or the other way around.
+    pub fn snapshot(&self) -> HistogramSnapshot {
+        HistogramSnapshot {
+            buckets: std::array::from_fn(|i| self.buckets[i].load(Ordering::Relaxed)),
+            count: self.count.load(Ordering::Relaxed),
+            sum: self.sum.load(Ordering::Relaxed),
+            max: self.max.load(Ordering::Relaxed),
+        }
+    }
+}
+
+pub struct HistogramSnapshot {
+    pub buckets: [u64; HISTOGRAM_BUCKETS],
+    pub count: u64,
+    pub sum: u64,
+    pub max: u64,
+}
+
+impl HistogramSnapshot {
+    /// How many recorded values were at most `value`,
+    /// give or take the precision of the bucket `value` is in.
+    pub fn count_at_or_below(&self, value: u64) -> u64 {
+        self.buckets[..=Histogram::bucket_of(value)].iter().sum()
+    }
+
+    /// The value at a quantile, like 0.99, to within the histogram's precision.
+    /// Reported as the top of its bucket, so it errs on the high side.
+    pub fn value_at_quantile(&self, quantile: f64) -> u64 {
+        let total: u64 = self.buckets.iter().sum();
+        let rank = ((quantile.clamp(0.0, 1.0) * total as f64).ceil() as u64).max(1);
+        let mut cumulative = 0;
+        for (bucket, count) in self.buckets.iter().enumerate() {
+            cumulative += count;
+            if cumulative >= rank {
+                return Histogram::bucket_upper_bound(bucket).min(self.max);
+            }
+        }
+        self.max
+    }
+}
+
+/// Nanoseconds on the same clock as the kernel's `bpf_ktime_get_ns`,
+/// which is what event timestamps are in.
+pub(crate) fn monotonic_ns() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
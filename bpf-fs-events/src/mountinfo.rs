@@ -0,0 +1,95 @@
+use std::ffi::OsString;
+use std::os::unix::ffi::OsStringExt;
+use std::path::Path;
+use std::path::PathBuf;
+
+/// A mount, from a line of /proc/self/mountinfo.
+#[derive(Clone, Debug)]
+pub(crate) struct Mount {
+    /// As the probes give it, in `Event::mount_id`
+    pub(crate) id: u32,
+    /// Its superblock's device, in the kernel's encoding, as in 'sb->s_dev',
+    /// which isn't always what stat gives, as for btrfs subvolumes
+    pub(crate) dev: u32,
+    /// What of its filesystem is mounted, as in a bind mount. Events' paths
+    /// are relative to the filesystem, so they start with this.
+    pub(crate) root: PathBuf,
+    pub(crate) mount_point: PathBuf,
+}
+
+impl Mount {
+    /// Where `path`, which is under the mount point, is in the filesystem.
+    pub(crate) fn fs_path(&self, path: &Path) -> Option<PathBuf> {
+        let rest = path.strip_prefix(&self.mount_point).ok()?;
+        Some(join(&self.root, rest))
+    }
+}
+
+/// `rest` under `base`, without a trailing slash if there's no rest.
+pub(crate) fn join(base: &Path, rest: &Path) -> PathBuf {
+    match rest.as_os_str().is_empty() {
+        true => base.to_path_buf(),
+        false => base.join(rest),
+    }
+}
+
+/// The kernel's encoding of a device number, as the probes see it.
+fn kernel_dev(major: u32, minor: u32) -> u32 {
+    (major << 20) | minor
+}
+
+// Spaces, tabs, newlines and backslashes are written as \ooo
+fn unescape(field: &str) -> PathBuf {
+    let field = field.as_bytes();
+    let mut path = Vec::with_capacity(field.len());
+    let mut at = 0;
+    while at < field.len() {
+        let octal = field.get(at + 1..at + 4).filter(|_| field[at] == b'\\');
+        match octal.and_then(|o| u8::from_str_radix(std::str::from_utf8(o).ok()?, 8).ok()) {
+            Some(byte) => {
+                path.push(byte);
+                at += 4;
+            }
+            None => {
+                path.push(field[at]);
+                at += 1;
+            }
+        }
+    }
+    PathBuf::from(OsString::from_vec(path))
+}
+
+fn parse(line: &str) -> Option<Mount> {
+    let mut fields = line.split(' ');
+    let id = fields.next()?.parse().ok()?;
+    let _parent = fields.next()?;
+    let (major, minor) = fields.next()?.split_once(':')?;
+    Some(Mount {
+        id,
+        dev: kernel_dev(major.parse().ok()?, minor.parse().ok()?),
+        root: unescape(fields.next()?),
+        mount_point: unescape(fields.next()?),
+    })
+}
+
+/// Our mount namespace's mounts, in the order they were mounted.
+pub(crate) fn mounts() -> Result<Vec<Mount>, std::io::Error> {
+    let mountinfo = std::fs::read_to_string("/proc/self/mountinfo")?;
+    Ok(mountinfo.lines().filter_map(parse).collect())
+}
+
+/// What's mounted at `path`, if anything is. Of mounts over the same
+/// mount point, the last is the one on top.
+pub(crate) fn mounted_at<'a>(mounts: &'a [Mount], path: &Path) -> Option<&'a Mount> {
+    mounts.iter().rev().find(|mount| mount.mount_point == path)
+}
+
+/// The mount `path` is on: of those whose mount points it's under, the deepest,
+/// and of mounts over the same mount point, the last.
+pub(crate) fn mount_of<'a>(mounts: &'a [Mount], path: &Path) -> Option<&'a Mount> {
+    let under = mounts
+        .iter()
+        .filter(|mount| path.starts_with(&mount.mount_point));
+    // Which is the last of the deepest
+    under.max_by_key(|mount| mount.mount_point.components().count())
+}
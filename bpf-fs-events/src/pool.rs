@@ -0,0 +1,86 @@
+use crate::event::Event;
+use std::sync::Arc;
+use std::sync::Mutex;
+
+/// How many spare paths a reader keeps, at most. Enough for every event
+/// a consumer could reasonably be holding on to; past that, they're freed.
+pub const PATH_POOL_CAPACITY: usize = 4096;
+
+// Most paths fit, so they rarely grow once they're in circulation
+const PATH_CAPACITY: usize = 256;
+
+/// Spare path buffers, one free list per reader. Events are decoded into paths
+/// taken from here, and `PooledEvent`s put theirs back when they're dropped,
+/// so once enough are in circulation, decoding an event allocates nothing.
+pub(crate) struct PathPool {
+    free: Mutex<Vec<String>>,
+}
+
+impl PathPool {
+    pub(crate) fn new() -> Self {
+        Self {
+            free: Mutex::new(Vec::with_capacity(PATH_POOL_CAPACITY)),
+        }
+    }
+
+    pub(crate) fn take(&self) -> String {
+        match self.free.lock().unwrap().pop() {
+            Some(path) => path,
+            None => String::with_capacity(PATH_CAPACITY),
+        }
+    }
+
+    pub(crate) fn put(&self, mut path: String) {
+        // Nothing to reuse, as for paths taken out by `PooledEvent::into_inner`
+        if path.capacity() == 0 {
+            return;
+        }
+        path.clear();
+        let mut free = self.free.lock().unwrap();
+        if free.len() < PATH_POOL_CAPACITY {
+            free.push(path);
+        }
+    }
+}
+
+/// An event whose paths go back to its reader's pool when it's dropped, for the
+/// next event to be decoded into. It can be sent to and dropped on any thread.
+/// `into_inner` gives up the paths for good, if the event is to be kept.
+pub struct PooledEvent {
+    event: Event,
+    pool: Arc<PathPool>,
+}
+
+impl PooledEvent {
+    pub(crate) fn new(event: Event, pool: Arc<PathPool>) -> Self {
+        Self { event, pool }
+    }
+
+    pub fn into_inner(mut self) -> Event {
+        let path_name = std::mem::take(&mut self.event.path_name);
+        let associated = self.event.associated.take();
+        // What's left has nothing on the heap to copy
+        Event {
+            path_name,
+            associated,
+            ..self.event.clone()
+        }
+    }
+}
+
+impl std::ops::Deref for PooledEvent {
+    type Target = Event;
+
+    fn deref(&self) -> &Event {
+        &self.event
+    }
+}
+
+impl Drop for PooledEvent {
+    fn drop(&mut self) {
+        self.pool.put(std::mem::take(&mut self.event.path_name));
+        if let Some(associated) = self.event.associated.take() {
+            self.pool.put(associated);
+        }
+    }
+}
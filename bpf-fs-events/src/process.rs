@@ -0,0 +1,123 @@
+use crate::event::RawEvent;
+use std::collections::HashMap;
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::sync::Mutex;
+
+/// How many processes we remember, at most.
+pub const PROCESS_CACHE_CAPACITY: usize = 4096;
+
+// Effect types of the lifecycle records in 'src/bpf/watcher.bpf.c'
+const ET_EXEC: u8 = 6;
+const ET_EXIT: u8 = 7;
+
+/// What we know about a process, from /proc, as of its last exec.
+#[derive(Clone, Debug)]
+pub struct ProcessInfo {
+    pub pid: u32,
+    /// None if it couldn't be read, as for kernel threads
+    pub exe: Option<PathBuf>,
+    pub cmdline: Vec<String>,
+}
+
+impl ProcessInfo {
+    fn read(pid: u32) -> Option<Self> {
+        let dir = PathBuf::from(format!("/proc/{pid}"));
+        // Without a cmdline, the process is gone (or never was)
+        let cmdline = std::fs::read(dir.join("cmdline")).ok()?;
+        let cmdline = cmdline
+            .split(|&b| b == 0)
+            .filter(|arg| !arg.is_empty())
+            .map(|arg| String::from_utf8_lossy(arg).into_owned())
+            .collect();
+        Some(Self {
+            pid,
+            exe: std::fs::read_link(dir.join("exe")).ok(),
+            cmdline,
+        })
+    }
+}
+
+#[derive(Default)]
+struct Entries {
+    by_pid: HashMap<u32, (Arc<ProcessInfo>, u64)>,
+    // Bumped on every use, for recency, and on every invalidation
+    tick: u64,
+    invalidations: u64,
+}
+
+/// Process metadata by pid, read lazily from /proc, at most once per process
+/// lifetime. Entries are dropped when the kernel tells us that their process
+/// exec'd or exited, in the same stream as the events, so an entry never
+/// outlives what it describes. Least recently used entries go first when full.
+pub struct ProcessCache {
+    entries: Mutex<Entries>,
+    capacity: usize,
+}
+
+impl ProcessCache {
+    pub(crate) fn new(capacity: usize) -> Self {
+        Self {
+            entries: Mutex::new(Entries::default()),
+            capacity,
+        }
+    }
+
+    /// The process, read from /proc if we haven't already.
+    /// None if it has already gone.
+    pub fn get(&self, pid: u32) -> Option<Arc<ProcessInfo>> {
+        let invalidations = {
+            let mut entries = self.entries.lock().unwrap();
+            entries.tick += 1;
+            let tick = entries.tick;
+            if let Some((info, used)) = entries.by_pid.get_mut(&pid) {
+                *used = tick;
+                return Some(info.clone());
+            }
+            entries.invalidations
+        };
+        // Not under the lock, it's a few syscalls
+        let info = Arc::new(ProcessInfo::read(pid)?);
+        let mut entries = self.entries.lock().unwrap();
+        // If anything exec'd or exited while we read, what we read may be stale
+        if entries.invalidations != invalidations {
+            return Some(info);
+        }
+        if entries.by_pid.len() >= self.capacity {
+            // A scan, but only on a miss, which costs a trip to /proc anyway
+            let oldest = entries.by_pid.iter().min_by_key(|(_, (_, used))| *used);
+            if let Some((&oldest, _)) = oldest {
+                entries.by_pid.remove(&oldest);
+            }
+        }
+        let tick = entries.tick;
+        entries.by_pid.insert(pid, (info.clone(), tick));
+        Some(info)
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.lock().unwrap().by_pid.len()
+    }
+
+    fn invalidate(&self, pid: u32) {
+        let mut entries = self.entries.lock().unwrap();
+        entries.invalidations += 1;
+        entries.by_pid.remove(&pid);
+    }
+
+    /// Takes the lifecycle records out of the stream. True if this was one.
+    pub(crate) fn take(&self, event: &RawEvent) -> bool {
+        match event.effect_type {
+            ET_EXEC | ET_EXIT => {
+                self.invalidate(event.pid);
+                true
+            }
+            _ => false,
+        }
+    }
+}
+
+/// The lifecycle programs have no variants, and are only loaded for a cache.
+pub(crate) fn is_lifecycle_prog(name: &str) -> bool {
+    name.starts_with("tp__")
+}
@@ -0,0 +1,126 @@
+use std::os::fd::AsRawFd;
+use std::os::fd::BorrowedFd;
+use std::os::fd::FromRawFd;
+use std::os::fd::OwnedFd;
+
+// From 'include/uapi/linux/bpf.h'
+const BPF_PROG_GET_FD_BY_ID: libc::c_long = 13;
+const BPF_OBJ_GET_INFO_BY_FD: libc::c_long = 15;
+const BPF_ENABLE_STATS: libc::c_long = 32;
+const BPF_STATS_RUN_TIME: u32 = 0;
+
+/// How often one of our programs has run, and for how long in total,
+/// as counted by the kernel while run-time stats are enabled.
+#[derive(Clone, Debug)]
+pub struct ProgStats {
+    pub name: String,
+    pub run_cnt: u64,
+    pub run_time_ns: u64,
+    /// Runs skipped because the program was already running on that CPU
+    pub recursion_misses: u64,
+}
+
+impl ProgStats {
+    pub fn ns_per_run(&self) -> u64 {
+        self.run_time_ns.checked_div(self.run_cnt).unwrap_or(0)
+    }
+}
+
+// The front of 'struct bpf_prog_info', up to the fields we want.
+// The kernel copies out only as much as we ask for.
+#[repr(C)]
+#[derive(Default)]
+struct ProgInfo {
+    _head: [u64; 24],
+    run_time_ns: u64,
+    run_cnt: u64,
+    recursion_misses: u64,
+}
+
+// The front of 'struct bpf_link_info'
+#[repr(C)]
+#[derive(Default)]
+struct LinkInfo {
+    link_type: u32,
+    id: u32,
+    prog_id: u32,
+    _pad: u32,
+}
+
+// The parts of 'union bpf_attr' for the commands we use
+#[repr(C)]
+struct EnableStatsAttr {
+    stats_type: u32,
+}
+
+#[repr(C)]
+struct GetFdByIdAttr {
+    id: u32,
+    next_id: u32,
+    open_flags: u32,
+}
+
+#[repr(C)]
+struct InfoAttr {
+    bpf_fd: u32,
+    info_len: u32,
+    info: u64,
+}
+
+fn bpf<T>(cmd: libc::c_long, attr: &mut T) -> libc::c_long {
+    let size = std::mem::size_of::<T>();
+    unsafe { libc::syscall(libc::SYS_bpf, cmd, attr as *mut T, size) }
+}
+
+/// Turns on the kernel's run-time stats for every BPF program, for as long
+/// as the returned fd is open. They cost a couple of clock reads per run,
+/// which is why they're off unless someone asks.
+pub(crate) fn enable() -> Result<OwnedFd, std::io::Error> {
+    let mut attr = EnableStatsAttr {
+        stats_type: BPF_STATS_RUN_TIME,
+    };
+    match bpf(BPF_ENABLE_STATS, &mut attr) {
+        fd if fd < 0 => Err(std::io::Error::last_os_error()),
+        fd => Ok(unsafe { OwnedFd::from_raw_fd(fd as i32) }),
+    }
+}
+
+fn get_info<T>(fd: BorrowedFd<'_>, info: &mut T) -> Result<(), std::io::Error> {
+    let mut attr = InfoAttr {
+        bpf_fd: fd.as_raw_fd() as u32,
+        info_len: std::mem::size_of::<T>() as u32,
+        info: info as *mut T as u64,
+    };
+    match bpf(BPF_OBJ_GET_INFO_BY_FD, &mut attr) {
+        err if err < 0 => Err(std::io::Error::last_os_error()),
+        _ => Ok(()),
+    }
+}
+
+pub(crate) fn read(name: &str, prog: BorrowedFd<'_>) -> Result<ProgStats, std::io::Error> {
+    let mut info = ProgInfo::default();
+    get_info(prog, &mut info)?;
+    Ok(ProgStats {
+        name: name.to_string(),
+        run_cnt: info.run_cnt,
+        run_time_ns: info.run_time_ns,
+        recursion_misses: info.recursion_misses,
+    })
+}
+
+/// For a program we only hold a link to, like one adopted from a pin.
+pub(crate) fn read_linked(name: &str, link: BorrowedFd<'_>) -> Result<ProgStats, std::io::Error> {
+    use std::os::fd::AsFd;
+    let mut info = LinkInfo::default();
+    get_info(link, &mut info)?;
+    let mut attr = GetFdByIdAttr {
+        id: info.prog_id,
+        next_id: 0,
+        open_flags: 0,
+    };
+    let prog = match bpf(BPF_PROG_GET_FD_BY_ID, &mut attr) {
+        fd if fd < 0 => return Err(std::io::Error::last_os_error()),
+        fd => unsafe { OwnedFd::from_raw_fd(fd as i32) },
+    };
+    read(name, prog.as_fd())
+}
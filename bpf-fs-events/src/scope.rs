@@ -0,0 +1,132 @@
+use libbpf_rs::MapFlags;
+use libbpf_rs::MapHandle;
+use std::os::fd::AsRawFd;
+use std::os::fd::FromRawFd;
+use std::os::fd::OwnedFd;
+use std::os::unix::fs::MetadataExt;
+use std::path::PathBuf;
+
+/// Only watch some processes, like a pod's, rather than the whole host.
+/// Filtered in the kernel, before any path is walked, so that everyone
+/// else's activity costs next to nothing. Empty lists don't filter.
+#[derive(Clone, Debug, Default)]
+pub struct Scope {
+    /// cgroup (v2) directories, like those under /sys/fs/cgroup/kubepods.slice.
+    /// Processes in their descendants are in scope too.
+    pub cgroups: Vec<PathBuf>,
+    /// Mount namespaces, like /proc/<pid>/ns/mnt
+    pub mount_namespaces: Vec<PathBuf>,
+    /// Processes, like a build job, and everything they fork from now on
+    /// or have already forked. Needs a 5.11+ kernel. Threads which already
+    /// exist, other than each process's main thread, aren't in scope.
+    pub process_trees: Vec<u32>,
+    /// Paths from each process's own root, as a container sees them, walked
+    /// through the mounts on the way, as for volumes, rather than from the
+    /// root of the filesystem they're on. Creations are then reported as
+    /// they're opened, where the kernel says which mount they're on, so
+    /// those made by mknod(2) of a regular file aren't.
+    pub relative_paths: bool,
+}
+
+impl Scope {
+    pub fn is_host(&self) -> bool {
+        self.cgroups.is_empty()
+            && self.mount_namespaces.is_empty()
+            && self.process_trees.is_empty()
+            && !self.relative_paths
+    }
+}
+
+// A cgroup's id is its directory's inode number, and a namespace's is its nsfs inode's
+fn id_of(path: &PathBuf) -> Result<u64, std::io::Error> {
+    Ok(std::fs::metadata(path)?.ino())
+}
+
+pub(crate) fn clear(map: &MapHandle) -> Result<(), libbpf_rs::Error> {
+    let keys: Vec<Vec<u8>> = map.keys().collect();
+    for key in keys {
+        map.delete(&key)?;
+    }
+    Ok(())
+}
+
+/// Fills the scope maps, replacing whatever a previous owner of pinned maps left.
+pub(crate) fn fill(
+    scope: &Scope,
+    cgroups: &MapHandle,
+    mntns: &MapHandle,
+) -> Result<(), Box<dyn std::error::Error>> {
+    clear(cgroups)?;
+    clear(mntns)?;
+    for path in &scope.cgroups {
+        let id = id_of(path)?;
+        cgroups.update(&id.to_ne_bytes(), &[1], MapFlags::ANY)?;
+        log::info!("watching cgroup {} ({id})", path.display());
+    }
+    for path in &scope.mount_namespaces {
+        let id = id_of(path)? as u32;
+        mntns.update(&id.to_ne_bytes(), &[1], MapFlags::ANY)?;
+        log::info!("watching mount namespace {} ({id})", path.display());
+    }
+    Ok(())
+}
+
+/// The fork program, which passes the process tree flag on
+pub(crate) fn is_fork_prog(name: &str) -> bool {
+    name.starts_with("tp_btf__")
+}
+
+// As the 4th field of /proc/<pid>/stat, after the comm, which can have anything in it
+fn ppid_of(stat: &str) -> Option<u32> {
+    let (_, after_comm) = stat.rsplit_once(')')?;
+    after_comm.split_whitespace().nth(1)?.parse().ok()
+}
+
+/// The roots, and every process under them, as of now.
+fn process_trees(roots: &[u32]) -> Vec<u32> {
+    let mut children: std::collections::HashMap<u32, Vec<u32>> = Default::default();
+    for entry in std::fs::read_dir("/proc").into_iter().flatten().flatten() {
+        let Some(pid) = entry.file_name().to_str().and_then(|s| s.parse().ok()) else {
+            continue;
+        };
+        let stat = std::fs::read_to_string(entry.path().join("stat")).unwrap_or_default();
+        if let Some(ppid) = ppid_of(&stat) {
+            children.entry(ppid).or_default().push(pid);
+        }
+    }
+    let mut tree = roots.to_vec();
+    let mut next = 0;
+    while next < tree.len() {
+        if let Some(kids) = children.get(&tree[next]) {
+            tree.extend(kids);
+        }
+        next += 1;
+    }
+    tree
+}
+
+/// Flags the process trees' tasks. The task storage map is keyed by pidfd from here.
+/// Done after the fork program is attached, so that no fork in between is missed,
+/// and until then, nothing is in scope. The flags of a previous owner of pinned
+/// maps can't be cleared (there's no iterating over task storage), but they
+/// go with the tasks they're on.
+pub(crate) fn flag_process_trees(
+    roots: &[u32],
+    tasks: &MapHandle,
+) -> Result<(), Box<dyn std::error::Error>> {
+    for pid in process_trees(roots) {
+        let fd = unsafe { libc::syscall(libc::SYS_pidfd_open, pid, 0) };
+        if fd < 0 {
+            let err = std::io::Error::last_os_error();
+            // Gone since we looked, unless it's one we were asked for
+            if roots.contains(&pid) {
+                return Err(format!("can't watch process {pid}: {err}").into());
+            }
+            continue;
+        }
+        let fd = unsafe { OwnedFd::from_raw_fd(fd as i32) };
+        tasks.update(&fd.as_raw_fd().to_ne_bytes(), &[1], MapFlags::ANY)?;
+    }
+    log::info!("watching the process trees under {roots:?}");
+    Ok(())
+}
@@ -0,0 +1,107 @@
+use libbpf_rs::MapFlags;
+use libbpf_rs::MapHandle;
+use std::os::fd::AsFd;
+use std::os::fd::AsRawFd;
+use std::path::Path;
+
+// Keep these in sync with 'src/bpf/watcher.bpf.c'
+const CONSUMERS_MAX: u32 = 8;
+const RING_BYTES: u32 = 1 << 22;
+
+/// Held while we set up, join, leave or tear down the shared probes,
+/// so that two of us never load them twice, or take the same slot.
+/// bpffs won't hold a regular file, but a directory locks just as well.
+pub(crate) struct DirLock(#[allow(dead_code)] std::fs::File);
+
+impl DirLock {
+    pub(crate) fn take(dir: &Path) -> Result<Self, std::io::Error> {
+        std::fs::create_dir_all(dir)?;
+        let dir = std::fs::File::open(dir)?;
+        match unsafe { libc::flock(dir.as_raw_fd(), libc::LOCK_EX) } {
+            0 => Ok(Self(dir)),
+            _ => Err(std::io::Error::last_os_error()),
+        }
+    }
+}
+
+/// Our slot among the shared probes' consumers, and the ring they copy our events into.
+pub(crate) struct Consumer {
+    slot: u32,
+    pub(crate) ring: MapHandle,
+}
+
+fn pid_in(pids: &MapHandle, slot: u32) -> u32 {
+    match pids.lookup(&slot.to_ne_bytes(), MapFlags::ANY) {
+        Ok(Some(pid)) => pid
+            .get(..4)
+            .map_or(0, |pid| u32::from_ne_bytes(pid.try_into().unwrap())),
+        _ => 0,
+    }
+}
+
+fn alive(pid: u32) -> bool {
+    match unsafe { libc::kill(pid as libc::pid_t, 0) } {
+        0 => true,
+        _ => std::io::Error::last_os_error().raw_os_error() != Some(libc::ESRCH),
+    }
+}
+
+/// Frees the slots of consumers who went away without leaving.
+/// Their rings would otherwise be filled, and kept around, forever.
+fn reap(consumers: &MapHandle, pids: &MapHandle) -> Result<(), libbpf_rs::Error> {
+    for slot in 0..CONSUMERS_MAX {
+        let pid = pid_in(pids, slot);
+        if pid != 0 && !alive(pid) {
+            log::info!("reaping consumer slot {slot} of pid {pid}");
+            let _ = consumers.delete(&slot.to_ne_bytes());
+            pids.update(&slot.to_ne_bytes(), &0u32.to_ne_bytes(), MapFlags::ANY)?;
+        }
+    }
+    Ok(())
+}
+
+/// Takes a free slot, and gives the probes a ring of our own to write to.
+pub(crate) fn join(
+    consumers: &MapHandle,
+    pids: &MapHandle,
+) -> Result<Consumer, Box<dyn std::error::Error>> {
+    reap(consumers, pids)?;
+    let slot = (0..CONSUMERS_MAX)
+        .find(|slot| pid_in(pids, *slot) == 0)
+        .ok_or("every consumer slot is taken")?;
+    let opts = libbpf_sys::bpf_map_create_opts {
+        sz: std::mem::size_of::<libbpf_sys::bpf_map_create_opts>() as _,
+        ..Default::default()
+    };
+    let ring = MapHandle::create(
+        libbpf_rs::MapType::RingBuf,
+        Some("consumer_ring"),
+        0,
+        0,
+        RING_BYTES,
+        &opts,
+    )?;
+    let ring_fd = ring.as_fd().as_raw_fd() as u32;
+    consumers.update(&slot.to_ne_bytes(), &ring_fd.to_ne_bytes(), MapFlags::ANY)?;
+    pids.update(
+        &slot.to_ne_bytes(),
+        &std::process::id().to_ne_bytes(),
+        MapFlags::ANY,
+    )?;
+    log::info!("joined shared probes as consumer {slot}");
+    Ok(Consumer { slot, ring })
+}
+
+impl Consumer {
+    /// Gives up our slot. True if nobody is left reading.
+    pub(crate) fn leave(
+        &self,
+        consumers: &MapHandle,
+        pids: &MapHandle,
+    ) -> Result<bool, libbpf_rs::Error> {
+        let _ = consumers.delete(&self.slot.to_ne_bytes());
+        pids.update(&self.slot.to_ne_bytes(), &0u32.to_ne_bytes(), MapFlags::ANY)?;
+        reap(consumers, pids)?;
+        Ok((0..CONSUMERS_MAX).all(|slot| pid_in(pids, slot) == 0))
+    }
+}
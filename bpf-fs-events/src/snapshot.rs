@@ -0,0 +1,247 @@
+use crate::crawl::SnapshotEntry;
+use crate::event::Event;
+use crate::mountinfo::Mount;
+use crate::FsEvents;
+use std::collections::BTreeMap;
+use std::collections::HashSet;
+use std::path::Path;
+use std::path::PathBuf;
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::Ordering;
+
+// How long to wait on the kernel between checks on the crawl
+const POLL_TIMEOUT: std::time::Duration = std::time::Duration::from_millis(10);
+
+// How long events from before the listing may take to come in once it's done,
+// from the probes which had timestamped them but not yet sent them
+const SETTLE: std::time::Duration = std::time::Duration::from_millis(10);
+
+/// What to take a snapshot of, and how.
+#[derive(Clone, Debug)]
+pub struct SnapshotOptions {
+    /// Directories (or anything else) to list everything under, as we see them.
+    /// Events' paths are relative to their filesystems, and are matched against
+    /// these through our mounts.
+    pub roots: Vec<PathBuf>,
+    /// Threads crawling, at least one
+    pub threads: usize,
+    /// Don't cross into other filesystems, which are likely somebody else's
+    pub same_filesystem: bool,
+}
+
+impl Default for SnapshotOptions {
+    fn default() -> Self {
+        Self {
+            roots: Vec::new(),
+            threads: std::thread::available_parallelism().map_or(4, |n| n.get()),
+            same_filesystem: false,
+        }
+    }
+}
+
+/// A listing of some trees which the event stream carries on from: everything
+/// up to `taken_at` is in it, and every event after is yet to be polled.
+/// Events just after it may already be in the listing, as the trees were
+/// still being looked at then, so they're to be applied idempotently: a
+/// creation of something which is there, or a deletion of something which
+/// isn't, changes nothing.
+pub struct Snapshot {
+    /// Every path under the roots, and the roots, by path
+    pub entries: BTreeMap<String, SnapshotEntry>,
+    /// When the listing is as of, on the same clock as `Event::timestamp`
+    pub taken_at: u64,
+    /// Events taken from the stream while we crawled which had nothing to do with
+    /// the roots, by timestamp, for whoever would have polled them otherwise.
+    /// The rest are in `entries`.
+    pub events: Vec<Event>,
+    /// Paths we couldn't read, other than those which went away as we crawled
+    pub errors: u64,
+}
+
+fn is_under(path: &str, roots: &[PathBuf]) -> bool {
+    roots.iter().any(|root| Path::new(path).starts_with(root))
+}
+
+/// One of the roots, or a mount under one, as its filesystem has it, which is
+/// how events' paths are given: a bind mount of /srv/data at /data is /srv/data.
+struct View {
+    /// As the roots are given, which is how the snapshot's paths are
+    path: PathBuf,
+    dev: u32,
+    fs_path: PathBuf,
+}
+
+/// The roots, and if we're to cross into other filesystems, the mounts under them.
+/// Roots which don't exist have none, as they aren't crawled either.
+fn views(mounts: &[Mount], roots: &[PathBuf], same_filesystem: bool) -> Vec<View> {
+    let mut views = Vec::new();
+    for root in roots {
+        let Ok(real) = std::fs::canonicalize(root) else {
+            continue;
+        };
+        let Some(mount) = crate::mountinfo::mount_of(mounts, &real) else {
+            continue;
+        };
+        if let Some(fs_path) = mount.fs_path(&real) {
+            let path = root.clone();
+            views.push(View {
+                path,
+                dev: mount.dev,
+                fs_path,
+            });
+        }
+        if same_filesystem {
+            continue;
+        }
+        for mount in mounts {
+            if let Ok(rest) = mount.mount_point.strip_prefix(&real) {
+                if !rest.as_os_str().is_empty() {
+                    views.push(View {
+                        path: crate::mountinfo::join(root, rest),
+                        dev: mount.dev,
+                        fs_path: mount.root.clone(),
+                    });
+                }
+            }
+        }
+    }
+    views
+}
+
+/// Where an event's path may be under the roots, on the filesystem of `dev`, or
+/// on any, as when the probe didn't know the mount, or it was mounted after we
+/// looked. A path can be in more than one place; it's taken to be in each, as
+/// what that costs is a recrawl.
+fn seen_at(path: &str, dev: Option<u32>, views: &[View], seen: &mut HashSet<PathBuf>) -> bool {
+    let mut any = false;
+    for view in views {
+        if dev.is_some_and(|dev| dev != view.dev) {
+            continue;
+        }
+        if let Ok(rest) = Path::new(path).strip_prefix(&view.fs_path) {
+            seen.insert(crate::mountinfo::join(&view.path, rest));
+            any = true;
+        }
+    }
+    any
+}
+
+fn path_key(path: PathBuf) -> String {
+    match path.into_os_string().into_string() {
+        Ok(path) => path,
+        // As paths from the kernel are
+        Err(path) => path.to_string_lossy().into_owned(),
+    }
+}
+
+/// Removes `path`, and everything under it. Keyed as the entries are, by `path_key`.
+fn remove_tree(entries: &mut BTreeMap<String, SnapshotEntry>, path: &str) {
+    // Which isn't a path, and would be taken for the root of everything
+    if path.is_empty() {
+        return;
+    }
+    entries.remove(path);
+    let prefix = match path.ends_with('/') {
+        true => path.to_string(),
+        false => format!("{path}/"),
+    };
+    let under: Vec<String> = entries
+        .range(prefix.clone()..)
+        .take_while(|(key, _)| key.starts_with(&prefix))
+        .map(|(key, _)| key.clone())
+        .collect();
+    for key in under {
+        entries.remove(&key);
+    }
+}
+
+/// Starts crawling, with the stream already running, and polls it meanwhile,
+/// so that the kernel's buffers don't fill. Everything the stream said about
+/// the roots until the crawl finished is looked at again, once it has.
+pub(crate) fn take(
+    watcher: &FsEvents,
+    opts: &SnapshotOptions,
+) -> Result<Snapshot, Box<dyn std::error::Error>> {
+    // As they are before the crawl. Events on any mounted since match on any filesystem.
+    let mounts = crate::mountinfo::mounts()?;
+    let views = views(&mounts, &opts.roots, opts.same_filesystem);
+    let mut events = Vec::new();
+    let done = AtomicBool::new(false);
+    let crawled = std::thread::scope(|scope| {
+        let done = &done;
+        let crawler = scope.spawn(move || {
+            let crawled = crate::crawl::crawl(&opts.roots, opts.threads, opts.same_filesystem);
+            done.store(true, Ordering::Release);
+            crawled
+        });
+        while !done.load(Ordering::Acquire) {
+            match watcher.poll_with_timeout(POLL_TIMEOUT) {
+                Ok(Some(event)) => events.push(event),
+                Ok(None) => (),
+                // The crawl carries on, but there's no stream left to stitch it to
+                Err(e) => return Err(format!("polling while crawling: {e:?}")),
+            }
+        }
+        Ok(crawler.join().unwrap())
+    })?;
+    let taken_at = crate::metrics::monotonic_ns();
+    // Whatever else the kernel had for us from before we were done, but not after
+    let through = watcher.take_through(taken_at, SETTLE);
+    events.extend(through.map_err(std::io::Error::from)?);
+    // Those polled while we crawled came in a CPU's buffer at a time
+    events.sort_by_key(|event| event.timestamp);
+    let mut entries: BTreeMap<String, SnapshotEntry> = crawled
+        .entries
+        .into_iter()
+        .map(|(path, entry)| (path_key(path), entry))
+        .collect();
+    // The crawl may have seen these paths before or after the events did,
+    // so they're looked at again, with anything under them
+    let mut stale: HashSet<PathBuf> = HashSet::new();
+    let mut touched = 0;
+    let events: Vec<Event> = events
+        .into_iter()
+        .filter(|event| {
+            let dev = match event.mount_id {
+                0 => None,
+                id => mounts
+                    .iter()
+                    .find(|mount| mount.id == id)
+                    .map(|mount| mount.dev),
+            };
+            let path = seen_at(&event.path_name, dev, &views, &mut stale);
+            let associated =
+                (event.associated.as_ref()).is_some_and(|to| seen_at(to, dev, &views, &mut stale));
+            touched += (path || associated) as usize;
+            !(path || associated)
+        })
+        .collect();
+    let outermost: Vec<PathBuf> = stale
+        .iter()
+        .filter(|path| !path.ancestors().skip(1).any(|a| stale.contains(a)))
+        .cloned()
+        .collect();
+    for path in &outermost {
+        remove_tree(&mut entries, &path_key(path.clone()));
+    }
+    let recrawled = crate::crawl::crawl(&outermost, opts.threads, opts.same_filesystem);
+    for (path, entry) in recrawled.entries {
+        let key = path_key(path);
+        // Outside the roots, if an event moved something out from under them
+        if is_under(&key, &opts.roots) {
+            entries.insert(key, entry);
+        }
+    }
+    log::info!(
+        "snapshot of {} paths, with {} events during the crawl, {} of them under the roots",
+        entries.len(),
+        touched + events.len(),
+        touched
+    );
+    Ok(Snapshot {
+        entries,
+        taken_at,
+        events,
+        errors: crawled.errors + recrawled.errors,
+    })
+}